@@ -1,7 +1,43 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <memory>
+#include <memory_resource>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <queue>
+#include <deque>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <filesystem>
 #include <sqlite3.h>
+#ifdef __unix__
+#include <unistd.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#endif
 
 using namespace std;
 
@@ -9,6 +45,34 @@ using namespace std;
 #define RENT_DAYS_ALLOWED 7
 #define RENT_PER_DAY 100
 #define EMPLOYEE_DISCOUNT 0.15
+#define HOLD_SECONDS 120 // How long a car stays reserved during checkout
+#define SCHEMA_VERSION 8 // Stored in PRAGMA user_version once the tables are set up
+
+// Column positions of rows in the cars table
+enum CarColumn
+{
+    CAR_ID,
+    CAR_MODEL,
+    CAR_YEAR,
+    CAR_AVAILABLE,
+    CAR_RENTED_BY,
+    CAR_RENTED_ON,
+    CAR_CONDITION,
+    CAR_X, // Location on the lot map
+    CAR_Y
+};
+
+// Column positions of rows in the customers and employees tables
+enum AccountColumn
+{
+    ACCOUNT_ID,
+    ACCOUNT_NAME,
+    ACCOUNT_MONEY,
+    ACCOUNT_RENTED_CARS,
+    ACCOUNT_FINE_DUE,
+    ACCOUNT_RECORD,
+    ACCOUNT_PASSWORD
+};
 
 bool askConfirmation(const string &message)
 {
@@ -17,6 +81,8 @@ bool askConfirmation(const string &message)
     cin >> choice;
     cin.ignore(); // Consume newline character
     while(tolower(choice) != 'y' && tolower(choice) != 'n'){
+        if (!cin)
+            return false; // Input ended
         cout << "Invalid input. Please enter y or n: ";
         cin >> choice;
         cin.ignore(); // Consume newline character
@@ -24,1125 +90,8557 @@ bool askConfirmation(const string &message)
     return tolower(choice) == 'y';
 }
 
-class Db
+// 64-bit FNV-1a hash; pass the previous result as hash to continue it over more data
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 14695981039346656037ULL)
 {
-protected:
-    string tablename;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
 
-    Db()
+// Fixed-size pool of worker threads used to fan queries out across shards
+class ThreadPool
+{
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex lock;
+    condition_variable cv;
+    bool stopping = false;
+
+public:
+    ThreadPool(size_t n = thread::hardware_concurrency())
     {
-        sqlite3 *db;
-        if (connectToDatabase(&db))
+        if (n == 0)
+            n = 2;
+        for (size_t i = 0; i < n; i++)
         {
-            cout << "Database  connection successful." << endl;
+            workers.emplace_back([this]
+                                 {
+                while (true)
+                {
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> guard(lock);
+                        cv.wait(guard, [this] { return stopping || !tasks.empty(); });
+                        if (stopping && tasks.empty())
+                            return;
+                        task = move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                } });
         }
     }
 
-    bool isTableEmpty(sqlite3 *db, string &table_name)
+    ~ThreadPool()
     {
-
-        string sql = "SELECT 1 FROM " + table_name + ";";
-
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
         {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            return false;
+            lock_guard<mutex> guard(lock);
+            stopping = true;
         }
-
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        cv.notify_all();
+        for (thread &worker : workers)
         {
-            sqlite3_finalize(stmt);
-            return true;
+            worker.join();
         }
-
-        sqlite3_finalize(stmt);
-        return false;
     }
 
-    // Function to create the database tables
-    void createTable(sqlite3 *db, string sql)
+    template <typename F>
+    auto submit(F f) -> future<decltype(f())>
     {
-        cout << "Creating table: " << tablename << endl;
-        // Execute statement and handle errors
-        char *errmsg;
-        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        auto task = make_shared<packaged_task<decltype(f())()>>(f);
+        future<decltype(f())> result = task->get_future();
         {
-            cerr << "Error creating " << tablename << " table: " << errmsg << endl;
-            sqlite3_free(errmsg);
+            lock_guard<mutex> guard(lock);
+            tasks.push([task]
+                       { (*task)(); });
         }
+        cv.notify_one();
+        return result;
     }
+};
 
+// Scratch memory for the command being handled. Rows and SQL text built while
+// a Scope is open come from a fixed per-thread buffer and are all released at
+// once when the outermost Scope closes; outside a Scope the heap is used.
+// Blocks freed during the command are pooled and handed out again, so a long
+// command that reads row after row stays within the buffer.
+class RequestArena
+{
 public:
-    // Function to connect to db and check if the database connection is successful
-    static bool connectToDatabase(sqlite3 **db)
+    // Passes allocations on to upstream, counting them
+    class Counter : public pmr::memory_resource
     {
-        int rc = sqlite3_open(FILENAME, db);
-        if (rc != SQLITE_OK)
+    private:
+        pmr::memory_resource *upstream;
+
+        void *do_allocate(size_t bytes, size_t alignment) override
         {
-            cerr << "Error opening database: " << sqlite3_errmsg(*db) << endl;
-            return false;
+            allocations++;
+            return upstream->allocate(bytes, alignment);
         }
-        return true;
-    }
 
-    void deleteRecord(int id, sqlite3 *db = nullptr)
-    {
-        if (db == nullptr)
+        void do_deallocate(void *memory, size_t bytes, size_t alignment) override
         {
-            if (!connectToDatabase(&db))
-                return;
+            upstream->deallocate(memory, bytes, alignment);
         }
-        if (search(id, db))
+
+        bool do_is_equal(const pmr::memory_resource &other) const noexcept override
         {
-            string sql = "DELETE FROM " + tablename + " WHERE id = ?;";
+            return this == &other;
+        }
 
-            sqlite3_stmt *stmt;
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-            {
-                cerr << "Error preparing statement for deleting: " << sqlite3_errmsg(db) << endl;
-                return;
-            }
+    public:
+        uint64_t allocations = 0;
 
-            // Bind the value of id to the prepared statement
-            sqlite3_bind_int(stmt, 1, id);
+        explicit Counter(pmr::memory_resource *upstream = pmr::new_delete_resource()) : upstream(upstream) {}
+    };
 
-            // Execute the statement
-            if (sqlite3_step(stmt) != SQLITE_DONE)
-            {
-                cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-                return;
-            }
-            cout << "Record with ID " << id << " deleted successfully." << endl;
-            sqlite3_finalize(stmt);
-        }else{
-            cout << "Record not found." << endl;
-        }
+private:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+    struct State
+    {
+        alignas(max_align_t) char buffer[BUFFER_SIZE];
+        Counter heap; // Used once the buffer is full
+        pmr::monotonic_buffer_resource monotonic{buffer, BUFFER_SIZE, &heap};
+        pmr::unsynchronized_pool_resource pool{&monotonic};
+        int depth = 0;
+    };
+
+    static State &state()
+    {
+        thread_local State current;
+        return current;
     }
 
-    bool search(int id, sqlite3 *db = nullptr)
+    static void *sqliteMalloc(int size)
     {
-        if (db == nullptr)
-        {
-            if (!connectToDatabase(&db))
-                return false;
-        }
-        string sql = "SELECT EXISTS (SELECT 1 FROM " + tablename + " WHERE id = ?);";
+        sqliteAllocations++;
+        return defaultMethods.xMalloc(size);
+    }
 
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    static void *sqliteRealloc(void *memory, int size)
+    {
+        sqliteAllocations++;
+        return defaultMethods.xRealloc(memory, size);
+    }
+
+    inline static sqlite3_mem_methods defaultMethods;
+
+public:
+    // Calls this thread has made to SQLite's allocator since it started
+    inline static thread_local uint64_t sqliteAllocations = 0;
+
+    class Scope
+    {
+    public:
+        Scope()
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            return false;
+            state().depth++;
         }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, id);
-
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        ~Scope()
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            return false;
+            State &current = state();
+            if (--current.depth == 0)
+            {
+                current.pool.release();
+                current.monotonic.release();
+            }
         }
 
-        // Check if EXISTS returned 1 (first column)
-        bool exists = sqlite3_column_int(stmt, 0) == 1;
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
 
-        sqlite3_finalize(stmt);
-        return exists;
+    static pmr::memory_resource *resource()
+    {
+        State &current = state();
+        return current.depth > 0 ? &current.pool : pmr::get_default_resource();
     }
 
-    static bool searchTable(int id, string table_name, sqlite3 *db = nullptr)
+    // Blocks this thread's arena has taken from the heap since it started
+    static uint64_t heapAllocations()
     {
-        if (db == nullptr)
-        {
-            if (!connectToDatabase(&db))
-                return false;
-        }
-        string sql = "SELECT EXISTS (SELECT 1 FROM " + table_name + " WHERE id = ?);";
+        return state().heap.allocations;
+    }
 
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    // Counts SQLite's allocations and gives it a preallocated page cache and
+    // lookaside. Must run before SQLite is first used.
+    static void configureSqlite()
+    {
+        if (sqlite3_config(SQLITE_CONFIG_GETMALLOC, &defaultMethods) == SQLITE_OK)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            return false;
+            sqlite3_mem_methods counting = defaultMethods;
+            counting.xMalloc = sqliteMalloc;
+            counting.xRealloc = sqliteRealloc;
+            sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
         }
+        // 512 slots of a 4 KiB page plus header; SQLite allocates the buffer itself
+        sqlite3_config(SQLITE_CONFIG_PAGECACHE, nullptr, 4096 + 128, 512);
+        sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 128, 512);
+    }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, id);
+    // Allocations counted over a run, divided over its operations
+    static void printPerOperation(uint64_t heap, uint64_t sqlite, int operations)
+    {
+        cout << (double)heap / operations << " heap + " << (double)sqlite / operations << " SQLite allocations per operation";
+    }
+};
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+// Row whose columns live in the request arena
+using ArenaRow = pmr::vector<pmr::string>;
+
+// Severity of a log entry
+enum LogLevel
+{
+    LEVEL_DEBUG,
+    LEVEL_INFO,
+    LEVEL_WARNING,
+    LEVEL_ERROR
+};
+
+// Diagnostics go to a log file instead of the terminal. Callers copy a fixed
+// size entry into a lock-free ring buffer (multiple producers, one consumer)
+// and return at once; a background thread formats the entries and appends
+// them to the file, starting a new file once it grows past maxFileBytes. When
+// the ring is full the entry is dropped and counted rather than blocking.
+class Log
+{
+public:
+    inline static atomic<int> minLevel{LEVEL_INFO};
+    inline static atomic<long long> maxFileBytes{1 << 20};
+    static constexpr int KEPT_FILES = 3; // file, file.1 and file.2
+
+    // Operation and id attached to entries logged on this thread while the
+    // context is open; contexts nest and an inner one without an id keeps
+    // the outer id
+    class Context
+    {
+    private:
+        const char *previousOperation;
+        int previousId;
+
+    public:
+        Context(const char *operation, int id = -1) : previousOperation(current().operation), previousId(current().id)
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            return false;
+            current().operation = operation;
+            current().id = id >= 0 ? id : previousId;
         }
 
-        // Check if EXISTS returned 1 (first column)
-        bool exists = sqlite3_column_int(stmt, 0) == 1;
+        ~Context()
+        {
+            current().operation = previousOperation;
+            current().id = previousId;
+        }
 
-        sqlite3_finalize(stmt);
-        return exists;
-    }
+        Context(const Context &) = delete;
+        Context &operator=(const Context &) = delete;
+    };
 
-    static void updateDues(int cusId, int money, int dues, string table)
+    static void write(LogLevel level, string_view message, string_view detail = {}, int code = 0)
     {
-        sqlite3 *db;
-        if (!connectToDatabase(&db))
+        if (level < minLevel)
             return;
-        string sql = "UPDATE " + table + " SET money = ?, fineDue = ? WHERE id = ?;";
+        Log &log = instance();
+        log.start();
 
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        // Claim a slot; a slot whose sequence is behind the claim is still being drained
+        size_t position = log.head.load(memory_order_relaxed);
+        Slot *slot;
+        while (true)
         {
-            cerr << "Error preparing statement for updating: " << sqlite3_errmsg(db) << endl;
-            return;
+            slot = &log.slots[position % CAPACITY];
+            long long lag = (long long)slot->sequence.load(memory_order_acquire) - (long long)position;
+            if (lag == 0)
+            {
+                if (log.head.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (lag < 0)
+            {
+                log.dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                position = log.head.load(memory_order_relaxed);
+            }
         }
 
-        // Bind the values of t to the prepared statement
-        sqlite3_bind_int(stmt, 1, money); // Money
-        sqlite3_bind_int(stmt, 2, dues);  // Dues
-        sqlite3_bind_int(stmt, 3, cusId); // ID
-
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+        Entry &entry = slot->entry;
+        entry.time = chrono::system_clock::now();
+        entry.level = level;
+        entry.id = current().id;
+        entry.code = code;
+        copyText(entry.operation, sizeof(entry.operation), current().operation == nullptr ? "-" : current().operation);
+        size_t length = copyText(entry.message, sizeof(entry.message), message);
+        if (!detail.empty())
         {
-            cerr << "Error updating customers: " << sqlite3_errmsg(db) << endl;
+            length += copyText(entry.message + length, sizeof(entry.message) - length, ": ");
+            copyText(entry.message + length, sizeof(entry.message) - length, detail);
         }
+        slot->sequence.store(position + 1, memory_order_release);
+    }
 
-        sqlite3_finalize(stmt);
+    static void error(string_view message, sqlite3 *db)
+    {
+        write(LEVEL_ERROR, message, sqlite3_errmsg(db), sqlite3_extended_errcode(db));
     }
-};
 
-class CarDb : public Db
-{
-private:
-    vector<vector<string>> defaultData = {
-        {"Lamborghini Aventador", "2023", "1", "-1", "-1", "100"},
-        {"Ferrari F8", "2022", "1", "-1", "-1", "100"},
-        {"Porsche 911", "2021", "1", "-1", "-1", "100"},
-        {"Koenigsegg Agera", "2021", "1", "-1", "-1", "100"},
-        {"Bugatti Veyron", "2020", "1", "-1", "-1", "100"},
-        {"Rolls Royce Spectre", "2019", "1", "-1", "-1", "100"}};
+    static void error(string_view message, const char *detail = nullptr)
+    {
+        write(LEVEL_ERROR, message, detail == nullptr ? "" : detail);
+    }
 
-    void load(sqlite3 *db)
+    static void warning(string_view message)
     {
-        if (isTableEmpty(db, tablename))
+        write(LEVEL_WARNING, message);
+    }
+
+    static void info(string_view message)
+    {
+        write(LEVEL_INFO, message);
+    }
+
+    // File written by the background thread; takes effect before its first entry
+    static void setFile(const string &file)
+    {
+        lock_guard<mutex> guard(instance().fileLock);
+        instance().path = file;
+    }
+
+    static void report()
+    {
+        Log &log = instance();
+        lock_guard<mutex> guard(log.fileLock);
+        cout << "Log file: " << log.path << " (level " << LEVEL_NAMES[minLevel] << ", new file after " << maxFileBytes << " bytes)" << endl;
+        cout << "Entries written: " << log.written << ", dropped: " << log.dropped << ", files started: " << log.rotations << endl;
+    }
+
+    static bool parseLevel(const string &name, int &level)
+    {
+        for (int i = LEVEL_DEBUG; i <= LEVEL_ERROR; i++)
         {
-            cout << "Loading cars..." << endl;
-            for (vector<string> data : defaultData)
+            if (name == LEVEL_NAMES[i])
             {
-                add(data, db);
+                level = i;
+                return true;
             }
         }
+        return false;
     }
 
-public:
-    CarDb()
+    ~Log()
     {
-        tablename = "cars";
-        sqlite3 *db;
-        connectToDatabase(&db);
-        string sql = "CREATE TABLE IF NOT EXISTS cars (id INTEGER PRIMARY KEY AUTOINCREMENT, model TEXT NOT NULL, year TEXT, available INTEGER NOT NULL DEFAULT 1, rentedBy INTEGER NOT NULL DEFAULT -1, rentedOn INTEGER NOT NULL DEFAULT -1, condition INTEGER NOT NULL DEFAULT 100 CHECK (condition >= 0 AND condition <= 100), FOREIGN KEY(rentedBy) REFERENCES customers(id) ON DELETE SET DEFAULT)";
-        // string sql_customers = "CREATE TABLE IF NOT EXISTS customers (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, password TEXT NOT NULL, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue DOUBLE NOT NULL DEFAULT 0, customerRecord DOUBLE NOT NULL DEFAULT 0)";
-        createTable(db, sql);
-        load(db);
+        if (!consumer.joinable())
+            return;
+        stopping = true;
+        consumer.join();
     }
 
-    static bool searchRentableCar(int id, sqlite3 *db = nullptr)
+private:
+    static constexpr size_t CAPACITY = 4096;
+    inline static const char *const LEVEL_NAMES[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+    struct Entry
     {
-        if (db == nullptr)
-        {
-            if (!connectToDatabase(&db))
-                return false;
-        }
-        string sql = "SELECT EXISTS (SELECT 1 FROM cars WHERE id = ? AND available=1);";
+        chrono::system_clock::time_point time;
+        LogLevel level;
+        int id;
+        int code;
+        char operation[32];
+        char message[216];
+    };
+
+    struct Slot
+    {
+        atomic<size_t> sequence;
+        Entry entry;
+    };
 
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    struct ThreadContext
+    {
+        const char *operation = nullptr;
+        int id = -1;
+    };
+
+    unique_ptr<Slot[]> slots;
+    atomic<size_t> head{0};
+    size_t tail = 0; // Only touched by the consumer
+    atomic<long long> dropped{0};
+    atomic<long long> written{0};
+    atomic<int> rotations{0};
+    atomic<bool> stopping{false};
+    once_flag started;
+    thread consumer;
+    mutex fileLock; // Guards path and file against setFile and report
+    string path = string(FILENAME) + ".log";
+    FILE *file = nullptr;
+    long long fileBytes = 0;
+
+    Log() : slots(new Slot[CAPACITY])
+    {
+        for (size_t i = 0; i < CAPACITY; i++)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            return false;
+            slots[i].sequence.store(i, memory_order_relaxed);
         }
+    }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, id);
+    static Log &instance()
+    {
+        static Log log;
+        return log;
+    }
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
-        {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            return false;
-        }
+    static ThreadContext &current()
+    {
+        thread_local ThreadContext context;
+        return context;
+    }
 
-        // Check if EXISTS returned 1 (first column)
-        bool exists = sqlite3_column_int(stmt, 0) == 1;
+    // Copies at most size - 1 bytes and terminates; returns the bytes copied
+    static size_t copyText(char *to, size_t size, string_view text)
+    {
+        if (size == 0)
+            return 0;
+        size_t length = min(text.size(), size - 1);
+        memcpy(to, text.data(), length);
+        to[length] = '\0';
+        return length;
+    }
 
-        sqlite3_finalize(stmt);
-        return exists;
+    void start()
+    {
+        call_once(started, [this]
+                  { consumer = thread([this]
+                                      { drain(); }); });
     }
 
-    static vector<string> searchCar(int id)
+    void drain()
     {
-        sqlite3 *db;
-        if (!connectToDatabase(&db))
-            return {};
-        string sql = "SELECT * FROM cars WHERE id = ?";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        while (true)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            bool stop = stopping;
+            int count = 0;
+            while (true)
+            {
+                Slot &slot = slots[tail % CAPACITY];
+                if (slot.sequence.load(memory_order_acquire) != tail + 1)
+                    break;
+                print(slot.entry);
+                slot.sequence.store(tail + CAPACITY, memory_order_release);
+                tail++;
+                count++;
+            }
+            if (count > 0)
+            {
+                lock_guard<mutex> guard(fileLock);
+                if (file != nullptr)
+                    fflush(file);
+            }
+            if (stop)
+                break;
+            if (count == 0)
+                this_thread::sleep_for(chrono::milliseconds(5));
         }
+        lock_guard<mutex> guard(fileLock);
+        if (file != nullptr)
+            fclose(file);
+        file = nullptr;
+    }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, id);
+    void print(const Entry &entry)
+    {
+        char stamp[32];
+        time_t seconds = chrono::system_clock::to_time_t(entry.time);
+        tm local;
+        localtime_r(&seconds, &local);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+        int millis = chrono::duration_cast<chrono::milliseconds>(entry.time.time_since_epoch()).count() % 1000;
+
+        char line[384];
+        int length = snprintf(line, sizeof(line), "%s.%03d %s op=%s", stamp, millis, LEVEL_NAMES[entry.level], entry.operation);
+        if (entry.id >= 0)
+            length += snprintf(line + length, sizeof(line) - length, " id=%d", entry.id);
+        if (entry.code != 0)
+            length += snprintf(line + length, sizeof(line) - length, " code=%d", entry.code);
+        length += snprintf(line + length, sizeof(line) - length, " msg=\"%s\"\n", entry.message);
+        length = min(length, (int)sizeof(line) - 1);
+
+        lock_guard<mutex> guard(fileLock);
+        if (file == nullptr || fileBytes + length > maxFileBytes)
+            openFile();
+        FILE *out = file == nullptr ? stderr : file;
+        fwrite(line, 1, length, out);
+        fileBytes += length;
+        written++;
+    }
 
-        // Execute the statement
+    // Starts a fresh file, shifting older ones to .1, .2, ...
+    void openFile()
+    {
+        if (file != nullptr)
+        {
+            fclose(file);
+            for (int i = KEPT_FILES - 1; i > 0; i--)
+            {
+                string from = i == 1 ? path : path + "." + to_string(i - 1);
+                rename(from.c_str(), (path + "." + to_string(i)).c_str());
+            }
+            rotations++;
+        }
+        file = fopen(path.c_str(), "a");
+        fileBytes = 0;
+        if (file != nullptr)
+        {
+            fseek(file, 0, SEEK_END);
+            fileBytes = ftell(file);
+        }
+    }
+};
+
+// Typed row of the cars table
+struct CarRow
+{
+    int id = -1;
+    string model;
+    string year;
+    int available = 0;
+    int rentedBy = -1;
+    int rentedOn = -1;
+    int condition = 0;
+    double x = 0;
+    double y = 0;
+};
+
+// Typed row of the customers or employees table
+struct AccountRow
+{
+    int id = -1;
+    string name;
+    int money = 0;
+    int rentedCars = 0;
+    int fineDue = 0;
+    int record = 0;
+};
+
+// Criteria for a fleet search; the defaults match every car
+struct CarQuery
+{
+    string model; // Part of the model name, empty for any model
+    int minYear = INT_MIN;
+    int maxYear = INT_MAX;
+    int minCondition = 0;
+    bool availableOnly = false;
+};
+
+// Formats the display commands can write their rows in, chosen with --format
+enum OutputFormat
+{
+    FORMAT_TABLE, // The text a person reads at the terminal
+    FORMAT_JSON,  // One JSON object per row (JSON Lines)
+    FORMAT_CSV    // A header line, then one line per row
+};
+
+// Column of a listing; numeric values are written to JSON without quotes
+struct OutputColumn
+{
+    const char *name;
+    bool numeric;
+};
+
+// What a display command lists: the columns every format writes, and for the
+// table format the line above the rows, the line shown when there are none
+// and how one row is worded
+struct Listing
+{
+    string title;
+    string none;
+    vector<OutputColumn> columns;
+    function<void(string &out, const vector<string> &values)> line;
+};
+
+// Writes the rows of listings in one format. Text is gathered in a buffer
+// and handed to the stream in large blocks with a single flush at the end of
+// each listing, instead of one write and flush per line.
+class RowSink
+{
+public:
+    static constexpr size_t BUFFER_BYTES = 64 << 10;
+
+    RowSink(ostream &out) : out(out)
+    {
+        buffer.reserve(BUFFER_BYTES + 4096);
+    }
+
+    virtual ~RowSink()
+    {
+        flush();
+    }
+
+    RowSink(const RowSink &) = delete;
+    RowSink &operator=(const RowSink &) = delete;
+
+    void begin(const Listing &listing)
+    {
+        current = &listing;
+        rows = 0;
+        start();
+    }
+
+    // values are in the order of the listing's columns
+    void row(const vector<string> &values)
+    {
+        write(values);
+        rows++;
+        if (buffer.size() >= BUFFER_BYTES)
+            flush(false);
+    }
+
+    void end()
+    {
+        finish();
+        flush();
+        current = nullptr;
+    }
+
+    // A listing of a single row, such as one car or account
+    void record(const Listing &listing, const vector<string> &values)
+    {
+        begin(listing);
+        row(values);
+        end();
+    }
+
+    long long count() const
+    {
+        return rows;
+    }
+
+protected:
+    ostream &out;
+    string buffer;
+    const Listing *current = nullptr;
+    long long rows = 0;
+
+    virtual void start() {}
+    virtual void write(const vector<string> &values) = 0;
+    virtual void finish() {}
+
+private:
+    void flush(bool sync = true)
+    {
+        if (!buffer.empty())
+        {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+        if (sync)
+            out.flush();
+    }
+};
+
+// The text the display commands have always printed
+class TableSink : public RowSink
+{
+public:
+    using RowSink::RowSink;
+
+protected:
+    void write(const vector<string> &values) override
+    {
+        if (rows == 0 && !current->title.empty())
+        {
+            buffer += current->title;
+            buffer += '\n';
+        }
+        current->line(buffer, values);
+    }
+
+    void finish() override
+    {
+        if (rows == 0 && !current->none.empty())
+        {
+            buffer += current->none;
+            buffer += '\n';
+        }
+    }
+};
+
+// One object per row keyed by column name; an empty listing writes nothing
+class JsonLinesSink : public RowSink
+{
+public:
+    using RowSink::RowSink;
+
+protected:
+    void write(const vector<string> &values) override
+    {
+        buffer += '{';
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            if (i > 0)
+                buffer += ',';
+            buffer += '"';
+            buffer += current->columns[i].name;
+            buffer += "\":";
+            if (current->columns[i].numeric && !values[i].empty())
+                buffer += values[i];
+            else
+                quote(values[i]);
+        }
+        buffer += "}\n";
+    }
+
+private:
+    void quote(const string &value)
+    {
+        buffer += '"';
+        for (char c : value)
+        {
+            switch (c)
+            {
+            case '"':
+                buffer += "\\\"";
+                break;
+            case '\\':
+                buffer += "\\\\";
+                break;
+            case '\n':
+                buffer += "\\n";
+                break;
+            case '\r':
+                buffer += "\\r";
+                break;
+            case '\t':
+                buffer += "\\t";
+                break;
+            default:
+                if ((unsigned char)c < 0x20)
+                {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                    buffer += escaped;
+                }
+                else
+                {
+                    buffer += c;
+                }
+            }
+        }
+        buffer += '"';
+    }
+};
+
+// RFC 4180 CSV; the header is written even when there are no rows
+class CsvSink : public RowSink
+{
+public:
+    using RowSink::RowSink;
+
+protected:
+    void start() override
+    {
+        for (size_t i = 0; i < current->columns.size(); i++)
+        {
+            if (i > 0)
+                buffer += ',';
+            buffer += current->columns[i].name;
+        }
+        buffer += '\n';
+    }
+
+    void write(const vector<string> &values) override
+    {
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            if (i > 0)
+                buffer += ',';
+            const string &value = values[i];
+            if (value.find_first_of(",\"\r\n") == string::npos)
+            {
+                buffer += value;
+                continue;
+            }
+            buffer += '"';
+            for (char c : value)
+            {
+                if (c == '"')
+                    buffer += '"';
+                buffer += c;
+            }
+            buffer += '"';
+        }
+        buffer += '\n';
+    }
+};
+
+// Picks the sink for the session's format and turns typed rows into the
+// values sinks write
+class Renderer
+{
+public:
+    inline static OutputFormat format = FORMAT_TABLE;
+
+    static unique_ptr<RowSink> open(OutputFormat format = Renderer::format, ostream &out = cout)
+    {
+        switch (format)
+        {
+        case FORMAT_JSON:
+            return make_unique<JsonLinesSink>(out);
+        case FORMAT_CSV:
+            return make_unique<CsvSink>(out);
+        default:
+            return make_unique<TableSink>(out);
+        }
+    }
+
+    static bool parseFormat(const string &name, OutputFormat &result)
+    {
+        if (name == "table")
+            result = FORMAT_TABLE;
+        else if (name == "json")
+            result = FORMAT_JSON;
+        else if (name == "csv")
+            result = FORMAT_CSV;
+        else
+            return false;
+        return true;
+    }
+
+    static const char *formatName(OutputFormat format)
+    {
+        static const char *names[] = {"table", "json", "csv"};
+        return names[format];
+    }
+
+    // In the order of the table's columns, so lines can index them with CarColumn
+    static vector<OutputColumn> carColumns()
+    {
+        return {{"id", true}, {"model", false}, {"year", false}, {"available", true}, {"rentedBy", true}, {"rentedOn", true}, {"condition", true},
+                {"x", true}, {"y", true}};
+    }
+
+    // In the order of the table's columns, so lines can index them with AccountColumn
+    static vector<OutputColumn> accountColumns()
+    {
+        return {{"id", true}, {"name", false}, {"money", true}, {"rentedCars", true}, {"fineDue", true}, {"record", true}};
+    }
+
+    // Fills values in place so a listing can reuse their storage for every row
+    static void values(const CarRow &car, vector<string> &values)
+    {
+        values.resize(CAR_Y + 1);
+        values[CAR_ID] = to_string(car.id);
+        values[CAR_MODEL] = car.model;
+        values[CAR_YEAR] = car.year;
+        values[CAR_AVAILABLE] = to_string(car.available);
+        values[CAR_RENTED_BY] = to_string(car.rentedBy);
+        values[CAR_RENTED_ON] = to_string(car.rentedOn);
+        values[CAR_CONDITION] = to_string(car.condition);
+        values[CAR_X] = number(car.x);
+        values[CAR_Y] = number(car.y);
+    }
+
+    // Shortest text that reads back as value, e.g. 12.5 rather than 12.500000
+    static string number(double value)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.15g", value);
+        return text;
+    }
+
+    static void values(const AccountRow &account, vector<string> &values)
+    {
+        values.resize(ACCOUNT_RECORD + 1);
+        values[ACCOUNT_ID] = to_string(account.id);
+        values[ACCOUNT_NAME] = account.name;
+        values[ACCOUNT_MONEY] = to_string(account.money);
+        values[ACCOUNT_RENTED_CARS] = to_string(account.rentedCars);
+        values[ACCOUNT_FINE_DUE] = to_string(account.fineDue);
+        values[ACCOUNT_RECORD] = to_string(account.record);
+    }
+};
+
+// Byte buffer of the startup snapshot. Values are stored in native byte order
+// and arrays as a length followed by their raw elements.
+struct SnapshotWriter
+{
+    string bytes;
+
+    template <typename T>
+    void put(const T &value)
+    {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    void putArray(const vector<T> &values)
+    {
+        put<uint64_t>(values.size());
+        bytes.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+    }
+
+    void putString(const string &value)
+    {
+        put<uint32_t>(value.size());
+        bytes.append(value);
+    }
+};
+
+// Reads values written by SnapshotWriter; every get fails rather than
+// reading past the end of the buffer
+struct SnapshotReader
+{
+    const char *next;
+    const char *end;
+
+    template <typename T>
+    bool get(T &value)
+    {
+        if ((size_t)(end - next) < sizeof(T))
+            return false;
+        memcpy(&value, next, sizeof(T));
+        next += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    bool getArray(vector<T> &values)
+    {
+        uint64_t count;
+        if (!get(count) || count > (size_t)(end - next) / sizeof(T))
+            return false;
+        values.resize(count);
+        memcpy(values.data(), next, count * sizeof(T));
+        next += count * sizeof(T);
+        return true;
+    }
+
+    bool getString(string &value)
+    {
+        uint32_t length;
+        if (!get(length) || length > (size_t)(end - next))
+            return false;
+        value.assign(next, length);
+        next += length;
+        return true;
+    }
+};
+
+// Structure-of-arrays copy of the cars table for multi-predicate searches.
+// Year, condition and availability are packed 16-bit columns filtered eight
+// cars at a time with SSE2 (a scalar loop elsewhere), and models are
+// dictionary encoded so a model predicate is one table lookup per car. Writes
+// to the main database made through the Db layer refresh the affected car.
+class CarColumns
+{
+private:
+    vector<int> ids;
+    vector<int16_t> years;
+    vector<int16_t> conditions;
+    vector<int16_t> available;
+    vector<uint32_t> models;
+    vector<int> rentedBy; // Rental state, for quotes
+    vector<int> rentedOn;
+    vector<double> xs; // Location, for nearest-car lookups
+    vector<double> ys;
+    vector<string> dictionary;
+    unordered_map<string, uint32_t> codes;
+    unordered_map<int, size_t> positions; // Car id -> slot in the columns
+    string file;                          // Database the copy was loaded from
+    bool loaded = false;
+    unordered_map<sqlite3 *, vector<int>> deferred; // Cars written inside a connection's open transaction
+    mutex lock;
+
+    // Uniform grid over the available cars: each cell of one model holds the
+    // ids and locations of the cars in it. Renting a car takes it out and returning it puts
+    // it back, so lookups never see cars that cannot be rented.
+    struct Cell
+    {
+        uint32_t model;
+        int x;
+        int y;
+
+        bool operator==(const Cell &other) const
+        {
+            return model == other.model && x == other.x && y == other.y;
+        }
+    };
+
+    struct CellHash
+    {
+        size_t operator()(const Cell &cell) const
+        {
+            uint64_t key = ((uint64_t)cell.model << 48) ^ ((uint64_t)(uint32_t)cell.x << 24) ^ (uint32_t)cell.y;
+            return hash<uint64_t>()(key * 0x9E3779B97F4A7C15ULL);
+        }
+    };
+
+    struct Located
+    {
+        int id;
+        double x;
+        double y;
+    };
+
+    unordered_map<Cell, vector<Located>, CellHash> grid;
+    double cellSize = 10; // Width of a cell in lot map units
+    int minCellX = INT_MAX, maxCellX = INT_MIN, minCellY = INT_MAX, maxCellY = INT_MIN; // Cells used so far
+
+    int cellOf(double coordinate) const
+    {
+        return (int)floor(max(-1e9, min(1e9, coordinate / cellSize)));
+    }
+
+    void place(size_t slot)
+    {
+        if (!available[slot])
+            return;
+        Cell cell{models[slot], cellOf(xs[slot]), cellOf(ys[slot])};
+        grid[cell].push_back({ids[slot], xs[slot], ys[slot]});
+        minCellX = min(minCellX, cell.x);
+        maxCellX = max(maxCellX, cell.x);
+        minCellY = min(minCellY, cell.y);
+        maxCellY = max(maxCellY, cell.y);
+    }
+
+    void unplace(size_t slot)
+    {
+        if (!available[slot])
+            return;
+        auto it = grid.find({models[slot], cellOf(xs[slot]), cellOf(ys[slot])});
+        if (it == grid.end())
+            return;
+        vector<Located> &cars = it->second;
+        int id = ids[slot];
+        auto car = find_if(cars.begin(), cars.end(), [id](const Located &car)
+                           { return car.id == id; });
+        if (car != cars.end())
+        {
+            *car = cars.back();
+            cars.pop_back();
+        }
+        if (cars.empty())
+            grid.erase(it);
+    }
+
+    void rebuildGrid()
+    {
+        grid.clear();
+        minCellX = minCellY = INT_MAX;
+        maxCellX = maxCellY = INT_MIN;
+        for (size_t slot = 0; slot < ids.size(); slot++)
+        {
+            place(slot);
+        }
+    }
+
+    // Which dictionary codes contain part, ignoring case; all of them if part is empty
+    vector<uint8_t> matchingModels(const string &part) const
+    {
+        vector<uint8_t> matches(dictionary.size(), 1);
+        if (part.empty())
+            return matches;
+        string needle = part;
+        transform(needle.begin(), needle.end(), needle.begin(), ::tolower);
+        for (size_t code = 0; code < dictionary.size(); code++)
+        {
+            string model = dictionary[code];
+            transform(model.begin(), model.end(), model.begin(), ::tolower);
+            matches[code] = model.find(needle) != string::npos;
+        }
+        return matches;
+    }
+
+    static int16_t clamp16(long long value)
+    {
+        return (int16_t)max<long long>(INT16_MIN + 1, min<long long>(INT16_MAX - 1, value));
+    }
+
+    uint32_t encode(const string &model)
+    {
+        auto it = codes.find(model);
+        if (it != codes.end())
+            return it->second;
+        uint32_t code = dictionary.size();
+        dictionary.push_back(model);
+        codes[model] = code;
+        return code;
+    }
+
+    void upsert(int id, const string &model, int year, int availability, int condition, int renter, int rentedDay, double x, double y)
+    {
+        auto it = positions.find(id);
+        size_t slot;
+        if (it == positions.end())
+        {
+            slot = ids.size();
+            positions[id] = slot;
+            ids.push_back(id);
+            years.push_back(0);
+            conditions.push_back(0);
+            available.push_back(0);
+            models.push_back(0);
+            rentedBy.push_back(-1);
+            rentedOn.push_back(-1);
+            xs.push_back(0);
+            ys.push_back(0);
+        }
+        else
+        {
+            slot = it->second;
+            unplace(slot);
+        }
+        years[slot] = clamp16(year);
+        conditions[slot] = clamp16(condition);
+        available[slot] = availability > 0 ? 1 : 0;
+        models[slot] = encode(model);
+        rentedBy[slot] = renter;
+        rentedOn[slot] = rentedDay;
+        xs[slot] = x;
+        ys[slot] = y;
+        place(slot);
+    }
+
+    void erase(int id)
+    {
+        auto it = positions.find(id);
+        if (it == positions.end())
+            return;
+        // Move the last car into the freed slot
+        size_t slot = it->second;
+        size_t last = ids.size() - 1;
+        unplace(slot);
+        ids[slot] = ids[last];
+        years[slot] = years[last];
+        conditions[slot] = conditions[last];
+        available[slot] = available[last];
+        models[slot] = models[last];
+        rentedBy[slot] = rentedBy[last];
+        rentedOn[slot] = rentedOn[last];
+        xs[slot] = xs[last];
+        ys[slot] = ys[last];
+        positions[ids[slot]] = slot;
+        positions.erase(it);
+        ids.pop_back();
+        years.pop_back();
+        conditions.pop_back();
+        available.pop_back();
+        models.pop_back();
+        rentedBy.pop_back();
+        rentedOn.pop_back();
+        xs.pop_back();
+        ys.pop_back();
+    }
+
+    void loadLocked(sqlite3 *db)
+    {
+        ids.clear();
+        years.clear();
+        conditions.clear();
+        available.clear();
+        models.clear();
+        rentedBy.clear();
+        rentedOn.clear();
+        xs.clear();
+        ys.clear();
+        positions.clear();
+        rebuildGrid();
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT id, model, year, available, condition, rentedBy, rentedOn, x, y FROM cars", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const unsigned char *year = sqlite3_column_text(stmt, 2);
+            upsert(sqlite3_column_int(stmt, 0),
+                   reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+                   year == nullptr ? 0 : atoi(reinterpret_cast<const char *>(year)),
+                   sqlite3_column_int(stmt, 3),
+                   sqlite3_column_int(stmt, 4),
+                   sqlite3_column_int(stmt, 5),
+                   sqlite3_column_int(stmt, 6),
+                   sqlite3_column_double(stmt, 7),
+                   sqlite3_column_double(stmt, 8));
+        }
+        sqlite3_finalize(stmt);
+        const char *name = sqlite3_db_filename(db, "main");
+        file = name == nullptr ? "" : name;
+        loaded = true;
+    }
+
+public:
+    // Copy of the main database's cars table
+    static CarColumns &fleet()
+    {
+        static CarColumns columns;
+        return columns;
+    }
+
+    bool isLoaded()
+    {
+        lock_guard<mutex> guard(lock);
+        return loaded;
+    }
+
+    void load(sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        loadLocked(db);
+    }
+
+    // Re-reads one car after a write on db; ignored for other database files.
+    // Inside a transaction the car is only noted, and re-read by settle once
+    // the transaction ends, so the copy never holds a write that is rolled back.
+    void refresh(int id, sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        const char *name = sqlite3_db_filename(db, "main");
+        if (!loaded || name == nullptr || file != name)
+            return;
+        if (!sqlite3_get_autocommit(db))
+        {
+            deferred[db].push_back(id);
+            return;
+        }
+        reread(id, db);
+    }
+
+    // Re-reads the cars written in db's last transaction, now that it has
+    // committed or rolled back. Called wherever a transaction is ended.
+    void settle(sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = deferred.find(db);
+        if (it == deferred.end() || !sqlite3_get_autocommit(db))
+            return;
+        vector<int> ids = move(it->second);
+        deferred.erase(it);
+        const char *name = sqlite3_db_filename(db, "main");
+        if (!loaded || name == nullptr || file != name)
+            return;
+        for (int id : ids)
+        {
+            reread(id, db);
+        }
+    }
+
+private:
+    void reread(int id, sqlite3 *db)
+    {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT model, year, available, condition, rentedBy, rentedOn, x, y FROM cars WHERE id = ?", -1, &stmt, nullptr) != SQLITE_OK)
+            return;
+        sqlite3_bind_int(stmt, 1, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const unsigned char *year = sqlite3_column_text(stmt, 1);
+            upsert(id,
+                   reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                   year == nullptr ? 0 : atoi(reinterpret_cast<const char *>(year)),
+                   sqlite3_column_int(stmt, 2),
+                   sqlite3_column_int(stmt, 3),
+                   sqlite3_column_int(stmt, 4),
+                   sqlite3_column_int(stmt, 5),
+                   sqlite3_column_double(stmt, 6),
+                   sqlite3_column_double(stmt, 7));
+        }
+        else
+        {
+            erase(id);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+public:
+    void save(SnapshotWriter &out)
+    {
+        lock_guard<mutex> guard(lock);
+        out.putArray(ids);
+        out.putArray(years);
+        out.putArray(conditions);
+        out.putArray(available);
+        out.putArray(models);
+        out.putArray(rentedBy);
+        out.putArray(rentedOn);
+        out.putArray(xs);
+        out.putArray(ys);
+        out.put<uint32_t>(dictionary.size());
+        for (const string &model : dictionary)
+        {
+            out.putString(model);
+        }
+    }
+
+    // Replaces the columns with a snapshot of db's cars; unchanged on failure
+    bool restore(SnapshotReader &in, sqlite3 *db)
+    {
+        vector<int> newIds, newRentedBy, newRentedOn;
+        vector<int16_t> newYears, newConditions, newAvailable;
+        vector<uint32_t> newModels;
+        vector<double> newXs, newYs;
+        uint32_t words;
+        if (!in.getArray(newIds) || !in.getArray(newYears) || !in.getArray(newConditions) || !in.getArray(newAvailable) ||
+            !in.getArray(newModels) || !in.getArray(newRentedBy) || !in.getArray(newRentedOn) || !in.getArray(newXs) ||
+            !in.getArray(newYs) || !in.get(words))
+            return false;
+        vector<string> newDictionary(words);
+        for (string &model : newDictionary)
+        {
+            if (!in.getString(model))
+                return false;
+        }
+        size_t count = newIds.size();
+        if (newYears.size() != count || newConditions.size() != count || newAvailable.size() != count || newModels.size() != count ||
+            newRentedBy.size() != count || newRentedOn.size() != count || newXs.size() != count || newYs.size() != count)
+            return false;
+        for (uint32_t code : newModels)
+        {
+            if (code >= words)
+                return false;
+        }
+
+        lock_guard<mutex> guard(lock);
+        ids = move(newIds);
+        years = move(newYears);
+        conditions = move(newConditions);
+        available = move(newAvailable);
+        models = move(newModels);
+        rentedBy = move(newRentedBy);
+        rentedOn = move(newRentedOn);
+        xs = move(newXs);
+        ys = move(newYs);
+        dictionary = move(newDictionary);
+        codes.clear();
+        for (uint32_t code = 0; code < dictionary.size(); code++)
+        {
+            codes[dictionary[code]] = code;
+        }
+        positions.clear();
+        positions.reserve(count);
+        for (size_t slot = 0; slot < count; slot++)
+        {
+            positions[ids[slot]] = slot;
+        }
+        rebuildGrid();
+        const char *name = sqlite3_db_filename(db, "main");
+        file = name == nullptr ? "" : name;
+        loaded = true;
+        return true;
+    }
+
+    // Adds cars directly, bypassing the database (used by benchmarks)
+    void add(int id, const string &model, int year, int availability, int condition, int renter = -1, int rentedDay = -1, double x = 0, double y = 0)
+    {
+        lock_guard<mutex> guard(lock);
+        upsert(id, model, year, availability, condition, renter, rentedDay, x, y);
+        loaded = true;
+    }
+
+    // Rental state of one car; false if the car is not in the copy
+    bool rental(int id, int &renter, int &rentedDay, int &condition)
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = positions.find(id);
+        if (it == positions.end())
+            return false;
+        renter = rentedBy[it->second];
+        rentedDay = rentedOn[it->second];
+        condition = conditions[it->second];
+        return true;
+    }
+
+    size_t size()
+    {
+        lock_guard<mutex> guard(lock);
+        return ids.size();
+    }
+
+    // Ids of cars matching every predicate of the query, in slot order
+    vector<int> search(const CarQuery &query)
+    {
+        lock_guard<mutex> guard(lock);
+        vector<int> found;
+        if (query.minYear > query.maxYear)
+            return found;
+
+        vector<uint8_t> modelMatches = matchingModels(query.model);
+
+        int16_t minYear = clamp16(query.minYear);
+        int16_t maxYear = clamp16(query.maxYear);
+        int16_t minCondition = clamp16(query.minCondition);
+        int16_t minAvailable = query.availableOnly ? 1 : 0;
+        size_t count = ids.size();
+        size_t i = 0;
+
+#ifdef __SSE2__
+        const __m128i belowYear = _mm_set1_epi16(minYear - 1);
+        const __m128i aboveYear = _mm_set1_epi16(maxYear + 1);
+        const __m128i belowCondition = _mm_set1_epi16(minCondition - 1);
+        const __m128i belowAvailable = _mm_set1_epi16(minAvailable - 1);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i year = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&years[i]));
+            __m128i condition = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&conditions[i]));
+            __m128i availability = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&available[i]));
+            __m128i match = _mm_and_si128(_mm_cmpgt_epi16(year, belowYear), _mm_cmplt_epi16(year, aboveYear));
+            match = _mm_and_si128(match, _mm_cmpgt_epi16(condition, belowCondition));
+            match = _mm_and_si128(match, _mm_cmpgt_epi16(availability, belowAvailable));
+            int bits = _mm_movemask_epi8(_mm_packs_epi16(match, _mm_setzero_si128()));
+            while (bits != 0)
+            {
+                int lane = __builtin_ctz(bits);
+                bits &= bits - 1;
+                if (modelMatches[models[i + lane]])
+                    found.push_back(ids[i + lane]);
+            }
+        }
+#endif
+        for (; i < count; i++)
+        {
+            bool match = (years[i] >= minYear) & (years[i] <= maxYear) & (conditions[i] >= minCondition) & (available[i] >= minAvailable);
+            if (match && modelMatches[models[i]])
+                found.push_back(ids[i]);
+        }
+        return found;
+    }
+
+    // A car found by nearest, how far it is from the point and where the
+    // grid has it
+    struct Neighbour
+    {
+        int id;
+        double distance;
+        double x = 0;
+        double y = 0;
+
+        // Closer first, then by id so ties always come out the same way
+        bool operator<(const Neighbour &other) const
+        {
+            return distance < other.distance || (distance == other.distance && id < other.id);
+        }
+    };
+
+    // The k available cars closest to (x, y) whose model contains model (any
+    // model if empty), closest first. Rings of cells around the point are
+    // searched outwards until no cell left can hold a car closer than the
+    // k-th found; once a ring has more cells than the grid has in use, the
+    // rest of the grid is scanned instead.
+    vector<Neighbour> nearest(const string &model, double x, double y, int k)
+    {
+        lock_guard<mutex> guard(lock);
+        vector<Neighbour> found; // Max-heap of the best k so far, by squared distance
+        if (k <= 0 || grid.empty())
+            return found;
+        vector<uint8_t> wanted = matchingModels(model);
+        vector<uint32_t> wantedCodes;
+        for (uint32_t code = 0; code < wanted.size(); code++)
+        {
+            if (wanted[code])
+                wantedCodes.push_back(code);
+        }
+        if (wantedCodes.empty())
+            return found;
+
+        auto consider = [&](const vector<Located> &cars)
+        {
+            for (const Located &located : cars)
+            {
+                double dx = located.x - x, dy = located.y - y;
+                Neighbour car{located.id, dx * dx + dy * dy, located.x, located.y};
+                if ((int)found.size() < k)
+                {
+                    found.push_back(car);
+                    push_heap(found.begin(), found.end());
+                }
+                else if (car < found.front())
+                {
+                    pop_heap(found.begin(), found.end());
+                    found.back() = car;
+                    push_heap(found.begin(), found.end());
+                }
+            }
+        };
+        auto visit = [&](long long cellX, long long cellY)
+        {
+            if (cellX < minCellX || cellX > maxCellX || cellY < minCellY || cellY > maxCellY)
+                return;
+            for (uint32_t code : wantedCodes)
+            {
+                auto it = grid.find({code, (int)cellX, (int)cellY});
+                if (it != grid.end())
+                    consider(it->second);
+            }
+        };
+
+        // Rings are squares of cells at one Chebyshev distance from the point's cell
+        long long centerX = cellOf(x), centerY = cellOf(y);
+        long long first = max({0LL, minCellX - centerX, centerX - maxCellX, minCellY - centerY, centerY - maxCellY});
+        long long last = max({centerX - minCellX, maxCellX - centerX, centerY - minCellY, maxCellY - centerY});
+        for (long long ring = first; ring <= last; ring++)
+        {
+            // No car in this ring or beyond is closer than the edge of the square of rings inside it
+            double reach = min({x - (centerX - ring + 1) * cellSize, (centerX + ring) * cellSize - x,
+                                y - (centerY - ring + 1) * cellSize, (centerY + ring) * cellSize - y});
+            if ((int)found.size() == k && reach > 0 && found.front().distance <= reach * reach)
+                break;
+            if ((unsigned long long)(8 * ring) * wantedCodes.size() > grid.size())
+            {
+                for (const auto &cell : grid)
+                {
+                    if (wanted[cell.first.model] && max(llabs(cell.first.x - centerX), llabs(cell.first.y - centerY)) >= ring)
+                        consider(cell.second);
+                }
+                break;
+            }
+            if (ring == 0)
+            {
+                visit(centerX, centerY);
+                continue;
+            }
+            for (long long dx = -ring; dx <= ring; dx++)
+            {
+                visit(centerX + dx, centerY - ring);
+                visit(centerX + dx, centerY + ring);
+            }
+            for (long long dy = -ring + 1; dy < ring; dy++)
+            {
+                visit(centerX - ring, centerY + dy);
+                visit(centerX + ring, centerY + dy);
+            }
+        }
+        sort_heap(found.begin(), found.end());
+        for (Neighbour &car : found)
+        {
+            car.distance = sqrt(car.distance);
+        }
+        return found;
+    }
+
+    // Times nearest-car lookups and rent/return updates of the grid over
+    // count synthetic cars in a 1000 x 1000 area, checking a sample of the
+    // lookups against a scan of every car
+    static void benchmarkNearest(int count)
+    {
+        CarColumns columns;
+        vector<string> models = {"Lamborghini Aventador", "Ferrari F8", "Porsche 911", "Koenigsegg Agera", "Bugatti Veyron", "Rolls Royce Spectre"};
+        mt19937 rng(253);
+        uniform_real_distribution<double> coordinate(0, 1000);
+        auto start = chrono::steady_clock::now();
+        for (int id = 1; id <= count; id++)
+        {
+            double x = coordinate(rng);
+            columns.add(id, models[rng() % models.size()], 2020, rng() % 4 != 0, 100, -1, -1, x, coordinate(rng));
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Built columns and grid for " << count << " cars (" << columns.grid.size() << " cells) in " << seconds * 1000 << " ms" << endl;
+
+        const int queries = 10000, checked = 20, k = 5;
+        struct Query
+        {
+            string model;
+            double x, y;
+        };
+        vector<Query> batch(queries);
+        for (Query &query : batch)
+        {
+            query.model = rng() % 4 == 0 ? "" : models[rng() % models.size()];
+            query.x = coordinate(rng);
+            query.y = coordinate(rng);
+        }
+        start = chrono::steady_clock::now();
+        for (const Query &query : batch)
+        {
+            columns.nearest(query.model, query.x, query.y, k);
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Grid: " << queries << " lookups of the " << k << " nearest in " << seconds * 1000 << " ms ("
+             << (long long)(queries / max(seconds, 1e-9)) << " lookups/sec)" << endl;
+
+        // The same answers by measuring the distance to every car
+        int mismatches = 0;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < checked; i++)
+        {
+            const Query &query = batch[i];
+            vector<uint8_t> wanted = columns.matchingModels(query.model);
+            vector<Neighbour> all;
+            for (size_t slot = 0; slot < columns.ids.size(); slot++)
+            {
+                if (columns.available[slot] && wanted[columns.models[slot]])
+                    all.push_back({columns.ids[slot], hypot(columns.xs[slot] - query.x, columns.ys[slot] - query.y)});
+            }
+            size_t kept = min<size_t>(k, all.size());
+            partial_sort(all.begin(), all.begin() + kept, all.end());
+            all.resize(kept);
+            vector<Neighbour> grid = columns.nearest(query.model, query.x, query.y, k);
+            mismatches += !equal(all.begin(), all.end(), grid.begin(), grid.end(), [](const Neighbour &a, const Neighbour &b)
+                                 { return a.id == b.id; });
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Scan: " << checked << " lookups in " << seconds * 1000 << " ms (" << (long long)(checked / max(seconds, 1e-9)) << " lookups/sec), "
+             << mismatches << " differed from the grid" << endl;
+
+        // Renting takes a car out of its cell and returning puts it back
+        const int updates = 200000;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < updates; i++)
+        {
+            int id = rng() % count + 1;
+            size_t slot = columns.positions[id];
+            columns.add(id, columns.dictionary[columns.models[slot]], 2020, !columns.available[slot], 100, -1, -1, columns.xs[slot], columns.ys[slot]);
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Grid: " << updates << " rents and returns in " << seconds * 1000 << " ms (" << (long long)(updates / max(seconds, 1e-9)) << " updates/sec)" << endl;
+    }
+
+    // Times a few searches over count synthetic cars
+    static void benchmark(int count)
+    {
+        CarColumns columns;
+        vector<string> models = {"Lamborghini Aventador", "Ferrari F8", "Porsche 911", "Koenigsegg Agera", "Bugatti Veyron", "Rolls Royce Spectre"};
+        mt19937 rng(253);
+        auto start = chrono::steady_clock::now();
+        for (int id = 1; id <= count; id++)
+        {
+            columns.add(id, models[rng() % models.size()], 1990 + rng() % 35, rng() % 4 != 0, rng() % 101);
+        }
+        double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Built columns for " << count << " cars in " << buildSeconds * 1000 << " ms" << endl;
+
+        vector<pair<string, CarQuery>> queries(3);
+        queries[0].first = "available, condition >= 90";
+        queries[0].second.availableOnly = true;
+        queries[0].second.minCondition = 90;
+        queries[1].first = "years 2015-2020, condition >= 50";
+        queries[1].second.minYear = 2015;
+        queries[1].second.maxYear = 2020;
+        queries[1].second.minCondition = 50;
+        queries[2].first = "Ferrari, available, from 2020";
+        queries[2].second.model = "ferrari";
+        queries[2].second.availableOnly = true;
+        queries[2].second.minYear = 2020;
+        for (const auto &query : queries)
+        {
+            start = chrono::steady_clock::now();
+            size_t matches = columns.search(query.second).size();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << query.first << ": " << matches << " matches in " << seconds * 1000 << " ms ("
+                 << (long long)(count / max(seconds, 1e-9)) << " cars/sec)" << endl;
+        }
+    }
+};
+
+// In-memory set of the ids present in a table of the main database, kept
+// current on insert and delete. Ids are AUTOINCREMENT, so a bitmap indexed by
+// id is compact, and a clear bit means the row certainly does not exist. Ids
+// above the highest one present when the filter was loaded may have been added
+// by another process, so those (and any other database file) are still left
+// to SQLite, even after this process inserts ids past that bound.
+class IdFilter
+{
+private:
+    vector<uint64_t> bits;
+    int maxId = 0;       // Highest id set, so bits can be indexed up to it
+    int loadedMaxId = 0; // Highest id at load; only ids up to it are answered here
+    string file;
+    bool loaded = false;
+    mutex lock;
+
+    bool isLoadedFrom(sqlite3 *db)
+    {
+        if (!loaded)
+            return false;
+        if (db == nullptr)
+            return true; // Connections opened by default go to the main database
+        const char *name = sqlite3_db_filename(db, "main");
+        return name != nullptr && file == name;
+    }
+
+    void set(int id)
+    {
+        if ((size_t)(id / 64) >= bits.size())
+            bits.resize(id / 64 + 1, 0);
+        bits[id / 64] |= 1ULL << (id % 64);
+        maxId = max(maxId, id);
+    }
+
+public:
+    static IdFilter &of(const string &table)
+    {
+        static map<string, IdFilter> filters;
+        static mutex registry;
+        lock_guard<mutex> guard(registry);
+        return filters[table];
+    }
+
+    void load(const string &table, sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        bits.clear();
+        maxId = 0;
+        loadedMaxId = 0;
+        sqlite3_stmt *stmt;
+        string sql = "SELECT id FROM " + table;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            set(sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        loadedMaxId = maxId;
+        const char *name = sqlite3_db_filename(db, "main");
+        file = name == nullptr ? "" : name;
+        loaded = true;
+    }
+
+    void save(SnapshotWriter &out)
+    {
+        lock_guard<mutex> guard(lock);
+        out.put<int32_t>(maxId);
+        out.putArray(bits);
+    }
+
+    // Replaces the filter with a snapshot of the table in db; unchanged on failure
+    bool restore(SnapshotReader &in, sqlite3 *db)
+    {
+        int32_t newMaxId;
+        vector<uint64_t> newBits;
+        if (!in.get(newMaxId) || !in.getArray(newBits) || newMaxId < 0 || (newMaxId > 0 && (size_t)(newMaxId / 64) >= newBits.size()))
+            return false;
+        lock_guard<mutex> guard(lock);
+        maxId = newMaxId;
+        loadedMaxId = newMaxId;
+        bits = move(newBits);
+        const char *name = sqlite3_db_filename(db, "main");
+        file = name == nullptr ? "" : name;
+        loaded = true;
+        return true;
+    }
+
+    // False only if the row certainly does not exist
+    bool mayContain(int id, sqlite3 *db = nullptr)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!isLoadedFrom(db) || id > loadedMaxId)
+            return true;
+        if (id <= 0)
+            return false;
+        return (bits[id / 64] >> (id % 64)) & 1;
+    }
+
+    void insert(int id, sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        if (isLoadedFrom(db) && id > 0)
+            set(id);
+    }
+
+    void erase(int id, sqlite3 *db)
+    {
+        lock_guard<mutex> guard(lock);
+        if (isLoadedFrom(db) && id > 0 && id <= maxId)
+            bits[id / 64] &= ~(1ULL << (id % 64));
+    }
+};
+
+// Time spent in each phase of startup, printed before the first prompt
+class StartupProfile
+{
+private:
+    inline static vector<pair<string, double>> phases;
+    inline static chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+public:
+    // Adds the time since start to phase and returns the current time
+    static chrono::steady_clock::time_point record(const string &phase, chrono::steady_clock::time_point start)
+    {
+        auto now = chrono::steady_clock::now();
+        double ms = chrono::duration<double, milli>(now - start).count();
+        auto it = find_if(phases.begin(), phases.end(), [&](const pair<string, double> &entry)
+                          { return entry.first == phase; });
+        if (it == phases.end())
+            phases.push_back({phase, ms});
+        else
+            it->second += ms;
+        return now;
+    }
+
+    static void print()
+    {
+        double total = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        cout << "Startup took " << total << " ms (";
+        for (size_t i = 0; i < phases.size(); i++)
+        {
+            cout << (i == 0 ? "" : ", ") << phases[i].first << " " << phases[i].second << " ms";
+        }
+        cout << ")" << endl;
+    }
+};
+
+// Binary copy of the in-memory indexes (the id filters and the car columns)
+// written next to the database on a clean exit, so the next start can skip
+// rebuilding them from full table scans. It records the counter that
+// triggers bump on every write affecting those indexes, so a write from any
+// process since the snapshot was taken makes it stale, and a checksum
+// rejects truncated or corrupt files.
+class FleetSnapshot
+{
+private:
+    inline static const char magic[8] = {'F', 'L', 'E', 'E', 'T', 'S', 'N', 'P'};
+    inline static const vector<string> tables = {"cars", "customers", "employees"};
+    inline static bool attempted = false;
+    inline static bool restored = false;
+
+    static string path(sqlite3 *db)
+    {
+        const char *name = sqlite3_db_filename(db, "main");
+        return name == nullptr || name[0] == '\0' ? "" : string(name) + ".snapshot";
+    }
+
+    static bool changeCounter(sqlite3 *db, int64_t &counter)
+    {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT counter FROM changes WHERE id = 1", -1, &stmt, nullptr) != SQLITE_OK)
+            return false;
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        if (found)
+            counter = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+public:
+    // Loads the indexes from the snapshot if it matches db; only tried once per run
+    static bool restore(sqlite3 *db)
+    {
+        if (attempted)
+            return restored;
+        attempted = true;
+        auto start = chrono::steady_clock::now();
+
+        int64_t counter = 0;
+        string file = path(db);
+        FILE *snapshot = file.empty() ? nullptr : fopen(file.c_str(), "rb");
+        if (snapshot == nullptr || !changeCounter(db, counter))
+        {
+            if (snapshot != nullptr)
+                fclose(snapshot);
+            return false;
+        }
+        vector<char> bytes;
+        if (fseek(snapshot, 0, SEEK_END) == 0)
+        {
+            long size = ftell(snapshot);
+            if (size > 0)
+            {
+                bytes.resize(size);
+                rewind(snapshot);
+                if (fread(bytes.data(), 1, size, snapshot) != (size_t)size)
+                    bytes.clear();
+            }
+        }
+        fclose(snapshot);
+
+        uint64_t sum;
+        uint32_t version;
+        int64_t snapshotCounter;
+        if (bytes.size() < sizeof(magic) + sizeof(sum) || memcmp(bytes.data(), magic, sizeof(magic)) != 0)
+            return false;
+        memcpy(&sum, bytes.data() + bytes.size() - sizeof(sum), sizeof(sum));
+        SnapshotReader in = {bytes.data() + sizeof(magic), bytes.data() + bytes.size() - sizeof(sum)};
+        if (fnv1a(bytes.data(), bytes.size() - sizeof(sum)) != sum || !in.get(version) || !in.get(snapshotCounter) ||
+            version != SCHEMA_VERSION || snapshotCounter != counter)
+            return false;
+
+        for (const string &table : tables)
+        {
+            if (!IdFilter::of(table).restore(in, db))
+                return false;
+        }
+        if (!CarColumns::fleet().restore(in, db))
+            return false;
+        restored = true;
+        StartupProfile::record("snapshot restore", start);
+        return true;
+    }
+
+    // Rebuilds the indexes from one read transaction on db and writes the snapshot
+    static bool save(sqlite3 *db)
+    {
+        string file = path(db);
+        if (file.empty())
+            return false;
+        SnapshotWriter out;
+        out.bytes.append(magic, sizeof(magic));
+        out.put<uint32_t>(SCHEMA_VERSION);
+
+        sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+        int64_t counter = 0;
+        bool ok = changeCounter(db, counter);
+        if (ok)
+        {
+            out.put<int64_t>(counter);
+            for (const string &table : tables)
+            {
+                IdFilter filter;
+                filter.load(table, db);
+                filter.save(out);
+            }
+            CarColumns columns;
+            columns.load(db);
+            columns.save(out);
+        }
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+        if (!ok)
+            return false;
+        out.put<uint64_t>(fnv1a(out.bytes.data(), out.bytes.size()));
+
+        // Write a new file and rename it over the old one, so readers never see half a snapshot
+        string temporary = file + ".tmp";
+        FILE *snapshot = fopen(temporary.c_str(), "wb");
+        if (snapshot == nullptr)
+        {
+            Log::error("Error writing snapshot", temporary.c_str());
+            return false;
+        }
+        bool written = fwrite(out.bytes.data(), 1, out.bytes.size(), snapshot) == out.bytes.size();
+        written = fclose(snapshot) == 0 && written;
+        if (!written || rename(temporary.c_str(), file.c_str()) != 0)
+        {
+            Log::error("Error writing snapshot", file.c_str());
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// How connections cope with other processes writing the same database. A
+// busy handler waits out short locks with growing sleeps up to a timeout,
+// write transactions take the write lock up front with BEGIN IMMEDIATE so
+// they never fail halfway, and an operation that still finds the database
+// busy is retried as a whole after a jittered exponential backoff.
+class Contention
+{
+public:
+    inline static atomic<int> busyTimeoutMs{1000}; // Longest wait of the busy handler per lock
+    inline static atomic<int> maxAttempts{5};      // Tries of a whole operation
+    inline static atomic<int> backoffMs{10};       // Backoff ceiling of the first retry, doubled per retry
+
+    struct Metrics
+    {
+        atomic<long long> operations{0};
+        atomic<long long> retries{0};
+        atomic<long long> giveUps{0};
+        atomic<long long> busyWaits{0};    // Locks the busy handler waited on
+        atomic<long long> busyTimeouts{0}; // Waits that reached the timeout
+        atomic<long long> waitMicros{0};   // Time slept by the busy handler
+        atomic<long long> backoffMicros{0};
+    };
+
+    static Metrics &metrics()
+    {
+        static Metrics counters;
+        return counters;
+    }
+
+private:
+    static int onBusy(void *, int count)
+    {
+        thread_local chrono::steady_clock::time_point since;
+        auto now = chrono::steady_clock::now();
+        if (count == 0)
+        {
+            since = now;
+            metrics().busyWaits++;
+        }
+        long long waited = chrono::duration_cast<chrono::microseconds>(now - since).count();
+        if (waited >= busyTimeoutMs * 1000LL)
+        {
+            metrics().busyTimeouts++;
+            return 0;
+        }
+        // Locks are usually held for well under a millisecond, so start short: 100us, 200us, ... up to 20ms
+        long long delay = min({100LL << min(count, 8), 20000LL, busyTimeoutMs * 1000LL - waited});
+        this_thread::sleep_for(chrono::microseconds(delay));
+        metrics().waitMicros += delay;
+        return 1;
+    }
+
+public:
+    static void install(sqlite3 *db)
+    {
+        sqlite3_busy_handler(db, onBusy, nullptr);
+    }
+
+    // Runs operation in a write transaction, retrying it while the database is
+    // busy. Inside a caller's transaction it just runs, as the caller owns retries.
+    static bool write(sqlite3 *db, const string &name, const function<bool()> &operation)
+    {
+        if (!sqlite3_get_autocommit(db))
+            return operation();
+
+        thread_local mt19937 rng(random_device{}());
+        Log::Context context(name.c_str());
+        metrics().operations++;
+        for (int attempt = 1;; attempt++)
+        {
+            bool done = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) == SQLITE_OK && operation() &&
+                        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK;
+            int code = sqlite3_errcode(db);
+            if (!done && !sqlite3_get_autocommit(db))
+                sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            CarColumns::fleet().settle(db);
+            if (done)
+                return true;
+            if (code != SQLITE_BUSY && code != SQLITE_LOCKED)
+                return false;
+            if (attempt >= maxAttempts)
+            {
+                metrics().giveUps++;
+                Log::write(LEVEL_WARNING, "Gave up after " + to_string(attempt) + " attempts", "the database is busy", code);
+                return false;
+            }
+            // Full jitter keeps processes that collided from retrying in step
+            metrics().retries++;
+            int ceiling = backoffMs * (1 << min(attempt - 1, 10));
+            int delay = uniform_int_distribution<int>(0, max(ceiling, 0))(rng);
+            this_thread::sleep_for(chrono::milliseconds(delay));
+            metrics().backoffMicros += delay * 1000;
+        }
+    }
+
+    static void report()
+    {
+        Metrics &counters = metrics();
+        cout << "Busy timeout " << busyTimeoutMs << " ms, " << maxAttempts << " attempts, backoff from " << backoffMs << " ms" << endl;
+        cout << "Write operations: " << counters.operations << ", retries: " << counters.retries << ", gave up: " << counters.giveUps << endl;
+        cout << "Busy waits: " << counters.busyWaits << " (" << counters.busyTimeouts << " timed out), waited "
+             << counters.waitMicros / 1000 << " ms, backed off " << counters.backoffMicros / 1000 << " ms" << endl;
+    }
+};
+
+class Db
+{
+protected:
+    string tablename;
+
+    // Database file used by connections that are not routed to a specific shard
+    inline static string databaseFile = FILENAME;
+
+    // Whether the database was already set up by this version, so tables,
+    // triggers and default rows need not be created again
+    bool schemaCurrent = false;
+
+    Db()
+    {
+        sqlite3 *db;
+        auto start = chrono::steady_clock::now();
+        if (connectToDatabase(&db))
+        {
+            Log::info("Database connection successful");
+            schemaCurrent = schemaVersion(db) == SCHEMA_VERSION;
+            if (!schemaCurrent)
+            {
+                // WAL lets report snapshots read while renters keep writing
+                sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+            }
+            sqlite3_close(db);
+        }
+        StartupProfile::record("schema check", start);
+    }
+
+    static int schemaVersion(sqlite3 *db)
+    {
+        int version = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                version = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return version;
+    }
+
+    // Counts writes to the table that affect the in-memory indexes in the
+    // changes table, so startup can tell whether its snapshot is current
+    void trackChanges(sqlite3 *db, const string &updatedColumns = "")
+    {
+        string sql = "CREATE TABLE IF NOT EXISTS changes (id INTEGER PRIMARY KEY CHECK (id = 1), counter INTEGER NOT NULL);"
+                     "INSERT OR IGNORE INTO changes VALUES (1, 0);";
+        vector<pair<string, string>> events = {{"insert", "INSERT"}, {"delete", "DELETE"}};
+        if (!updatedColumns.empty())
+            events.push_back({"update", "UPDATE OF " + updatedColumns});
+        for (const auto &event : events)
+        {
+            sql += "CREATE TRIGGER IF NOT EXISTS " + tablename + "_changes_" + event.first + " AFTER " + event.second + " ON " +
+                   tablename + " BEGIN UPDATE changes SET counter = counter + 1 WHERE id = 1; END;";
+        }
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error tracking changes to " + tablename, errmsg);
+            sqlite3_free(errmsg);
+        }
+    }
+
+    bool isTableEmpty(sqlite3 *db, string &table_name)
+    {
+
+        string sql = "SELECT 1 FROM " + table_name + ";";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return false;
+        }
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt);
+            return true;
+        }
+
+        sqlite3_finalize(stmt);
+        return false;
+    }
+
+    // Function to create the database tables
+    void createTable(sqlite3 *db, string sql)
+    {
+        Log::info("Creating table " + tablename);
+        // Execute statement and handle errors
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error creating " + tablename + " table", errmsg);
+            sqlite3_free(errmsg);
+        }
+    }
+
+public:
+    static const string &getDatabaseFile()
+    {
+        return databaseFile;
+    }
+
+    // Points connections that are not routed to a shard at another database file
+    static void setDatabaseFile(const string &file)
+    {
+        databaseFile = file;
+    }
+
+    // Marks the database as set up by this version once every table exists
+    static void stampSchema()
+    {
+        sqlite3 *db;
+        if (!connectToDatabase(&db))
+            return;
+        if (schemaVersion(db) != SCHEMA_VERSION)
+        {
+            string sql = "PRAGMA user_version = " + to_string(SCHEMA_VERSION) + ";";
+            sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+        }
+        sqlite3_close(db);
+    }
+
+    // Function to connect to db and check if the database connection is successful
+    static bool connectToDatabase(sqlite3 **db)
+    {
+        return connectToDatabase(db, databaseFile);
+    }
+
+    // Function to connect to a specific database file (used for shards)
+    static bool connectToDatabase(sqlite3 **db, const string &file)
+    {
+        int rc = sqlite3_open(file.c_str(), db);
+        if (rc != SQLITE_OK)
+        {
+            Log::error("Error opening database", *db);
+            return false;
+        }
+        Contention::install(*db);
+        return true;
+    }
+
+    void deleteRecord(int id, sqlite3 *db = nullptr)
+    {
+        deleteFromTable(id, tablename, db);
+    }
+
+    static void deleteFromTable(int id, string table_name, sqlite3 *db = nullptr)
+    {
+        // Ids the filter rules out are not looked up at all
+        if (!IdFilter::of(table_name).mayContain(id, db))
+        {
+            cout << "Record not found." << endl;
+            return;
+        }
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return;
+        }
+        string sql = "DELETE FROM " + table_name + " WHERE id = ?;";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for deleting", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, id);
+
+        // Execute the statement; the number of deleted rows tells whether it existed
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error executing statement", db);
+        }
+        else if (sqlite3_changes(db) == 0)
+        {
+            cout << "Record not found." << endl;
+        }
+        else
+        {
+            cout << "Record with ID " << id << " deleted successfully." << endl;
+            IdFilter::of(table_name).erase(id, db);
+            if (table_name == "cars")
+                CarColumns::fleet().refresh(id, db);
+        }
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+    }
+
+    bool search(int id, sqlite3 *db = nullptr)
+    {
+        if (!IdFilter::of(tablename).mayContain(id, db))
+            return false;
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "SELECT EXISTS (SELECT 1 FROM " + tablename + " WHERE id = ?);";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            return false;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, id);
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            Log::error("Error executing statement", db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        // Check if EXISTS returned 1 (first column)
+        bool exists = sqlite3_column_int(stmt, 0) == 1;
+
+        sqlite3_finalize(stmt);
+        return exists;
+    }
+
+    static bool searchTable(int id, string table_name, sqlite3 *db = nullptr)
+    {
+        if (!IdFilter::of(table_name).mayContain(id, db))
+            return false;
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "SELECT EXISTS (SELECT 1 FROM " + table_name + " WHERE id = ?);";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            return false;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, id);
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            Log::error("Error executing statement", db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        // Check if EXISTS returned 1 (first column)
+        bool exists = sqlite3_column_int(stmt, 0) == 1;
+
+        sqlite3_finalize(stmt);
+        return exists;
+    }
+
+    // Row of table with the given id, read into row using row's allocator
+    static bool searchRow(const string &table_name, int id, ArenaRow &row, sqlite3 *db = nullptr)
+    {
+        row.clear();
+        if (!IdFilter::of(table_name).mayContain(id, db))
+            return false;
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        pmr::string sql("SELECT * FROM ", row.get_allocator());
+        sql += table_name;
+        sql += " WHERE id = ?";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return false;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, id);
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            Log::error("Error executing statement", db);
+            sqlite3_finalize(stmt);
+            if (ownDb)
+                sqlite3_close(db);
+            return false;
+        }
+
+        int columns = sqlite3_column_count(stmt);
+        row.reserve(columns);
+        for (int i = 0; i < columns; i++)
+        {
+            const unsigned char *text = sqlite3_column_text(stmt, i);
+            row.emplace_back(text == nullptr ? "" : reinterpret_cast<const char *>(text));
+        }
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        return true;
+    }
+
+    // Rows of table for many ids with one statement. The ids are bound as a
+    // single JSON array, results come back in input order and ids without a
+    // row get an empty vector.
+    static vector<vector<string>> searchMany(const string &table_name, const vector<int> &ids, sqlite3 *db = nullptr)
+    {
+        vector<vector<string>> rows(ids.size());
+        if (ids.empty())
+            return rows;
+
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return rows;
+        }
+
+        string idArray = "[";
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            idArray += (i > 0 ? "," : "") + to_string(ids[i]);
+        }
+        idArray += "]";
+
+        string sql = "SELECT ids.key, " + table_name + ".* FROM json_each(?) AS ids JOIN " + table_name + " ON " + table_name + ".id = ids.value";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return rows;
+        }
+        sqlite3_bind_text(stmt, 1, idArray.c_str(), -1, SQLITE_TRANSIENT);
+
+        int columns = sqlite3_column_count(stmt);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            vector<string> &row = rows[sqlite3_column_int(stmt, 0)];
+            for (int i = 1; i < columns; i++)
+            {
+                const unsigned char *text = sqlite3_column_text(stmt, i);
+                row.push_back(text == nullptr ? "" : reinterpret_cast<const char *>(text));
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        return rows;
+    }
+
+    static vector<optional<AccountRow>> searchAccounts(const string &table_name, const vector<int> &ids, sqlite3 *db = nullptr)
+    {
+        vector<optional<AccountRow>> accounts;
+        for (const vector<string> &row : searchMany(table_name, ids, db))
+        {
+            if (row.empty())
+            {
+                accounts.push_back(nullopt);
+                continue;
+            }
+            AccountRow account;
+            account.id = stoi(row[ACCOUNT_ID]);
+            account.name = row[ACCOUNT_NAME];
+            account.money = stoi(row[ACCOUNT_MONEY]);
+            account.rentedCars = stoi(row[ACCOUNT_RENTED_CARS]);
+            account.fineDue = stoi(row[ACCOUNT_FINE_DUE]);
+            account.record = stoi(row[ACCOUNT_RECORD]);
+            accounts.push_back(account);
+        }
+        return accounts;
+    }
+
+    // Streams every account of table_name to visit in id order, as typed rows
+    static bool forEachAccount(const string &table_name, const function<void(const AccountRow &)> &visit, sqlite3 *db = nullptr)
+    {
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        // The record column is named after the table, so columns are read by position
+        string sql = "SELECT * FROM " + table_name;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return false;
+        }
+
+        AccountRow account;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            const unsigned char *name = sqlite3_column_text(stmt, ACCOUNT_NAME);
+            account.id = sqlite3_column_int(stmt, ACCOUNT_ID);
+            account.name = name == nullptr ? "" : reinterpret_cast<const char *>(name);
+            account.money = sqlite3_column_int(stmt, ACCOUNT_MONEY);
+            account.rentedCars = sqlite3_column_int(stmt, ACCOUNT_RENTED_CARS);
+            account.fineDue = sqlite3_column_int(stmt, ACCOUNT_FINE_DUE);
+            account.record = sqlite3_column_int(stmt, ACCOUNT_RECORD);
+            visit(account);
+        }
+        if (rc != SQLITE_DONE)
+            Log::error("Error reading accounts", db);
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        return rc == SQLITE_DONE;
+    }
+
+    // An account's columns as the display commands print them
+    static Listing accountListing(const string &title, const string &none, const char *recordName)
+    {
+        string suffix = string(", ") + recordName + " Record: ";
+        return {title, none, Renderer::accountColumns(), [suffix](string &out, const vector<string> &account)
+                {
+                    out += account[ACCOUNT_ID];
+                    out += ". ";
+                    out += account[ACCOUNT_NAME];
+                    out += ", $";
+                    out += account[ACCOUNT_MONEY];
+                    out += ", ";
+                    out += account[ACCOUNT_RENTED_CARS];
+                    out += " cars rented, Fine Due: $";
+                    out += account[ACCOUNT_FINE_DUE];
+                    out += suffix;
+                    out += account[ACCOUNT_RECORD];
+                    out += '\n';
+                }};
+    }
+
+    // Writes one account through the session's sink; the table format shows it as three lines
+    static void displayAccount(const string &table_name, int id, const char *role, const string &extraLine = "", sqlite3 *db = nullptr)
+    {
+        optional<AccountRow> account = searchAccounts(table_name, {id}, db)[0];
+        if (!account)
+        {
+            cout << "No " << role << " with ID " << id << "." << endl;
+            return;
+        }
+        string recordName = string(1, toupper(role[0])) + (role + 1);
+        Listing listing{"", "", Renderer::accountColumns(), [&](string &out, const vector<string> &account)
+                        {
+                            out += recordName + " Name: " + account[ACCOUNT_NAME] + ", ID: " + account[ACCOUNT_ID] + "\n";
+                            out += "Money: " + account[ACCOUNT_MONEY] + " Rented Cars: " + account[ACCOUNT_RENTED_CARS] + "\n";
+                            out += "Fine Due: " + account[ACCOUNT_FINE_DUE] + ", " + recordName + " Record: " + account[ACCOUNT_RECORD] + "\n";
+                            out += extraLine;
+                        }};
+        vector<string> values;
+        Renderer::values(*account, values);
+        Renderer::open()->record(listing, values);
+    }
+
+    static bool updateDues(int cusId, int money, int dues, string table, sqlite3 *db = nullptr)
+    {
+        Log::Context context("updateDues", cusId);
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "UPDATE " + table + " SET money = ?, fineDue = ? WHERE id = ?;";
+
+        bool updated = Contention::write(db, "updateDues", [&]
+                                         {
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement for updating", db);
+                return false;
+            }
+
+            // Bind the values of t to the prepared statement
+            sqlite3_bind_int(stmt, 1, money); // Money
+            sqlite3_bind_int(stmt, 2, dues);  // Dues
+            sqlite3_bind_int(stmt, 3, cusId); // ID
+
+            // Execute the statement; no row changed means no such account
+            bool done = sqlite3_step(stmt) == SQLITE_DONE;
+            if (!done)
+            {
+                Log::error("Error updating customers", db);
+            }
+            done = done && sqlite3_changes(db) == 1;
+            sqlite3_finalize(stmt);
+            return done; });
+
+        if (ownDb)
+            sqlite3_close(db);
+        return updated;
+    }
+};
+
+// Counts kept current by triggers, so the dashboard never scans the base
+// tables: cars and available cars per model, and for customers and employees
+// a histogram of record scores with the fines due in each bucket. verify
+// recomputes them from the base tables to catch drift.
+class Aggregates
+{
+public:
+    struct ModelCount
+    {
+        string model;
+        int total = 0;
+        int available = 0;
+    };
+
+    struct RecordBucket
+    {
+        int record = 0;
+        int accounts = 0;
+        long long fineDue = 0;
+    };
+
+private:
+    static string recordColumn(const string &table)
+    {
+        return table == "employees" ? "employeeRecord" : "customerRecord";
+    }
+
+    // Statements recomputing the counts of table from its rows
+    static string recompute(const string &table)
+    {
+        if (table == "cars")
+            return "SELECT model, count(*), sum(available > 0) FROM cars GROUP BY model";
+        return "SELECT '" + table + "', " + recordColumn(table) + ", count(*), sum(fineDue) FROM " + table + " GROUP BY " + recordColumn(table);
+    }
+
+    static string stored(const string &table)
+    {
+        if (table == "cars")
+            return "SELECT model, total, available FROM fleet_stats";
+        return "SELECT tableName, record, accounts, fineDue FROM account_stats WHERE tableName = '" + table + "'";
+    }
+
+public:
+    // Creates the counter tables and the triggers of table, then fills the counts
+    static void create(const string &table, sqlite3 *db)
+    {
+        string sql;
+        if (table == "cars")
+        {
+            string add = "INSERT INTO fleet_stats VALUES (new.model, 1, new.available > 0) ON CONFLICT(model) DO UPDATE SET "
+                         "total = total + 1, available = available + excluded.available;";
+            string remove = "UPDATE fleet_stats SET total = total - 1, available = available - (old.available > 0) WHERE model = old.model; "
+                            "DELETE FROM fleet_stats WHERE model = old.model AND total = 0;";
+            sql = "CREATE TABLE IF NOT EXISTS fleet_stats (model TEXT PRIMARY KEY, total INTEGER NOT NULL, available INTEGER NOT NULL);"
+                  "CREATE TRIGGER IF NOT EXISTS cars_stats_insert AFTER INSERT ON cars BEGIN " + add + " END;"
+                  "CREATE TRIGGER IF NOT EXISTS cars_stats_delete AFTER DELETE ON cars BEGIN " + remove + " END;"
+                  "CREATE TRIGGER IF NOT EXISTS cars_stats_update AFTER UPDATE OF model, available ON cars BEGIN " + remove + add + " END;";
+        }
+        else
+        {
+            string record = recordColumn(table);
+            string add = "INSERT INTO account_stats VALUES ('" + table + "', new." + record + ", 1, new.fineDue) ON CONFLICT(tableName, record) DO UPDATE SET "
+                         "accounts = accounts + 1, fineDue = fineDue + excluded.fineDue;";
+            string remove = "UPDATE account_stats SET accounts = accounts - 1, fineDue = fineDue - old.fineDue WHERE tableName = '" + table + "' AND record = old." + record + "; "
+                            "DELETE FROM account_stats WHERE tableName = '" + table + "' AND record = old." + record + " AND accounts = 0;";
+            sql = "CREATE TABLE IF NOT EXISTS account_stats (tableName TEXT NOT NULL, record INTEGER NOT NULL, accounts INTEGER NOT NULL, fineDue INTEGER NOT NULL, PRIMARY KEY (tableName, record));"
+                  "CREATE TRIGGER IF NOT EXISTS " + table + "_stats_insert AFTER INSERT ON " + table + " BEGIN " + add + " END;"
+                  "CREATE TRIGGER IF NOT EXISTS " + table + "_stats_delete AFTER DELETE ON " + table + " BEGIN " + remove + " END;"
+                  "CREATE TRIGGER IF NOT EXISTS " + table + "_stats_update AFTER UPDATE OF fineDue, " + record + " ON " + table + " BEGIN " + remove + add + " END;";
+        }
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error creating " + table + " aggregates", errmsg);
+            sqlite3_free(errmsg);
+            return;
+        }
+        rebuild(table, db);
+    }
+
+    // Replaces the counts of table with ones recomputed from its rows
+    static bool rebuild(const string &table, sqlite3 *db)
+    {
+        string sql = "SAVEPOINT aggregates;";
+        if (table == "cars")
+            sql += "DELETE FROM fleet_stats; INSERT INTO fleet_stats " + recompute(table) + ";";
+        else
+            sql += "DELETE FROM account_stats WHERE tableName = '" + table + "'; INSERT INTO account_stats " + recompute(table) + ";";
+        sql += "RELEASE aggregates;";
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error rebuilding " + table + " aggregates", errmsg);
+            sqlite3_free(errmsg);
+            sqlite3_exec(db, "ROLLBACK TO aggregates; RELEASE aggregates;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        return true;
+    }
+
+    static vector<ModelCount> models(sqlite3 *db)
+    {
+        vector<ModelCount> counts;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, (stored("cars") + " ORDER BY model").c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return counts;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            counts.push_back({reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2)});
+        }
+        sqlite3_finalize(stmt);
+        return counts;
+    }
+
+    static vector<RecordBucket> records(const string &table, sqlite3 *db)
+    {
+        vector<RecordBucket> buckets;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, (stored(table) + " ORDER BY record").c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return buckets;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            buckets.push_back({sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2), sqlite3_column_int64(stmt, 3)});
+        }
+        sqlite3_finalize(stmt);
+        return buckets;
+    }
+
+    // Number of stored counts that differ from the base tables (each way), or -1 on error
+    static int drift(const string &table, sqlite3 *db)
+    {
+        string sql = "SELECT count(*) FROM (SELECT * FROM (" + stored(table) + " EXCEPT " + recompute(table) + ") UNION ALL "
+                     "SELECT * FROM (" + recompute(table) + " EXCEPT " + stored(table) + "))";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return -1;
+        }
+        int rows = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        return rows;
+    }
+
+    // Compares every counter table with its base table and optionally rebuilds the ones that drifted
+    static bool verify(bool repair, sqlite3 *db = nullptr)
+    {
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+        bool consistent = true;
+        for (const char *table : {"cars", "customers", "employees"})
+        {
+            // Counts and rows are compared inside one transaction, so writers
+            // cannot cause false drift; a busy database retries the table
+            int rows = -1;
+            bool rebuilt = false;
+            bool checked = Contention::write(db, "verifyAggregates", [&]
+                                             {
+                rows = drift(table, db);
+                rebuilt = repair && rows > 0 && rebuild(table, db);
+                return rows >= 0; });
+            if (checked && rows == 0)
+            {
+                cout << table << ": aggregates match." << endl;
+                continue;
+            }
+            consistent = false;
+            if (!checked)
+            {
+                cout << table << ": aggregates could not be checked." << endl;
+                continue;
+            }
+            cout << table << ": " << rows << " aggregate rows differ from the table." << endl;
+            if (rebuilt)
+                cout << table << ": aggregates rebuilt." << endl;
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return consistent;
+    }
+};
+
+// Versions of every car, customer and employee row, so past state can be
+// looked up. Triggers copy each insert or update into <table>_history as a
+// version valid from the current business day until the next write to that
+// row, which closes it. The business day lives in app_clock and is moved
+// forward by rentals and returns, the only writes that carry a date; other
+// writes are stamped with the last day seen. Closed versions older than the
+// retention window are pruned in the background.
+class History
+{
+public:
+    static constexpr int OPEN = INT_MAX; // validTo of a row's current version
+    inline static atomic<int> retentionDays{365};
+
+private:
+    static string columns(const string &table)
+    {
+        if (table == "cars")
+            return "model, year, available, rentedBy, rentedOn, condition, x, y";
+        return "name, money, rentedCars, fineDue, " + string(table == "employees" ? "employeeRecord" : "customerRecord");
+    }
+
+    // "new.a, new.b, ..." for the columns of table
+    static string prefixed(const string &table, const string &prefix)
+    {
+        string list;
+        stringstream names(columns(table));
+        string name;
+        while (getline(names, name, ','))
+        {
+            name.erase(0, name.find_first_not_of(' '));
+            list += (list.empty() ? "" : ", ") + prefix + name;
+        }
+        return list;
+    }
+
+    static bool exec(sqlite3 *db, const string &sql, const string &what)
+    {
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error(what, errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    }
+
+    // Adds the columns a history table made by an older version lacks (such
+    // as the cars' location). Current versions take the row's value; older
+    // ones keep NULL, as the value was not recorded then. The triggers are
+    // dropped so they are made again copying the new columns.
+    static void addMissingColumns(const string &table, sqlite3 *db)
+    {
+        string history = table + "_history";
+        vector<string> existing;
+        sqlite3_stmt *stmt;
+        string sql = "SELECT name FROM pragma_table_info('" + history + "')";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            return;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            existing.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+        }
+        sqlite3_finalize(stmt);
+        if (existing.empty())
+            return; // Not made yet
+
+        sql.clear();
+        stringstream names(columns(table));
+        string name;
+        while (getline(names, name, ','))
+        {
+            name.erase(0, name.find_first_not_of(' '));
+            if (find(existing.begin(), existing.end(), name) != existing.end())
+                continue;
+            sql += "ALTER TABLE " + history + " ADD COLUMN " + name + ";"
+                   "UPDATE " + history + " SET " + name + " = (SELECT " + name + " FROM " + table + " WHERE " + table + ".id = " + history + ".id) "
+                   "WHERE validTo = " + to_string(OPEN) + ";";
+        }
+        if (sql.empty())
+            return;
+        sql += "DROP TRIGGER IF EXISTS " + table + "_history_insert;"
+               "DROP TRIGGER IF EXISTS " + table + "_history_update;";
+        exec(db, sql, "Error adding columns to " + history);
+    }
+
+public:
+    // Creates the clock, the history table and triggers of table, and gives
+    // rows without a current version one from today
+    static void create(const string &table, sqlite3 *db)
+    {
+        addMissingColumns(table, db);
+        string history = table + "_history";
+        string today = "(SELECT day FROM app_clock WHERE id = 1)";
+        string open = "INSERT INTO " + history + " (id, " + columns(table) + ", validFrom, validTo) VALUES (new.id, " +
+                      prefixed(table, "new.") + ", " + today + ", " + to_string(OPEN) + ");";
+        // A version opened and closed on the same day was never visible at the end of any day
+        string close = "UPDATE " + history + " SET validTo = " + today + " WHERE id = old.id AND validTo = " + to_string(OPEN) + "; "
+                       "DELETE FROM " + history + " WHERE id = old.id AND validTo = " + today + " AND validFrom = validTo;";
+        string sql = "CREATE TABLE IF NOT EXISTS app_clock (id INTEGER PRIMARY KEY CHECK (id = 1), day INTEGER NOT NULL);"
+                     "INSERT OR IGNORE INTO app_clock VALUES (1, 0);"
+                     "CREATE TABLE IF NOT EXISTS " + history + " (version INTEGER PRIMARY KEY, id INTEGER NOT NULL, " + columns(table) + ", "
+                     "validFrom INTEGER NOT NULL, validTo INTEGER NOT NULL);"
+                     "CREATE INDEX IF NOT EXISTS " + history + "_id ON " + history + " (id, validTo);"
+                     "CREATE INDEX IF NOT EXISTS " + history + "_end ON " + history + " (validTo);"
+                     "CREATE TRIGGER IF NOT EXISTS " + table + "_history_insert AFTER INSERT ON " + table + " BEGIN " + open + " END;"
+                     "CREATE TRIGGER IF NOT EXISTS " + table + "_history_update AFTER UPDATE OF " + columns(table) + " ON " + table + " BEGIN " + close + open + " END;"
+                     "CREATE TRIGGER IF NOT EXISTS " + table + "_history_delete AFTER DELETE ON " + table + " BEGIN " + close + " END;"
+                     "INSERT INTO " + history + " (id, " + columns(table) + ", validFrom, validTo) SELECT id, " + columns(table) + ", " + today + ", " +
+                     to_string(OPEN) + " FROM " + table + " WHERE id NOT IN (SELECT id FROM " + history + " WHERE validTo = " + to_string(OPEN) + ");";
+        exec(db, sql, "Error creating " + table + " history");
+    }
+
+    // Moves the business day forward to day (never back). Databases without
+    // history, such as benchmark scratch files, have no clock and are skipped.
+    static void advanceClock(int day, sqlite3 *db)
+    {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "UPDATE app_clock SET day = max(day, ?) WHERE id = 1", -1, &stmt, nullptr) != SQLITE_OK)
+            return;
+        sqlite3_bind_int(stmt, 1, day);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+
+    static int today(sqlite3 *db)
+    {
+        int day = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT day FROM app_clock WHERE id = 1", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                day = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return day;
+    }
+
+    // The car as it was at the end of day; false if it did not exist then
+    static bool carAsOf(int id, int day, CarRow &car, sqlite3 *db = nullptr)
+    {
+        bool found = false;
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+        // The first version ending after day is the one covering it, if it had started
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT model, year, available, rentedBy, rentedOn, condition, x, y FROM cars_history "
+                                   "WHERE id = ?1 AND validTo > ?2 AND validFrom <= ?2 ORDER BY validTo LIMIT 1",
+                               -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+        }
+        else
+        {
+            sqlite3_bind_int(stmt, 1, id);
+            sqlite3_bind_int(stmt, 2, day);
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                const unsigned char *year = sqlite3_column_text(stmt, 1);
+                car.id = id;
+                car.model = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+                car.year = year == nullptr ? "" : reinterpret_cast<const char *>(year);
+                car.available = sqlite3_column_int(stmt, 2);
+                car.rentedBy = sqlite3_column_int(stmt, 3);
+                car.rentedOn = sqlite3_column_int(stmt, 4);
+                car.condition = sqlite3_column_int(stmt, 5);
+                car.x = sqlite3_column_double(stmt, 6); // NULL (0) before location was versioned
+                car.y = sqlite3_column_double(stmt, 7);
+                found = true;
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return found;
+    }
+
+    // The customer or employee as they were at the end of day
+    static bool accountAsOf(const string &table, int id, int day, AccountRow &account, sqlite3 *db = nullptr)
+    {
+        bool found = false;
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+        string sql = "SELECT " + columns(table) + " FROM " + table + "_history WHERE id = ?1 AND validTo > ?2 AND validFrom <= ?2 ORDER BY validTo LIMIT 1";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+        }
+        else
+        {
+            sqlite3_bind_int(stmt, 1, id);
+            sqlite3_bind_int(stmt, 2, day);
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                account.id = id;
+                account.name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+                account.money = sqlite3_column_int(stmt, 1);
+                account.rentedCars = sqlite3_column_int(stmt, 2);
+                account.fineDue = sqlite3_column_int(stmt, 3);
+                account.record = sqlite3_column_int(stmt, 4);
+                found = true;
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return found;
+    }
+
+    // Deletes versions that ended more than keepDays before today, a chunk
+    // per transaction so writers are not held up; returns how many went
+    static long long prune(int keepDays, sqlite3 *db)
+    {
+        long long removed = 0;
+        int cutoff = today(db) - keepDays;
+        for (const char *table : {"cars", "customers", "employees"})
+        {
+            string history = string(table) + "_history";
+            string sql = "DELETE FROM " + history + " WHERE version IN (SELECT version FROM " + history + " WHERE validTo < ? LIMIT 1000)";
+            int changes = 1;
+            while (changes > 0)
+            {
+                changes = 0;
+                bool ok = Contention::write(db, "prune", [&]
+                                            {
+                    sqlite3_stmt *stmt;
+                    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                        return false;
+                    sqlite3_bind_int(stmt, 1, cutoff);
+                    bool done = sqlite3_step(stmt) == SQLITE_DONE;
+                    changes = sqlite3_changes(db);
+                    sqlite3_finalize(stmt);
+                    return done; });
+                if (!ok)
+                {
+                    Log::error("Error pruning " + history, db);
+                    return removed;
+                }
+                removed += changes;
+            }
+        }
+        return removed;
+    }
+
+    static void report(sqlite3 *db)
+    {
+        cout << "Business day: " << today(db) << ", versions kept for " << retentionDays << " days after they end" << endl;
+        for (const char *table : {"cars", "customers", "employees"})
+        {
+            string sql = "SELECT count(*), sum(validTo = " + to_string(OPEN) + ") FROM " + string(table) + "_history";
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                continue;
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                cout << table << ": " << sqlite3_column_int64(stmt, 0) << " versions, " << sqlite3_column_int64(stmt, 1) << " current" << endl;
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    // Prunes the main database every intervalSeconds while it exists
+    class Pruner
+    {
+    private:
+        thread worker;
+        mutex lock;
+        condition_variable wake;
+        bool stopping = false;
+
+    public:
+        Pruner(int intervalSeconds = 60)
+        {
+            worker = thread([this, intervalSeconds]
+                            {
+                unique_lock<mutex> guard(lock);
+                while (!wake.wait_for(guard, chrono::seconds(intervalSeconds), [this] { return stopping; }))
+                {
+                    guard.unlock();
+                    sqlite3 *db;
+                    if (Db::connectToDatabase(&db))
+                    {
+                        long long removed = prune(retentionDays, db);
+                        if (removed > 0)
+                            Log::info("Pruned " + to_string(removed) + " old versions");
+                        sqlite3_close(db);
+                    }
+                    guard.lock();
+                } });
+        }
+
+        ~Pruner()
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            worker.join();
+        }
+    };
+};
+
+// Hierarchical timer wheel. Level 0 has one slot per tick; each higher level
+// covers 64 slots of the level below and is cascaded down a slot at a time as
+// the wheel turns, so scheduling and expiring are O(1) per timer however many
+// are pending. The wheel only moves when advance is called.
+class TimerWheel
+{
+private:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 3;
+
+    struct Timer
+    {
+        uint64_t tick;
+        uint64_t id;
+    };
+
+    vector<Timer> slots[LEVELS][SLOTS];
+    uint64_t current;
+    size_t pending = 0;
+
+    void place(const Timer &timer)
+    {
+        uint64_t delta = timer.tick - current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+            level++;
+        // Timers beyond the top level wait in its farthest slot and are placed again from there
+        uint64_t tick = min<uint64_t>(timer.tick, current + (1ULL << (SLOT_BITS * LEVELS)) - 1);
+        slots[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(timer);
+    }
+
+    void cascade(int level)
+    {
+        vector<Timer> timers;
+        timers.swap(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+        for (const Timer &timer : timers)
+        {
+            place(timer);
+        }
+    }
+
+public:
+    explicit TimerWheel(uint64_t now = 0) : current(now) {}
+
+    size_t size() const
+    {
+        return pending;
+    }
+
+    // Timers due at or before the current tick fire on the next advance
+    void schedule(uint64_t id, uint64_t tick)
+    {
+        place({max(tick, current + 1), id});
+        pending++;
+    }
+
+    // Turns the wheel to tick, appending the ids of timers that fired
+    void advance(uint64_t tick, vector<uint64_t> &fired)
+    {
+        while (current < tick)
+        {
+            if (pending == 0)
+            {
+                current = tick;
+                break;
+            }
+            current++;
+            for (int level = 1; level < LEVELS && (current & ((1ULL << (SLOT_BITS * level)) - 1)) == 0; level++)
+            {
+                cascade(level);
+            }
+            vector<Timer> &due = slots[0][current & (SLOTS - 1)];
+            for (const Timer &timer : due)
+            {
+                fired.push_back(timer.id);
+            }
+            pending -= due.size();
+            due.clear();
+        }
+    }
+};
+
+// Read-only connection pinned to one point-in-time WAL snapshot. Reports run
+// against it see a consistent view and neither block nor wait for writers.
+class ReadSnapshot
+{
+private:
+    sqlite3 *db = nullptr;
+
+public:
+    ReadSnapshot(const string &file = Db::getDatabaseFile())
+    {
+        if (sqlite3_open_v2(file.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error opening read snapshot", db);
+            sqlite3_close(db);
+            db = nullptr;
+            return;
+        }
+
+        // The snapshot is taken by the first read inside the transaction
+        char *errmsg;
+        if (sqlite3_exec(db, "BEGIN; SELECT count(*) FROM sqlite_master;", nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error starting read snapshot", errmsg);
+            sqlite3_free(errmsg);
+        }
+    }
+
+    ~ReadSnapshot()
+    {
+        if (db != nullptr)
+        {
+            sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+            sqlite3_close(db);
+        }
+    }
+
+    ReadSnapshot(const ReadSnapshot &) = delete;
+    ReadSnapshot &operator=(const ReadSnapshot &) = delete;
+
+    sqlite3 *handle() const
+    {
+        return db;
+    }
+};
+
+// Storage operations needed by the rental logic. Rows are whole table rows
+// in column order with the id first, the same shape CarDb::searchCar returns.
+class StorageEngine
+{
+public:
+    virtual ~StorageEngine() {}
+
+    virtual bool get(const string &table, int id, vector<string> &row) = 0;
+    // Inserts a row (its id column is ignored) and returns the new id, or -1
+    virtual int insert(const string &table, const vector<string> &row) = 0;
+    // Replaces an existing row
+    virtual bool put(const string &table, int id, const vector<string> &row) = 0;
+    virtual bool erase(const string &table, int id) = 0;
+    // Visits rows in id order until visit returns false
+    virtual void scan(const string &table, const function<bool(const vector<string> &)> &visit) = 0;
+    // Applies changes (column -> value) only if the column currently holds expected
+    virtual bool conditionalUpdate(const string &table, int id, int column, const string &expected, const map<int, string> &changes) = 0;
+    // Runs work atomically, rolling back if it returns false
+    virtual bool transaction(const function<bool()> &work) = 0;
+};
+
+// Engine keeping every table in memory: rows live in a vector indexed by id
+// and a transaction keeps an undo log of the rows it overwrote.
+class MemoryEngine : public StorageEngine
+{
+private:
+    unordered_map<string, vector<vector<string>>> tables; // empty row = no row with that id
+    vector<tuple<string, int, vector<string>>> undoLog;
+    bool inTransaction = false;
+    recursive_mutex lock;
+
+    vector<vector<string>> &rowsOf(const string &table)
+    {
+        vector<vector<string>> &rows = tables[table];
+        if (rows.empty())
+            rows.emplace_back(); // ids start at 1
+        return rows;
+    }
+
+    void remember(const string &table, int id, const vector<string> &row)
+    {
+        if (inTransaction)
+            undoLog.emplace_back(table, id, row);
+    }
+
+public:
+    bool get(const string &table, int id, vector<string> &row) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        vector<vector<string>> &rows = rowsOf(table);
+        if (id <= 0 || id >= (int)rows.size() || rows[id].empty())
+            return false;
+        row = rows[id];
+        return true;
+    }
+
+    int insert(const string &table, const vector<string> &row) override
+    {
+        if (row.empty())
+            return -1; // Not even an id column, as SQLite would refuse it
+        lock_guard<recursive_mutex> guard(lock);
+        vector<vector<string>> &rows = rowsOf(table);
+        int id = rows.size();
+        remember(table, id, {});
+        rows.push_back(row);
+        rows[id][0] = to_string(id);
+        return id;
+    }
+
+    bool put(const string &table, int id, const vector<string> &row) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        vector<vector<string>> &rows = rowsOf(table);
+        if (id <= 0 || id >= (int)rows.size() || rows[id].empty())
+            return false;
+        remember(table, id, rows[id]);
+        rows[id] = row;
+        rows[id][0] = to_string(id);
+        return true;
+    }
+
+    bool erase(const string &table, int id) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        vector<vector<string>> &rows = rowsOf(table);
+        if (id <= 0 || id >= (int)rows.size() || rows[id].empty())
+            return false;
+        remember(table, id, rows[id]);
+        rows[id].clear();
+        return true;
+    }
+
+    void scan(const string &table, const function<bool(const vector<string> &)> &visit) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        for (const vector<string> &row : rowsOf(table))
+        {
+            if (!row.empty() && !visit(row))
+                return;
+        }
+    }
+
+    bool conditionalUpdate(const string &table, int id, int column, const string &expected, const map<int, string> &changes) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        vector<vector<string>> &rows = rowsOf(table);
+        if (id <= 0 || id >= (int)rows.size() || rows[id].empty() || rows[id][column] != expected)
+            return false;
+        remember(table, id, rows[id]);
+        for (const auto &change : changes)
+        {
+            rows[id][change.first] = change.second;
+        }
+        return true;
+    }
+
+    bool transaction(const function<bool()> &work) override
+    {
+        lock_guard<recursive_mutex> guard(lock);
+        if (inTransaction)
+            return work(); // Nested work joins the outer transaction
+
+        inTransaction = true;
+        bool committed = work();
+        if (!committed)
+        {
+            // Undo in reverse order so the oldest copy of each row wins
+            for (auto it = undoLog.rbegin(); it != undoLog.rend(); ++it)
+            {
+                vector<vector<string>> &rows = tables[std::get<0>(*it)];
+                int id = std::get<1>(*it);
+                rows[id] = std::get<2>(*it);
+                if (rows[id].empty() && id == (int)rows.size() - 1)
+                    rows.pop_back(); // Give back ids of rolled back inserts
+            }
+        }
+        undoLog.clear();
+        inTransaction = false;
+        return committed;
+    }
+};
+
+// Engine backed by a SQLite connection, with its statements cached per SQL text
+class SqliteEngine : public StorageEngine
+{
+private:
+    sqlite3 *db;
+    bool ownDb;
+    map<string, vector<string>> columns;
+    map<string, sqlite3_stmt *> statements;
+
+    sqlite3_stmt *prepare(const string &sql)
+    {
+        auto it = statements.find(sql);
+        if (it != statements.end())
+        {
+            sqlite3_reset(it->second);
+            sqlite3_clear_bindings(it->second);
+            return it->second;
+        }
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return nullptr;
+        }
+        statements[sql] = stmt;
+        return stmt;
+    }
+
+    const vector<string> &columnsOf(const string &table)
+    {
+        auto it = columns.find(table);
+        if (it != columns.end())
+            return it->second;
+        vector<string> &names = columns[table];
+        sqlite3_stmt *stmt = prepare("PRAGMA table_info(" + table + ")");
+        while (stmt != nullptr && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            names.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
+        }
+        return names;
+    }
+
+    static vector<string> readRow(sqlite3_stmt *stmt)
+    {
+        vector<string> row;
+        int count = sqlite3_column_count(stmt);
+        for (int i = 0; i < count; i++)
+        {
+            const unsigned char *text = sqlite3_column_text(stmt, i);
+            row.push_back(text == nullptr ? "" : reinterpret_cast<const char *>(text));
+        }
+        return row;
+    }
+
+    bool execute(const string &sql)
+    {
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error executing statement", errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    SqliteEngine(sqlite3 *db = nullptr) : db(db), ownDb(db == nullptr)
+    {
+        if (ownDb && !Db::connectToDatabase(&this->db))
+            this->db = nullptr;
+    }
+
+    SqliteEngine(const string &file) : ownDb(true)
+    {
+        if (!Db::connectToDatabase(&db, file))
+            db = nullptr;
+    }
+
+    ~SqliteEngine()
+    {
+        for (auto &statement : statements)
+        {
+            sqlite3_finalize(statement.second);
+        }
+        if (ownDb && db != nullptr)
+            sqlite3_close(db);
+    }
+
+    SqliteEngine(const SqliteEngine &) = delete;
+    SqliteEngine &operator=(const SqliteEngine &) = delete;
+
+    sqlite3 *handle() const
+    {
+        return db;
+    }
+
+private:
+    inline static map<sqlite3 *, shared_ptr<SqliteEngine>> kept;
+    inline static mutex keptLock;
+
+public:
+    // Keeps an engine for a long-lived connection, so every rental and return
+    // on it reuses the same statements. Its owner calls release before
+    // closing the connection, since SQLite will not close a connection that
+    // still has prepared statements.
+    static void keep(sqlite3 *db)
+    {
+        lock_guard<mutex> guard(keptLock);
+        if (kept.find(db) == kept.end())
+            kept[db] = make_shared<SqliteEngine>(db);
+    }
+
+    static void release(sqlite3 *db)
+    {
+        lock_guard<mutex> guard(keptLock);
+        kept.erase(db);
+    }
+
+    // The engine kept for db, or one that lives for the caller's use only
+    static shared_ptr<SqliteEngine> forConnection(sqlite3 *db)
+    {
+        {
+            lock_guard<mutex> guard(keptLock);
+            auto it = kept.find(db);
+            if (it != kept.end())
+                return it->second;
+        }
+        return make_shared<SqliteEngine>(db);
+    }
+
+    bool get(const string &table, int id, vector<string> &row) override
+    {
+        sqlite3_stmt *stmt = prepare("SELECT * FROM " + table + " WHERE id = ?");
+        if (stmt == nullptr)
+            return false;
+        sqlite3_bind_int(stmt, 1, id);
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        if (found)
+            row = readRow(stmt);
+        // An active statement would keep its read snapshot open
+        sqlite3_reset(stmt);
+        return found;
+    }
+
+    int insert(const string &table, const vector<string> &row) override
+    {
+        const vector<string> &names = columnsOf(table);
+        string sql = "INSERT INTO " + table + " (";
+        string values;
+        for (size_t i = 1; i < names.size() && i < row.size(); i++)
+        {
+            sql += (i > 1 ? ", " : "") + names[i];
+            values += (i > 1 ? ", ?" : "?");
+        }
+        sqlite3_stmt *stmt = prepare(sql + ") VALUES (" + values + ")");
+        if (stmt == nullptr)
+            return -1;
+        for (size_t i = 1; i < names.size() && i < row.size(); i++)
+        {
+            sqlite3_bind_text(stmt, i, row[i].c_str(), -1, SQLITE_TRANSIENT);
+        }
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error inserting " + table, db);
+            return -1;
+        }
+        IdFilter::of(table).insert(sqlite3_last_insert_rowid(db), db);
+        return sqlite3_last_insert_rowid(db);
+    }
+
+    bool put(const string &table, int id, const vector<string> &row) override
+    {
+        const vector<string> &names = columnsOf(table);
+        string sql = "UPDATE " + table + " SET ";
+        for (size_t i = 1; i < names.size() && i < row.size(); i++)
+        {
+            sql += (i > 1 ? ", " : "") + names[i] + " = ?";
+        }
+        sqlite3_stmt *stmt = prepare(sql + " WHERE id = ?");
+        if (stmt == nullptr)
+            return false;
+        int bound = 0;
+        for (size_t i = 1; i < names.size() && i < row.size(); i++)
+        {
+            sqlite3_bind_text(stmt, ++bound, row[i].c_str(), -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_bind_int(stmt, bound + 1, id);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error updating " + table, db);
+            return false;
+        }
+        return sqlite3_changes(db) == 1;
+    }
+
+    bool erase(const string &table, int id) override
+    {
+        sqlite3_stmt *stmt = prepare("DELETE FROM " + table + " WHERE id = ?");
+        if (stmt == nullptr)
+            return false;
+        sqlite3_bind_int(stmt, 1, id);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error deleting from " + table, db);
+            return false;
+        }
+        if (sqlite3_changes(db) != 1)
+            return false;
+        IdFilter::of(table).erase(id, db);
+        return true;
+    }
+
+    void scan(const string &table, const function<bool(const vector<string> &)> &visit) override
+    {
+        sqlite3_stmt *stmt = prepare("SELECT * FROM " + table + " ORDER BY id");
+        while (stmt != nullptr && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            if (!visit(readRow(stmt)))
+                break;
+        }
+        if (stmt != nullptr)
+            sqlite3_reset(stmt);
+    }
+
+    bool conditionalUpdate(const string &table, int id, int column, const string &expected, const map<int, string> &changes) override
+    {
+        const vector<string> &names = columnsOf(table);
+        string sql = "UPDATE " + table + " SET ";
+        bool first = true;
+        for (const auto &change : changes)
+        {
+            sql += (first ? "" : ", ") + names[change.first] + " = ?";
+            first = false;
+        }
+        sqlite3_stmt *stmt = prepare(sql + " WHERE id = ? AND " + names[column] + " = ?");
+        if (stmt == nullptr)
+            return false;
+        int bound = 0;
+        for (const auto &change : changes)
+        {
+            sqlite3_bind_text(stmt, ++bound, change.second.c_str(), -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_bind_int(stmt, bound + 1, id);
+        sqlite3_bind_text(stmt, bound + 2, expected.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error updating " + table, db);
+            return false;
+        }
+        return sqlite3_changes(db) == 1;
+    }
+
+    bool transaction(const function<bool()> &work) override
+    {
+        if (!sqlite3_get_autocommit(db))
+            return work(); // Nested work joins the outer transaction
+
+        if (!execute("BEGIN;"))
+            return false;
+        if (!work())
+        {
+            execute("ROLLBACK;");
+            return false;
+        }
+        return execute("COMMIT;");
+    }
+};
+
+class CarDb : public Db
+{
+private:
+    inline static const vector<vector<string>> defaultData = {
+        {"Lamborghini Aventador", "2023", "1", "-1", "-1", "100"},
+        {"Ferrari F8", "2022", "1", "-1", "-1", "100"},
+        {"Porsche 911", "2021", "1", "-1", "-1", "100"},
+        {"Koenigsegg Agera", "2021", "1", "-1", "-1", "100"},
+        {"Bugatti Veyron", "2020", "1", "-1", "-1", "100"},
+        {"Rolls Royce Spectre", "2019", "1", "-1", "-1", "100"}};
+
+    void load(sqlite3 *db)
+    {
+        if (isTableEmpty(db, tablename))
+        {
+            Log::info("Loading default cars");
+            for (const vector<string> &data : defaultData)
+            {
+                add(data, db);
+            }
+        }
+    }
+
+public:
+    inline static const string schema = "CREATE TABLE IF NOT EXISTS cars (id INTEGER PRIMARY KEY AUTOINCREMENT, model TEXT NOT NULL, year TEXT, available INTEGER NOT NULL DEFAULT 1, rentedBy INTEGER NOT NULL DEFAULT -1, rentedOn INTEGER NOT NULL DEFAULT -1, condition INTEGER NOT NULL DEFAULT 100 CHECK (condition >= 0 AND condition <= 100), x REAL NOT NULL DEFAULT 0, y REAL NOT NULL DEFAULT 0, FOREIGN KEY(rentedBy) REFERENCES customers(id) ON DELETE SET DEFAULT)";
+
+    // Cars per renter, for counting an account's rentals without a scan
+    inline static const string rentedByIndex = "CREATE INDEX IF NOT EXISTS cars_rented_by ON cars (rentedBy)";
+
+    // Checkout holds; a hold counts only until expiresAt (unix time in ms)
+    inline static const string holdsSchema = "CREATE TABLE IF NOT EXISTS holds (carId INTEGER PRIMARY KEY, holder INTEGER NOT NULL, holderTable TEXT NOT NULL, token INTEGER NOT NULL, expiresAt INTEGER NOT NULL)";
+
+    CarDb()
+    {
+        tablename = "cars";
+        sqlite3 *db;
+        connectToDatabase(&db);
+        auto start = chrono::steady_clock::now();
+        if (!schemaCurrent)
+        {
+            // string sql_customers = "CREATE TABLE IF NOT EXISTS customers (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, password TEXT NOT NULL, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue DOUBLE NOT NULL DEFAULT 0, customerRecord DOUBLE NOT NULL DEFAULT 0)";
+            createTable(db, schema);
+            addLocation(db);
+            createSearchIndex(db);
+            createTable(db, holdsSchema);
+            createTable(db, rentedByIndex);
+            trackChanges(db, "model, year, available, rentedBy, rentedOn, condition, x, y");
+            load(db);
+            Aggregates::create(tablename, db);
+            History::create(tablename, db);
+            start = StartupProfile::record("schema setup", start);
+        }
+        else
+        {
+            // Checked on every start, since a stamped schema does not prove its triggers were made
+            createSearchIndex(db);
+        }
+        if (!schemaCurrent || !FleetSnapshot::restore(db))
+        {
+            IdFilter::of(tablename).load(tablename, db);
+            StartupProfile::record("index scans", start);
+        }
+        sqlite3_close(db);
+    }
+
+    // Adds the location columns to a cars table made before cars had them.
+    // Cars already in it are placed at (0, 0) until moved.
+    static void addLocation(sqlite3 *db)
+    {
+        bool exists = false;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('cars') WHERE name = 'x'", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            exists = sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
+        }
+        if (exists)
+            return;
+
+        // The change counter's update trigger is recreated to watch the new columns
+        string sql = "ALTER TABLE cars ADD COLUMN x REAL NOT NULL DEFAULT 0;"
+                     "ALTER TABLE cars ADD COLUMN y REAL NOT NULL DEFAULT 0;"
+                     "DROP TRIGGER IF EXISTS cars_changes_update;";
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error adding car locations", errmsg);
+            sqlite3_free(errmsg);
+        }
+    }
+
+    // Full-text index over model and year, kept in sync with cars by triggers
+    static void createSearchIndex(sqlite3 *db)
+    {
+        // The table and its three triggers; anything missing (say a trigger
+        // that failed to create) is made again and the index rebuilt
+        int parts = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE name IN ('cars_fts', 'cars_fts_insert', 'cars_fts_delete', 'cars_fts_update')",
+                               -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                parts = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        if (parts == 4)
+            return;
+
+        string sql = "CREATE VIRTUAL TABLE IF NOT EXISTS cars_fts USING fts5(model, year, content='cars', content_rowid='id', prefix='2 3');"
+                     "CREATE TRIGGER IF NOT EXISTS cars_fts_insert AFTER INSERT ON cars BEGIN "
+                     "INSERT INTO cars_fts(rowid, model, year) VALUES (new.id, new.model, new.year); END;"
+                     "CREATE TRIGGER IF NOT EXISTS cars_fts_delete AFTER DELETE ON cars BEGIN "
+                     "INSERT INTO cars_fts(cars_fts, rowid, model, year) VALUES ('delete', old.id, old.model, old.year); END;"
+                     "CREATE TRIGGER IF NOT EXISTS cars_fts_update AFTER UPDATE OF model, year ON cars BEGIN "
+                     "INSERT INTO cars_fts(cars_fts, rowid, model, year) VALUES ('delete', old.id, old.model, old.year); "
+                     "INSERT INTO cars_fts(rowid, model, year) VALUES (new.id, new.model, new.year); END;"
+                     "INSERT INTO cars_fts(cars_fts) VALUES ('rebuild');"; // Index cars added before the index existed
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error creating car search index", errmsg);
+            sqlite3_free(errmsg);
+        }
+    }
+
+    // Cars whose model or year start with each word of text, best match first.
+    // Each result is {id, model, year, available, condition}.
+    static vector<vector<string>> findCars(const string &text, int limit, sqlite3 *db = nullptr)
+    {
+        // Every word becomes a quoted prefix term, e.g. lambo -> "lambo"*
+        string match;
+        string word;
+        for (size_t i = 0; i <= text.size(); i++)
+        {
+            if (i < text.size() && isalnum((unsigned char)text[i]))
+            {
+                word += text[i];
+            }
+            else if (!word.empty())
+            {
+                match += (match.empty() ? "\"" : " \"") + word + "\"*";
+                word.clear();
+            }
+        }
+        if (match.empty())
+            return {};
+
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return {};
+        }
+        string sql = "SELECT cars.id, cars.model, cars.year, cars.available, cars.condition FROM cars_fts JOIN cars ON cars.id = cars_fts.rowid "
+                     "WHERE cars_fts MATCH ? ORDER BY rank LIMIT ?";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return {};
+        }
+        sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, limit);
+
+        vector<vector<string>> cars;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            cars.push_back({to_string(sqlite3_column_int(stmt, 0)),
+                            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+                            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+                            to_string(sqlite3_column_int(stmt, 3)),
+                            to_string(sqlite3_column_int(stmt, 4))});
+        }
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        return cars;
+    }
+
+    static void displayFoundCars(const string &text, int limit = 10)
+    {
+        // findCars gives id, model, year, available and condition
+        Listing listing{"Cars matching \"" + text + "\":", "No cars match \"" + text + "\".",
+                        {{"id", true}, {"model", false}, {"year", false}, {"available", true}, {"condition", true}},
+                        [](string &out, const vector<string> &car)
+                        {
+                            out += car[0] + ". " + car[1] + " (" + car[2] + "), " + (car[3] == "1" ? "Available" : "Rented") + ", Condition: " + car[4] + "%\n";
+                        }};
+        unique_ptr<RowSink> sink = Renderer::open();
+        sink->begin(listing);
+        for (const vector<string> &car : findCars(text, limit))
+        {
+            sink->row(car);
+        }
+        sink->end();
+    }
+
+    // Runs "findCar <text>", asking for the text when the line has none
+    static void runFindCar(string line)
+    {
+        if (line.find_first_not_of(" \t") == string::npos)
+        {
+            cout << "Enter the car to look for: ";
+            getline(cin, line);
+        }
+        line.erase(0, line.find_first_not_of(" \t"));
+        displayFoundCars(line);
+    }
+
+    // Seeds a storage engine with count cars cycling through the default models
+    static void seed(StorageEngine &engine, int count = defaultData.size())
+    {
+        for (int i = 0; i < count; i++)
+        {
+            add(engine, defaultData[i % defaultData.size()]);
+        }
+    }
+
+    // Adds a car (model, year, available, rentedBy, rentedOn, condition) on any
+    // storage engine and returns its id, or -1. The car is placed at the
+    // origin, spelled the way SQLite reads back a REAL 0 so rows match on
+    // every engine.
+    static int add(StorageEngine &engine, const vector<string> &car)
+    {
+        vector<string> row = {""};
+        row.insert(row.end(), car.begin(), car.end());
+        row.resize(CAR_Y + 1, "0.0");
+        return engine.insert("cars", row);
+    }
+
+    // Replaces the columns from model to condition of a whole car row; the
+    // location is left as it is
+    template <typename Row> // vector<string> or ArenaRow
+    static bool update(StorageEngine &engine, int id, const Row &car)
+    {
+        map<int, string> changes;
+        for (int column = CAR_MODEL; column <= CAR_CONDITION; column++)
+        {
+            changes[column] = string(car[column]);
+        }
+        return engine.conditionalUpdate("cars", id, CAR_ID, to_string(id), changes);
+    }
+
+    static bool erase(StorageEngine &engine, int id)
+    {
+        return engine.erase("cars", id);
+    }
+
+    static bool searchRentableCar(int id, sqlite3 *db = nullptr)
+    {
+        if (!IdFilter::of("cars").mayContain(id, db))
+            return false;
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "SELECT EXISTS (SELECT 1 FROM cars WHERE id = ? AND available=1);";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            return false;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, id);
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            Log::error("Error executing statement", db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        // Check if EXISTS returned 1 (first column)
+        bool exists = sqlite3_column_int(stmt, 0) == 1;
+
+        sqlite3_finalize(stmt);
+        return exists;
+    }
+
+    // The car's row, in the request arena while a command is handled; empty if there is none
+    static ArenaRow searchCar(int id, sqlite3 *db = nullptr)
+    {
+        ArenaRow car(RequestArena::resource());
+        if (!searchRow("cars", id, car, db))
+            car.clear();
+        return car;
+    }
+
+    // Ids of cars matching every predicate of query, answered from the columnar copy
+    static vector<int> searchCars(const CarQuery &query)
+    {
+        CarColumns &columns = CarColumns::fleet();
+        if (!columns.isLoaded())
+        {
+            sqlite3 *db;
+            if (!connectToDatabase(&db))
+                return {};
+            columns.load(db);
+            sqlite3_close(db);
+        }
+        return columns.search(query);
+    }
+
+    // Cars for many ids with one statement, in input order; missing ids give nullopt
+    static vector<optional<CarRow>> searchCars(const vector<int> &ids, sqlite3 *db = nullptr)
+    {
+        vector<optional<CarRow>> cars;
+        for (const vector<string> &row : searchMany("cars", ids, db))
+        {
+            if (row.empty())
+            {
+                cars.push_back(nullopt);
+                continue;
+            }
+            CarRow car;
+            car.id = stoi(row[CAR_ID]);
+            car.model = row[CAR_MODEL];
+            car.year = row[CAR_YEAR];
+            car.available = stoi(row[CAR_AVAILABLE]);
+            car.rentedBy = stoi(row[CAR_RENTED_BY]);
+            car.rentedOn = stoi(row[CAR_RENTED_ON]);
+            car.condition = stoi(row[CAR_CONDITION]);
+            car.x = stod(row[CAR_X]);
+            car.y = stod(row[CAR_Y]);
+            cars.push_back(car);
+        }
+        return cars;
+    }
+
+    static void displayCar(int id, sqlite3 *db = nullptr)
+    {
+        optional<CarRow> car = searchCars(vector<int>{id}, db)[0];
+        if (!car)
+        {
+            cout << "No car with ID " << id << "." << endl;
+            return;
+        }
+        displayCar(*car);
+    }
+
+    static void displayCar(const CarRow &car)
+    {
+        vector<string> values;
+        Renderer::values(car, values);
+        Renderer::open()->record(carListing(), values);
+    }
+
+#ifdef __unix__
+    // Rows per second listing every car into /dev/null, printing a line at a
+    // time with a flush each as the listings used to, then through each sink
+    static void benchmarkListing()
+    {
+        sqlite3 *db;
+        if (!connectToDatabase(&db))
+            return;
+        ofstream out("/dev/null");
+        forEachCar("1", 0, [](const CarRow &) {}, db); // Warm the page cache
+
+        auto report = [](const char *name, long long rows, chrono::steady_clock::time_point start)
+        {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << name << ": " << rows << " rows in " << seconds * 1000 << " ms (" << (long long)(rows / max(seconds, 1e-9)) << " rows/sec)" << endl;
+        };
+
+        long long rows = 0;
+        auto start = chrono::steady_clock::now();
+        forEachCar("1", 0, [&](const CarRow &car)
+                   {
+                       out << car.id << ". " << car.model << " (" << car.year << "), ";
+                       if (car.available == 1)
+                           out << "Available, ";
+                       else
+                           out << "Rented by: " << car.rentedBy << ", on Day: " << car.rentedOn << ", ";
+                       out << "Condition: " << car.condition << "%" << endl;
+                       rows++; },
+                   db);
+        report("Line at a time", rows, start);
+
+        for (OutputFormat format : {FORMAT_TABLE, FORMAT_JSON, FORMAT_CSV})
+        {
+            unique_ptr<RowSink> sink = Renderer::open(format, out);
+            start = chrono::steady_clock::now();
+            displayAll(*sink, db);
+            report(Renderer::formatName(format), sink->count(), start);
+        }
+        sqlite3_close(db);
+    }
+#endif
+
+    // Compares fetching count random cars one id at a time with one batched lookup
+    static void benchmarkMultiGet(int count)
+    {
+        sqlite3 *db;
+        if (!connectToDatabase(&db))
+            return;
+        int maxId = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT IFNULL(MAX(id), 0) FROM cars", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                maxId = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        if (maxId == 0)
+        {
+            cout << "No cars to look up." << endl;
+            sqlite3_close(db);
+            return;
+        }
+
+        mt19937 rng(253);
+        vector<int> ids(count);
+        for (int &id : ids)
+        {
+            id = rng() % maxId + 1;
+        }
+
+        // Rows read within this command come from its arena; the heap figure
+        // counts what the arena had to take from the heap
+        uint64_t heapStart = RequestArena::heapAllocations(), sqliteStart = RequestArena::sqliteAllocations;
+        auto start = chrono::steady_clock::now();
+        for (int id : ids)
+        {
+            searchCar(id);
+        }
+        double perIdConnection = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Looked up " << count << " ids:" << endl;
+        cout << "Per id, new connection each: " << perIdConnection << " ms, ";
+        RequestArena::printPerOperation(RequestArena::heapAllocations() - heapStart, RequestArena::sqliteAllocations - sqliteStart, count);
+        cout << endl;
+
+        heapStart = RequestArena::heapAllocations(), sqliteStart = RequestArena::sqliteAllocations;
+        start = chrono::steady_clock::now();
+        for (int id : ids)
+        {
+            searchCar(id, db);
+        }
+        double perIdArena = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Per id, shared connection, request arena: " << perIdArena << " ms, ";
+        RequestArena::printPerOperation(RequestArena::heapAllocations() - heapStart, RequestArena::sqliteAllocations - sqliteStart, count);
+        cout << endl;
+
+        // The same rows with their columns on the heap, as before the arena
+        RequestArena::Counter heap;
+        sqliteStart = RequestArena::sqliteAllocations;
+        start = chrono::steady_clock::now();
+        for (int id : ids)
+        {
+            ArenaRow car(&heap);
+            searchRow("cars", id, car, db);
+        }
+        double perIdHeap = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Per id, shared connection, row on the heap: " << perIdHeap << " ms, ";
+        RequestArena::printPerOperation(heap.allocations, RequestArena::sqliteAllocations - sqliteStart, count);
+        cout << endl;
+
+        sqliteStart = RequestArena::sqliteAllocations;
+        start = chrono::steady_clock::now();
+        vector<optional<CarRow>> cars = searchCars(ids, db);
+        double batched = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Batched: " << batched << " ms, " << (double)(RequestArena::sqliteAllocations - sqliteStart) / count
+             << " SQLite allocations per operation" << endl;
+        sqlite3_close(db);
+
+        size_t missing = count_if(cars.begin(), cars.end(), [](const optional<CarRow> &car)
+                                  { return !car; });
+        cout << missing << " of the ids had no car." << endl;
+    }
+
+    static void add(const vector<string> &car, sqlite3 *db = nullptr)
+    {
+        SqliteEngine engine(db);
+        if (engine.handle() == nullptr)
+            return;
+        int id = add(engine, car);
+        if (id > 0)
+            CarColumns::fleet().refresh(id, engine.handle());
+        cout << "Car " << car[0] << "(" << car[1] << "), "
+             << "Available: " << car[2] << ", rentedBy: " << car[3] << ", rentedOn: " << car[4] << ", Condition: " << car[5] << ", added successfully." << endl;
+    }
+
+    template <typename Row> // vector<string> or ArenaRow
+    static bool update(int id, const Row &car, sqlite3 *db = nullptr)
+    {
+        // Ids the filter rules out are not looked up at all
+        if (!IdFilter::of("cars").mayContain(id, db))
+        {
+            return false;
+        }
+        SqliteEngine engine(db);
+        if (engine.handle() == nullptr || !update(engine, id, car))
+            return false;
+        CarColumns::fleet().refresh(id, engine.handle());
+        return true;
+    }
+
+    void deleteRecord(int id, sqlite3 *db = nullptr)
+    {
+        // Ids the filter rules out are not looked up at all
+        if (!IdFilter::of("cars").mayContain(id, db))
+        {
+            cout << "Record not found." << endl;
+            return;
+        }
+        SqliteEngine engine(db);
+        if (engine.handle() == nullptr)
+            return;
+        if (!erase(engine, id))
+        {
+            cout << "Record not found." << endl;
+            return;
+        }
+        cout << "Record with ID " << id << " deleted successfully." << endl;
+        CarColumns::fleet().refresh(id, engine.handle());
+    }
+
+    // Places a car at (x, y) on the lot map
+    static bool move(int id, double x, double y, sqlite3 *db = nullptr)
+    {
+        Log::Context context("move", id);
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "UPDATE cars SET x = ?, y = ? WHERE id = ?", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for moving", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return false;
+        }
+        sqlite3_bind_double(stmt, 1, x);
+        sqlite3_bind_double(stmt, 2, y);
+        sqlite3_bind_int(stmt, 3, id);
+        bool moved = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) > 0;
+        sqlite3_finalize(stmt);
+        if (moved)
+            CarColumns::fleet().refresh(id, db);
+        if (ownDb)
+            sqlite3_close(db);
+        return moved;
+    }
+
+    // The k available cars of a model closest to (x, y), from the in-memory
+    // grid. Rows are read back from the database before they are shown; a car
+    // another process has rented or moved meanwhile is refreshed in the grid
+    // and the grid asked again, until every car found is live.
+    // Times the nearest cars are asked for again after finding hits changed
+    // by another process; after that the rows are shown as read
+    static constexpr int MAX_NEAREST_REQUERIES = 3;
+
+    // The k nearest available cars from columns, checked against db. A hit
+    // whose row is gone, rented or moved is re-read and the grid asked again.
+    // Locations are compared as the stored doubles, the same values the grid
+    // was loaded from, so a car far from the origin still matches exactly.
+    static vector<CarColumns::Neighbour> currentNearest(CarColumns &columns, const string &model, double x, double y, int k, sqlite3 *db, int &requeries)
+    {
+        vector<CarColumns::Neighbour> found;
+        requeries = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT available, x, y FROM cars WHERE id = ?", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for nearest cars", db);
+            return found;
+        }
+        for (;; requeries++)
+        {
+            found = columns.nearest(model, x, y, k);
+            bool stale = false;
+            for (const CarColumns::Neighbour &car : found)
+            {
+                sqlite3_bind_int(stmt, 1, car.id);
+                bool current = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 1 &&
+                               sqlite3_column_double(stmt, 1) == car.x && sqlite3_column_double(stmt, 2) == car.y;
+                sqlite3_reset(stmt);
+                if (!current)
+                {
+                    columns.refresh(car.id, db);
+                    stale = true;
+                }
+            }
+            if (!stale || requeries == MAX_NEAREST_REQUERIES)
+                break;
+        }
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    // Looks up nearest cars on a scratch database whose cars are far from the
+    // origin, where the text form of a location no longer round-trips, then
+    // moves and rents cars behind the grid's back and checks each change is
+    // caught by one requery
+    static bool verifyNearest()
+    {
+        const string scratch = "nearest.db";
+        remove(scratch.c_str());
+        sqlite3 *db;
+        if (!connectToDatabase(&db, scratch))
+            return false;
+        sqlite3_exec(db, schema.c_str(), nullptr, nullptr, nullptr);
+        auto place = [db](const string &sql, double x, double y, int id)
+        {
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                return;
+            sqlite3_bind_double(stmt, 1, x);
+            sqlite3_bind_double(stmt, 2, y);
+            sqlite3_bind_int(stmt, 3, id);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        };
+        const string insert = "INSERT INTO cars (model, year, x, y, id) VALUES ('Far', '2024', ?, ?, ?)";
+        place(insert, 12345678901.123456, 5, 1);
+        place(insert, -98765432109.87654, 3, 2);
+        place(insert, 0.1, 0.2, 3);
+
+        CarColumns columns;
+        columns.load(db);
+        struct Step
+        {
+            string change;
+            int requeries;
+            int nearest;
+        };
+        vector<Step> steps = {{"", 0, 1},
+                              {"UPDATE cars SET x = ?, y = ? WHERE id = ?", 1, 3},
+                              {"UPDATE cars SET available = 0 WHERE id = 3", 1, 2}};
+        bool ok = true;
+        for (const Step &step : steps)
+        {
+            if (step.change.find('?') != string::npos)
+                place(step.change, -1e11, 0, 1);
+            else if (!step.change.empty())
+                sqlite3_exec(db, step.change.c_str(), nullptr, nullptr, nullptr);
+            int requeries;
+            vector<CarColumns::Neighbour> found = currentNearest(columns, "", 12345678900, 5, 1, db, requeries);
+            int nearest = found.empty() ? -1 : found[0].id;
+            if (requeries != step.requeries || nearest != step.nearest)
+            {
+                cout << "Expected car " << step.nearest << " after " << step.requeries << " requeries, got car " << nearest << " after " << requeries << "." << endl;
+                ok = false;
+            }
+        }
+        sqlite3_close(db);
+        remove(scratch.c_str());
+        cout << (ok ? "Nearest cars stayed current with locations far from the origin." : "Nearest car check failed.") << endl;
+        return ok;
+    }
+
+    static void displayNearest(const string &model, double x, double y, int k)
+    {
+        CarColumns &columns = CarColumns::fleet();
+        sqlite3 *db;
+        if (!connectToDatabase(&db))
+            return;
+        if (!columns.isLoaded())
+            columns.load(db);
+        int requeries;
+        vector<CarColumns::Neighbour> found = currentNearest(columns, model == "*" ? "" : model, x, y, k, db, requeries);
+        vector<int> ids;
+        for (const CarColumns::Neighbour &car : found)
+        {
+            ids.push_back(car.id);
+        }
+        vector<optional<CarRow>> cars = searchCars(ids, db);
+
+        Listing listing{"Available cars nearest to (" + Renderer::number(x) + ", " + Renderer::number(y) + "):",
+                        "No available cars match \"" + model + "\".", Renderer::carColumns(), [](string &out, const vector<string> &car)
+                        {
+                            auto rounded = [](const string &value)
+                            { return Renderer::number(round(stod(value) * 100) / 100); };
+                            out += car[CAR_ID] + ". " + car[CAR_MODEL] + " (" + car[CAR_YEAR] + "), Condition: " + car[CAR_CONDITION] +
+                                   "%, at (" + rounded(car[CAR_X]) + ", " + rounded(car[CAR_Y]) + "), " + car.back() + " away\n";
+                        }};
+        listing.columns.push_back({"distance", true});
+        vector<string> values;
+        unique_ptr<RowSink> sink = Renderer::open();
+        sink->begin(listing);
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            // Still changing after the last requery: rows that are gone are left out
+            if (!cars[i])
+                continue;
+            Renderer::values(*cars[i], values);
+            values.push_back(Renderer::number(round(found[i].distance * 100) / 100));
+            sink->row(values);
+        }
+        sink->end();
+        sqlite3_close(db);
+    }
+
+    // Runs "nearest <model> <x> <y> <k>", asking for the arguments when the
+    // line has none. The model is every word before the last three, so it may
+    // have spaces ("Rolls Royce").
+    static void runNearest(string line)
+    {
+        if (line.find_first_not_of(" \t") == string::npos)
+        {
+            cout << "Enter the model (or * for any), x, y and the number of cars: ";
+            getline(cin, line);
+        }
+        istringstream in(line);
+        vector<string> words;
+        string word;
+        while (in >> word)
+        {
+            words.push_back(word);
+        }
+        string model;
+        double x, y;
+        int k = 0;
+        if (words.size() >= 4)
+        {
+            for (size_t i = 0; i + 3 < words.size(); i++)
+            {
+                model += (model.empty() ? "" : " ") + words[i];
+            }
+            istringstream numbers(words[words.size() - 3] + " " + words[words.size() - 2] + " " + words.back());
+            if (!(numbers >> x >> y >> k))
+                k = 0;
+        }
+        if (k <= 0)
+        {
+            cout << "Usage: nearest <model> <x> <y> <k>" << endl;
+            return;
+        }
+        displayNearest(model, x, y, k);
+    }
+
+    // Streams the cars matching where to visit in id order, as typed rows; a
+    // ? in where is bound to param
+    static bool forEachCar(const string &where, int param, const function<void(const CarRow &)> &visit, sqlite3 *db = nullptr)
+    {
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "SELECT id, model, year, available, rentedBy, rentedOn, condition, x, y FROM cars WHERE " + where;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return false;
+        }
+        if (sqlite3_bind_parameter_count(stmt) > 0)
+            sqlite3_bind_int(stmt, 1, param);
+
+        CarRow car;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            const unsigned char *model = sqlite3_column_text(stmt, CAR_MODEL);
+            const unsigned char *year = sqlite3_column_text(stmt, CAR_YEAR);
+            car.id = sqlite3_column_int(stmt, CAR_ID);
+            car.model = model == nullptr ? "" : reinterpret_cast<const char *>(model);
+            car.year = year == nullptr ? "" : reinterpret_cast<const char *>(year);
+            car.available = sqlite3_column_int(stmt, CAR_AVAILABLE);
+            car.rentedBy = sqlite3_column_int(stmt, CAR_RENTED_BY);
+            car.rentedOn = sqlite3_column_int(stmt, CAR_RENTED_ON);
+            car.condition = sqlite3_column_int(stmt, CAR_CONDITION);
+            car.x = sqlite3_column_double(stmt, CAR_X);
+            car.y = sqlite3_column_double(stmt, CAR_Y);
+            visit(car);
+        }
+        if (rc != SQLITE_DONE)
+            Log::error("Error reading cars", db);
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        return rc == SQLITE_DONE;
+    }
+
+    // Where the car is: "Available, " or who rented it and when
+    static void appendStatus(string &out, const vector<string> &car)
+    {
+        if (car[CAR_AVAILABLE] == "1")
+        {
+            out += "Available, ";
+        }
+        else
+        {
+            out += "Rented by: ";
+            out += car[CAR_RENTED_BY];
+            out += ", on Day: ";
+            out += car[CAR_RENTED_ON];
+            out += ", ";
+        }
+    }
+
+    // One car on its own, as shown after adding or finding it
+    static const Listing &carListing()
+    {
+        static const Listing listing{"", "", Renderer::carColumns(), [](string &out, const vector<string> &car)
+                                     {
+                                         out += "Car Model: ";
+                                         out += car[CAR_MODEL];
+                                         out += " (";
+                                         out += car[CAR_YEAR];
+                                         out += "), ID: ";
+                                         out += car[CAR_ID];
+                                         out += ", ";
+                                         appendStatus(out, car);
+                                         out += "Condition: ";
+                                         out += car[CAR_CONDITION];
+                                         out += "%\n";
+                                     }};
+        return listing;
+    }
+
+    static void display(sqlite3 *db = nullptr)
+    {
+        display(*Renderer::open(), db);
+    }
+
+    static void display(RowSink &sink, sqlite3 *db = nullptr)
+    {
+        static const Listing listing{"Displaying all available cars:", "No cars available to rent.", Renderer::carColumns(), [](string &out, const vector<string> &car)
+                                     {
+                                         out += car[CAR_ID];
+                                         out += ". ";
+                                         out += car[CAR_MODEL];
+                                         out += " (";
+                                         out += car[CAR_YEAR];
+                                         out += "), Condition: ";
+                                         out += car[CAR_CONDITION];
+                                         out += "%\n";
+                                     }};
+        vector<string> values;
+        sink.begin(listing);
+        forEachCar("available=1", 0, [&](const CarRow &car)
+                   {
+                       Renderer::values(car, values);
+                       sink.row(values); },
+                   db);
+        sink.end();
+    }
+
+    static void displayAll(sqlite3 *db = nullptr)
+    {
+        displayAll(*Renderer::open(), db);
+    }
+
+    static void displayAll(RowSink &sink, sqlite3 *db = nullptr)
+    {
+        static const Listing listing{"Displaying all cars:", "No cars available.", Renderer::carColumns(), [](string &out, const vector<string> &car)
+                                     {
+                                         out += car[CAR_ID];
+                                         out += ". ";
+                                         out += car[CAR_MODEL];
+                                         out += " (";
+                                         out += car[CAR_YEAR];
+                                         out += "), ";
+                                         appendStatus(out, car);
+                                         out += "Condition: ";
+                                         out += car[CAR_CONDITION];
+                                         out += "%\n";
+                                     }};
+        vector<string> values;
+        sink.begin(listing);
+        forEachCar("1", 0, [&](const CarRow &car)
+                   {
+                       Renderer::values(car, values);
+                       sink.row(values); },
+                   db);
+        sink.end();
+    }
+};
+
+class CustomerDb : public Db
+{
+private:
+    inline static const vector<vector<string>> defaultData = {
+        {"Linus", "5000", "0", "0", "5"},
+        {"Elon", "50000", "0", "0", "10"},
+        {"Steve", "10000", "0", "0", "7"},
+        {"Bill", "25000", "0", "0", "8"},
+        {"John", "100", "0", "0", "3"}};
+
+    void load(sqlite3 *db)
+    {
+        if (isTableEmpty(db, tablename))
+        {
+            Log::info("Loading default customers");
+            for (const vector<string> &data : defaultData)
+            {
+                add(data, db);
+            }
+        }
+    }
+
+public:
+    inline static const string schema = "CREATE TABLE IF NOT EXISTS customers (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, money INTEGER NOT NULL DEFAULT 5000, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue INTEGER NOT NULL DEFAULT 0, customerRecord INTEGER NOT NULL DEFAULT 5, password TEXT NOT NULL DEFAULT 123)";
+
+    CustomerDb()
+    {
+        tablename = "customers";
+        sqlite3 *db;
+        connectToDatabase(&db);
+        auto start = chrono::steady_clock::now();
+        if (!schemaCurrent)
+        {
+            createTable(db, schema);
+            trackChanges(db);
+            load(db);
+            Aggregates::create(tablename, db);
+            History::create(tablename, db);
+            start = StartupProfile::record("schema setup", start);
+        }
+        if (!schemaCurrent || !FleetSnapshot::restore(db))
+        {
+            IdFilter::of(tablename).load(tablename, db);
+            StartupProfile::record("index scans", start);
+        }
+        sqlite3_close(db);
+    }
+
+    // Seeds a storage engine with the default customers
+    static void seed(StorageEngine &engine)
+    {
+        for (const vector<string> &data : defaultData)
+        {
+            vector<string> row = {""};
+            row.insert(row.end(), data.begin(), data.end());
+            row.push_back("123"); // Password
+            engine.insert("customers", row);
+        }
+    }
+
+    // Customers for many ids with one statement, in input order; missing ids give nullopt
+    static vector<optional<AccountRow>> searchCustomers(const vector<int> &ids, sqlite3 *db = nullptr)
+    {
+        return searchAccounts("customers", ids, db);
+    }
+
+    // The customer's row, in the request arena while a command is handled; empty if there is none
+    static ArenaRow searchCus(int id, sqlite3 *db = nullptr)
+    {
+        ArenaRow cus(RequestArena::resource());
+        if (!searchRow("customers", id, cus, db))
+            cus.clear();
+        return cus;
+    }
+
+    static void add(const vector<string> &cus, sqlite3 *db = nullptr)
+    {
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return;
+        }
+        string sql = "INSERT INTO customers (name, money, rentedCars, fineDue, customerRecord) VALUES (?, ?, ?, ?, ?)";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for adding customers", db);
+            return;
+        }
+
+        // Bind the values of t to the prepared statement
+        sqlite3_bind_text(stmt, 1, cus[0].c_str(), -1, SQLITE_TRANSIENT); // Name
+        sqlite3_bind_text(stmt, 2, cus[1].c_str(), -1, SQLITE_TRANSIENT); // Money
+        sqlite3_bind_text(stmt, 3, cus[2].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
+        sqlite3_bind_text(stmt, 4, cus[3].c_str(), -1, SQLITE_TRANSIENT); // fineDue
+        sqlite3_bind_text(stmt, 5, cus[4].c_str(), -1, SQLITE_TRANSIENT); // record
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error inserting customers", db);
+        }
+        else
+        {
+            IdFilter::of("customers").insert(sqlite3_last_insert_rowid(db), db);
+        }
+        cout << "Customer " << cus[0] << " added successfully." << endl;
+        sqlite3_finalize(stmt);
+    }
+
+    template <typename Row> // vector<string> or ArenaRow
+    static bool update(int id, const Row &cus, sqlite3 *db = nullptr)
+    {
+        // Ids the filter rules out are not looked up at all
+        if (!IdFilter::of("customers").mayContain(id, db))
+        {
+            cout << "Customer not found." << endl;
+            return false;
+        }
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "UPDATE customers SET name = ?, money = ?, rentedCars = ?, fineDue = ?, customerRecord = ? WHERE id = ?;";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for updating", db);
+            return false;
+        }
+
+        // Bind the values of t to the prepared statement
+        sqlite3_bind_text(stmt, 1, cus[1].c_str(), -1, SQLITE_TRANSIENT); // Name
+        sqlite3_bind_text(stmt, 2, cus[2].c_str(), -1, SQLITE_TRANSIENT); // Money
+        sqlite3_bind_text(stmt, 3, cus[3].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
+        sqlite3_bind_text(stmt, 4, cus[4].c_str(), -1, SQLITE_TRANSIENT); // fineDue
+        sqlite3_bind_text(stmt, 5, cus[5].c_str(), -1, SQLITE_TRANSIENT); // record
+        sqlite3_bind_int(stmt, 6, id);                                    // ID
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error updating customers", db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        // The update itself tells whether the customer exists
+        bool updated = sqlite3_changes(db) > 0;
+        if (!updated)
+        {
+            cout << "Customer not found." << endl;
+        }
+        else
+        {
+            cout << "Customer " << cus[0] << " updated successfully." << endl;
+        }
+        sqlite3_finalize(stmt);
+        return updated;
+    }
+
+    static void display(sqlite3 *db = nullptr)
+    {
+        display(*Renderer::open(), db);
+    }
+
+    static void display(RowSink &sink, sqlite3 *db = nullptr)
+    {
+        static const Listing listing = accountListing("Displaying all customers:", "No customers.", "Customer");
+        vector<string> values;
+        sink.begin(listing);
+        forEachAccount("customers", [&](const AccountRow &account)
+                       {
+                           Renderer::values(account, values);
+                           sink.row(values); },
+                       db);
+        sink.end();
+    }
+
+    static void displayCustomer(int id, sqlite3 *db = nullptr)
+    {
+        displayAccount("customers", id, "customer", "", db);
+    }
+};
+
+class EmployeeDb : public Db
+{
+private:
+    inline static const vector<vector<string>> defaultData = {
+        {"Emp1", "500", "0", "0", "7"},
+        {"Emp2", "5000", "0", "0", "5"},
+        {"Emp3", "1000", "0", "0", "6"},
+        {"Emp4", "2500", "0", "0", "8"},
+        {"Emp5", "10", "0", "0", "3"}};
+
+    void load(sqlite3 *db)
+    {
+        if (isTableEmpty(db, tablename))
+        {
+            Log::info("Loading default employees");
+            for (const vector<string> &data : defaultData)
+            {
+                add(data, db);
+            }
+        }
+    }
+
+public:
+    inline static const string schema = "CREATE TABLE IF NOT EXISTS employees (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, money INTEGER NOT NULL DEFAULT 500, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue INTEGER NOT NULL DEFAULT 0, employeeRecord INTEGER NOT NULL DEFAULT 7, password TEXT NOT NULL DEFAULT 123)";
+
+    EmployeeDb()
+    {
+        tablename = "employees";
+        sqlite3 *db;
+        connectToDatabase(&db);
+        auto start = chrono::steady_clock::now();
+        if (!schemaCurrent)
+        {
+            createTable(db, schema);
+            trackChanges(db);
+            load(db);
+            Aggregates::create(tablename, db);
+            History::create(tablename, db);
+            start = StartupProfile::record("schema setup", start);
+        }
+        if (!schemaCurrent || !FleetSnapshot::restore(db))
+        {
+            IdFilter::of(tablename).load(tablename, db);
+            StartupProfile::record("index scans", start);
+        }
+        sqlite3_close(db);
+    }
+
+    // Seeds a storage engine with the default employees
+    static void seed(StorageEngine &engine)
+    {
+        for (const vector<string> &data : defaultData)
+        {
+            vector<string> row = {""};
+            row.insert(row.end(), data.begin(), data.end());
+            row.push_back("123"); // Password
+            engine.insert("employees", row);
+        }
+    }
+
+    // Employees for many ids with one statement, in input order; missing ids give nullopt
+    static vector<optional<AccountRow>> searchEmployees(const vector<int> &ids, sqlite3 *db = nullptr)
+    {
+        return searchAccounts("employees", ids, db);
+    }
+
+    // The employee's row, in the request arena while a command is handled; empty if there is none
+    static ArenaRow searchEmp(int i, sqlite3 *db = nullptr)
+    {
+        ArenaRow emp(RequestArena::resource());
+        if (!searchRow("employees", i, emp, db))
+            emp.clear();
+        return emp;
+    }
+
+    static void add(const vector<string> &emp, sqlite3 *db = nullptr)
+    {
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return;
+        }
+        string sql = "INSERT INTO employees (name, money, rentedCars, fineDue, employeeRecord) VALUES (?, ?, ?, ?, ?)";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for adding employees", db);
+            return;
+        }
+
+        // Bind the values of t to the prepared statement
+        sqlite3_bind_text(stmt, 1, emp[0].c_str(), -1, SQLITE_TRANSIENT); // Name
+        sqlite3_bind_text(stmt, 2, emp[1].c_str(), -1, SQLITE_TRANSIENT); // Money
+        sqlite3_bind_text(stmt, 3, emp[2].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
+        sqlite3_bind_text(stmt, 4, emp[3].c_str(), -1, SQLITE_TRANSIENT); // fineDue
+        sqlite3_bind_text(stmt, 5, emp[4].c_str(), -1, SQLITE_TRANSIENT); // record
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error inserting employees", db);
+        }
+        else
+        {
+            IdFilter::of("employees").insert(sqlite3_last_insert_rowid(db), db);
+        }
+        cout << "Employee " << emp[0] << " added successfully." << endl;
+        sqlite3_finalize(stmt);
+    }
+
+    template <typename Row> // vector<string> or ArenaRow
+    static bool update(int id, const Row &emp, sqlite3 *db = nullptr)
+    {
+        // Ids the filter rules out are not looked up at all
+        if (!IdFilter::of("employees").mayContain(id, db))
+        {
+            cout << "Employee not found." << endl;
+            return false;
+        }
+        if (db == nullptr)
+        {
+            if (!connectToDatabase(&db))
+                return false;
+        }
+        string sql = "UPDATE employees SET name = ?, money = ?, rentedCars = ?, fineDue = ?, employeeRecord = ? WHERE id = ?;";
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for updating", db);
+            return false;
+        }
+
+        // Bind the values of t to the prepared statement
+        sqlite3_bind_text(stmt, 1, emp[1].c_str(), -1, SQLITE_TRANSIENT); // Name
+        sqlite3_bind_text(stmt, 2, emp[2].c_str(), -1, SQLITE_TRANSIENT); // Money
+        sqlite3_bind_text(stmt, 3, emp[3].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
+        sqlite3_bind_text(stmt, 4, emp[4].c_str(), -1, SQLITE_TRANSIENT); // fineDue
+        sqlite3_bind_text(stmt, 5, emp[5].c_str(), -1, SQLITE_TRANSIENT); // record
+        sqlite3_bind_int(stmt, 6, id);                                    // ID
+
+        // Execute the statement
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            Log::error("Error updating employees", db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        // The update itself tells whether the employee exists
+        bool updated = sqlite3_changes(db) > 0;
+        if (!updated)
+        {
+            cout << "Employee not found." << endl;
+        }
+        else
+        {
+            cout << "Employee " << emp[0] << " updated successfully." << endl;
+        }
+        sqlite3_finalize(stmt);
+        return updated;
+    }
+
+    static void display(sqlite3 *db = nullptr)
+    {
+        display(*Renderer::open(), db);
+    }
+
+    static void display(RowSink &sink, sqlite3 *db = nullptr)
+    {
+        static const Listing listing = accountListing("Displaying all employees", "No employees.", "Employee");
+        vector<string> values;
+        sink.begin(listing);
+        forEachAccount("employees", [&](const AccountRow &account)
+                       {
+                           Renderer::values(account, values);
+                           sink.row(values); },
+                       db);
+        sink.end();
+    }
+
+    static void displayEmployee(int id, sqlite3 *db = nullptr)
+    {
+        ostringstream discount;
+        discount << "Employee Discount: " << EMPLOYEE_DISCOUNT * 100 << "%\n";
+        displayAccount("employees", id, "employee", discount.str(), db);
+    }
+};
+
+// Outcome of settling one account's dues
+struct SettlementResult
+{
+    int id = -1;
+    int paid = 0;  // Amount taken from money towards the dues
+    int money = 0; // Money left after paying
+    int dues = 0;  // Dues still pending after paying
+};
+
+// Accounts a settlement pass applies to
+struct SettlementFilter
+{
+    int minDues = 1;
+    int fromId = 0;
+    int toId = INT_MAX;
+};
+
+// Settles dues with the partial-payment rule used by clear_dues: an account
+// pays as much of its dues as its money covers. Bulk settlement is one
+// set-based UPDATE inside a write transaction; a single account is settled
+// with one conditional update, so a fine added concurrently is never lost.
+class DuesSettlement
+{
+private:
+    static bool execute(sqlite3 *db, const char *sql)
+    {
+        char *errmsg;
+        if (sqlite3_exec(db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error executing statement", errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    static int payment(int money, int dues)
+    {
+        return max(0, min(money, dues));
+    }
+
+    // Settles every account of table matching filter and reports each of them
+    static vector<SettlementResult> settle(const string &table, const SettlementFilter &filter = SettlementFilter(), sqlite3 *db = nullptr)
+    {
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return {};
+        }
+
+        vector<SettlementResult> results;
+        string where = " WHERE fineDue >= ? AND fineDue > 0 AND id BETWEEN ? AND ?";
+        string select = "SELECT id, money, fineDue FROM " + table + where + " ORDER BY id";
+        string update = "UPDATE " + table + " SET money = money - MAX(0, MIN(money, fineDue)), fineDue = fineDue - MAX(0, MIN(money, fineDue))" + where;
+
+        // The write lock is taken up front so the report matches what is updated;
+        // a busy database retries the whole settlement
+        bool settled = Contention::write(db, "settleDues", [&]
+                                         {
+            results.clear();
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, select.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement", db);
+                return false;
+            }
+            sqlite3_bind_int(stmt, 1, filter.minDues);
+            sqlite3_bind_int(stmt, 2, filter.fromId);
+            sqlite3_bind_int(stmt, 3, filter.toId);
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                SettlementResult result;
+                result.id = sqlite3_column_int(stmt, 0);
+                int money = sqlite3_column_int(stmt, 1);
+                int dues = sqlite3_column_int(stmt, 2);
+                result.paid = payment(money, dues);
+                result.money = money - result.paid;
+                result.dues = dues - result.paid;
+                results.push_back(result);
+            }
+            sqlite3_finalize(stmt);
+
+            if (sqlite3_prepare_v2(db, update.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement", db);
+                return false;
+            }
+            sqlite3_bind_int(stmt, 1, filter.minDues);
+            sqlite3_bind_int(stmt, 2, filter.fromId);
+            sqlite3_bind_int(stmt, 3, filter.toId);
+            bool ok = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == (int)results.size();
+            if (!ok)
+                Log::error("Error settling " + table + " dues", db);
+            sqlite3_finalize(stmt);
+            return ok; });
+        if (!settled)
+            results.clear();
+        if (ownDb)
+            sqlite3_close(db);
+        return results;
+    }
+
+    // Settles one account with a single conditional update computed from the
+    // row itself. RETURNING only sees the new values, so the amount paid comes
+    // from a read under the same write lock; no other writer can get between
+    // the two.
+    static bool settleAccount(const string &table, int id, SettlementResult &result, sqlite3 *db = nullptr)
+    {
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+
+        string select = "SELECT money, fineDue FROM " + table + " WHERE id = ?";
+        string update = "UPDATE " + table + " SET money = money - MAX(0, MIN(money, fineDue)), fineDue = fineDue - MAX(0, MIN(money, fineDue)) "
+                                            "WHERE id = ? AND MIN(money, fineDue) > 0 RETURNING money, fineDue";
+        bool settled = Contention::write(db, "settle", [&]
+                                         {
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, select.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement", db);
+                return false;
+            }
+            sqlite3_bind_int(stmt, 1, id);
+            bool found = sqlite3_step(stmt) == SQLITE_ROW;
+            int money = found ? sqlite3_column_int(stmt, 0) : 0;
+            int dues = found ? sqlite3_column_int(stmt, 1) : 0;
+            sqlite3_finalize(stmt);
+            if (!found)
+                return false;
+
+            result.id = id;
+            result.paid = 0;
+            result.money = money;
+            result.dues = dues;
+            if (sqlite3_prepare_v2(db, update.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement", db);
+                return false;
+            }
+            sqlite3_bind_int(stmt, 1, id);
+            int rc = sqlite3_step(stmt);
+            if (rc == SQLITE_ROW)
+            {
+                result.money = sqlite3_column_int(stmt, 0);
+                result.dues = sqlite3_column_int(stmt, 1);
+                result.paid = money - result.money;
+                rc = sqlite3_step(stmt);
+            }
+            sqlite3_finalize(stmt);
+            if (rc != SQLITE_DONE)
+            {
+                Log::error("Error settling dues", db);
+                return false;
+            }
+            return true; });
+
+        if (ownDb)
+            sqlite3_close(db);
+        return settled;
+    }
+};
+
+// Base class for users
+class User
+{
+protected:
+    string name;
+    int id;
+    string password;
+
+    User(int i) : id(i)
+    {
+        password = "123";
+    }
+
+    User(string n, int i, string p) : name(n), id(i), password(p) {}
+
+    virtual void displayDetails() const
+    {
+        displayDetails("", {}, {}, "");
+    }
+
+    // Writes the name and id followed by a subclass's role and columns; the
+    // table format puts the role and extra text on lines of their own
+    void displayDetails(const string &role, const vector<OutputColumn> &columns, const vector<string> &values, const string &text) const
+    {
+        Listing listing{"", "", {{"name", false}, {"id", true}}, [&](string &out, const vector<string> &)
+                        {
+                            out += "Name: " + name + ", ID: " + to_string(id) + "\n";
+                            if (!role.empty())
+                                out += "Role: " + role + "\n";
+                            out += text;
+                        }};
+        vector<string> row = {name, to_string(id)};
+        if (!role.empty())
+        {
+            listing.columns.push_back({"role", false});
+            row.push_back(role);
+        }
+        listing.columns.insert(listing.columns.end(), columns.begin(), columns.end());
+        row.insert(row.end(), values.begin(), values.end());
+        Renderer::open()->record(listing, row);
+    }
+
+public:
+
+    bool checkPassword(string pass)
+    {
+        return pass == password;
+    }
+};
+
+// Itemized charges for returning a rented car
+struct ReturnCharges
+{
+    int rentDays = 0;
+    int rent = 0;        // Rent for the days the car was out, after any discount
+    int overdueFine = 0; // $10 per day beyond the allowed period
+    int damageFine = 0;  // $20 per condition point lost
+    int recordDeduction = 0;
+
+    int total() const
+    {
+        return rent + overdueFine + damageFine;
+    }
+};
+
+// One line of a rental cart: a specific car, or any quantity available cars of a model
+struct CartItem
+{
+    int carId = -1;
+    string model;
+    int quantity = 1;
+};
+
+// What a cart line claimed, or why it could not be claimed
+struct CartResult
+{
+    CartItem item;
+    vector<int> claimed;
+    string error;
+};
+
+// Class for cars
+class Car
+{
+private:
+    string model;
+    string condition;
+
+public:
+    Car(string m, string c) : model(m), condition(c) {}
+
+    // Name of the record column of a renter table
+    static string recordColumn(const string &table)
+    {
+        return table == "employees" ? "employeeRecord" : "customerRecord";
+    }
+
+    // Rules for the charges of a return; false if the date is before the rental date
+    static bool computeCharges(int rentedOn, int rentedCondition, int date, int condition, bool employee, int daysAllowed, int rentPerDay, double employeeDiscount, ReturnCharges &charges)
+    {
+        charges = ReturnCharges();
+        charges.rentDays = date - rentedOn;
+        if (charges.rentDays < 0)
+            return false;
+
+        charges.rent = charges.rentDays * rentPerDay;
+        if (employee)
+        {
+            charges.rent = (1 - employeeDiscount) * charges.rent;
+        }
+        if (charges.rentDays > daysAllowed)
+        {
+            charges.overdueFine = 10 * (charges.rentDays - daysAllowed);
+            charges.recordDeduction += 1;
+        }
+        if (condition < rentedCondition)
+        {
+            charges.damageFine = 20 * (rentedCondition - condition);
+            charges.recordDeduction += 2;
+        }
+        return true;
+    }
+
+    // report prints the outcome for the renter; benchmarks turn it off
+    static bool rent(int cusId, int carId, int date, string table, sqlite3 *db = nullptr, bool report = true)
+    {
+        Log::Context context("rent", carId);
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+
+        bool rented = Contention::write(db, "rent", [&]
+                                        {
+            History::advanceClock(date, db);
+            // Cars held by another renter's checkout are skipped (databases without holds have none)
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, "SELECT 1 FROM holds WHERE carId = ? AND expiresAt > ?", -1, &stmt, nullptr) == SQLITE_OK)
+            {
+                sqlite3_bind_int(stmt, 1, carId);
+                sqlite3_bind_int64(stmt, 2, chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count());
+                bool held = sqlite3_step(stmt) == SQLITE_ROW;
+                sqlite3_finalize(stmt);
+                if (held)
+                {
+                    if (report)
+                        cout << "Car " << carId << " is on hold for another renter." << endl;
+                    return false;
+                }
+            }
+
+            if (!rent(*SqliteEngine::forConnection(db), cusId, carId, date, table))
+            {
+                if (report)
+                    cout << "Car " << carId << " is not available or does not exist." << endl;
+                return false;
+            }
+            return true; });
+        if (rented)
+        {
+            CarColumns::fleet().refresh(carId, db);
+            if (report)
+                cout << "Car rented successfully." << endl;
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return rented;
+    }
+
+    // Claims every item of the cart for the renter in one transaction, or none
+    // of them if any item cannot be claimed; results says what each item got
+    static bool rentCart(int cusId, const vector<CartItem> &items, int date, string table, vector<CartResult> &results, sqlite3 *db = nullptr)
+    {
+        results.clear();
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+        // Retried as a whole while other processes hold the write lock
+        bool rented = Contention::write(db, "rentCart", [&]
+                                        {
+            results.clear();
+            History::advanceClock(date, db);
+
+            // Cars held by a checkout are skipped (databases without holds have none)
+            string unheld;
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, "SELECT 1 FROM holds", -1, &stmt, nullptr) == SQLITE_OK)
+            {
+                sqlite3_finalize(stmt);
+                unheld = " AND NOT EXISTS (SELECT 1 FROM holds WHERE carId = cars.id AND expiresAt > ?4)";
+            }
+            string byId = "UPDATE cars SET available=available-1, rentedBy=?1, rentedOn=?2 WHERE id=?3 AND available > 0" + unheld + " RETURNING id";
+            string byModel = "UPDATE cars SET available=available-1, rentedBy=?1, rentedOn=?2 WHERE id IN (SELECT id FROM cars WHERE model=?5 COLLATE NOCASE AND available > 0" + unheld + " LIMIT ?3) RETURNING id";
+            sqlite3_stmt *claimById = nullptr;
+            sqlite3_stmt *claimByModel = nullptr;
+            if (sqlite3_prepare_v2(db, byId.c_str(), -1, &claimById, nullptr) != SQLITE_OK ||
+                sqlite3_prepare_v2(db, byModel.c_str(), -1, &claimByModel, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statements for claiming cars", db);
+                sqlite3_finalize(claimById);
+                return false;
+            }
+            int64_t now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+            bool ok = true;
+            int total = 0;
+            for (const CartItem &item : items)
+            {
+                CartResult result;
+                result.item = item;
+                bool byCar = item.model.empty();
+                stmt = byCar ? claimById : claimByModel;
+                sqlite3_bind_int(stmt, 1, cusId);
+                sqlite3_bind_int(stmt, 2, date);
+                sqlite3_bind_int(stmt, 3, byCar ? item.carId : item.quantity);
+                sqlite3_bind_int64(stmt, 4, now);
+                if (!byCar)
+                    sqlite3_bind_text(stmt, 5, item.model.c_str(), -1, SQLITE_TRANSIENT);
+                int rc;
+                while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                {
+                    result.claimed.push_back(sqlite3_column_int(stmt, 0));
+                }
+                if (rc != SQLITE_DONE)
+                    result.error = sqlite3_errmsg(db);
+                else if (byCar && result.claimed.empty())
+                    result.error = "not available";
+                else if (!byCar && (int)result.claimed.size() < item.quantity)
+                    result.error = "only " + to_string(result.claimed.size()) + " available";
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+                ok = ok && result.error.empty();
+                total += result.claimed.size();
+                results.push_back(result);
+            }
+            sqlite3_finalize(claimById);
+            sqlite3_finalize(claimByModel);
+            if (!ok || total == 0)
+                return false;
+
+            string sql = "UPDATE " + table + " SET rentedCars=rentedCars+? WHERE id=?";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                Log::error("Error preparing statement for " + table + " rented cars", db);
+                return false;
+            }
+            sqlite3_bind_int(stmt, 1, total);
+            sqlite3_bind_int(stmt, 2, cusId);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+            {
+                Log::error("Error updating " + table + " rented cars", db);
+                sqlite3_finalize(stmt);
+                return false;
+            }
+            bool renterFound = sqlite3_changes(db) == 1;
+            sqlite3_finalize(stmt);
+            if (!renterFound)
+            {
+                // The claimed cars would point at nobody, so none of them are kept
+                for (CartResult &result : results)
+                {
+                    result.error = "no such renter";
+                }
+                return false;
+            }
+            return true; });
+        for (const CartResult &result : results)
+        {
+            for (int carId : result.claimed)
+            {
+                CarColumns::fleet().refresh(carId, db);
+            }
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return rented;
+    }
+
+    static vector<int> checkRents(int cusId, string table, sqlite3 *db = nullptr)
+    {
+        // The rented car's columns plus the day it is due back
+        static const Listing listing = []
+        {
+            Listing listing{"Your rented cars:", "You haven't rented any cars.", Renderer::carColumns(), [](string &out, const vector<string> &car)
+                            {
+                                out += car[CAR_ID];
+                                out += ". ";
+                                out += car[CAR_MODEL];
+                                out += " (";
+                                out += car[CAR_YEAR];
+                                out += "), Due Date: ";
+                                out += car.back();
+                                out += '\n';
+                            }};
+            listing.columns.push_back({"due", true});
+            return listing;
+        }();
+
+        vector<int> rentedCars;
+        vector<string> values;
+        unique_ptr<RowSink> sink = Renderer::open();
+        sink->begin(listing);
+        CarDb::forEachCar("rentedBy=?", cusId, [&](const CarRow &car)
+                          {
+                              Renderer::values(car, values);
+                              values.push_back(to_string(car.rentedOn == -1 ? -1 : car.rentedOn + RENT_DAYS_ALLOWED));
+                              sink->row(values);
+                              rentedCars.push_back(car.id); },
+                          db);
+        sink->end();
+        return rentedCars;
+    }
+
+    // report prints the outcome for the renter, as for rent
+    static bool returnCar(int cusId, int carId, int date, int condition, string table, int daysAllowed, int rentPerDay, double employeeDiscount, sqlite3 *db = nullptr, bool report = true)
+    {
+        Log::Context context("return", carId);
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return false;
+        }
+
+        bool returned = Contention::write(db, "return", [&]
+                                          {
+            History::advanceClock(date, db);
+            ReturnCharges charges;
+            if (!returnCar(*SqliteEngine::forConnection(db), cusId, carId, date, condition, table, daysAllowed, rentPerDay, employeeDiscount, charges))
+            {
+                if (!report)
+                    return false;
+                if (charges.rentDays < 0)
+                    cout << "Invalid return date. Please enter a date after the rental date." << endl;
+                else
+                    cout << "Car " << carId << " is not rented by this renter." << endl;
+                return false;
+            }
+            if (charges.overdueFine > 0 && report)
+            {
+                cout << "You have exceeded the allowed rental period. A fine of $10 per day will be added to your account." << endl;
+            }
+            if (charges.damageFine > 0 && report)
+            {
+                cout << "The condition of the car is worse than when you rented it. A fine of $20 per % difference will be added to your account." << endl;
+            }
+            return true; });
+        if (returned)
+        {
+            CarColumns::fleet().refresh(carId, db);
+            if (report)
+                cout << "Car returned successfully." << endl;
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return returned;
+    }
+
+    // Rents an available car on any storage engine; rent above runs this on
+    // its connection after the SQLite-only hold check
+    static bool rent(StorageEngine &engine, int cusId, int carId, int date, const string &table)
+    {
+        return engine.transaction([&]
+                                  {
+            vector<string> renter;
+            if (!engine.get(table, cusId, renter))
+                return false;
+            if (!engine.conditionalUpdate("cars", carId, CAR_AVAILABLE, "1", {{CAR_AVAILABLE, "0"}, {CAR_RENTED_BY, to_string(cusId)}, {CAR_RENTED_ON, to_string(date)}}))
+                return false;
+            return engine.conditionalUpdate(table, cusId, ACCOUNT_ID, to_string(cusId), {{ACCOUNT_RENTED_CARS, to_string(stoi(renter[ACCOUNT_RENTED_CARS]) + 1)}}); });
+    }
+
+    // Returns a car rented by the renter on any storage engine and adds the
+    // charges to the renter's dues. charges is filled in even when the return
+    // fails, so a negative rentDays tells a date before the rental.
+    static bool returnCar(StorageEngine &engine, int cusId, int carId, int date, int condition, const string &table, int daysAllowed, int rentPerDay, double employeeDiscount, ReturnCharges &charges)
+    {
+        charges = ReturnCharges();
+        return engine.transaction([&]
+                                  {
+            vector<string> car;
+            vector<string> renter;
+            if (!engine.get("cars", carId, car) || !engine.get(table, cusId, renter))
+                return false;
+            if (!computeCharges(stoi(car[CAR_RENTED_ON]), stoi(car[CAR_CONDITION]), date, condition, table == "employees", daysAllowed, rentPerDay, employeeDiscount, charges))
+                return false;
+            if (!engine.conditionalUpdate("cars", carId, CAR_RENTED_BY, to_string(cusId), {{CAR_AVAILABLE, to_string(stoi(car[CAR_AVAILABLE]) + 1)}, {CAR_RENTED_BY, "-1"}}))
+                return false;
+            map<int, string> changes = {{ACCOUNT_RENTED_CARS, to_string(stoi(renter[ACCOUNT_RENTED_CARS]) - 1)},
+                                        {ACCOUNT_FINE_DUE, to_string(stoi(renter[ACCOUNT_FINE_DUE]) + charges.total())}};
+            if (charges.recordDeduction > 0)
+            {
+                changes[ACCOUNT_RECORD] = to_string(stoi(renter[ACCOUNT_RECORD]) - 1);
+            }
+            return engine.conditionalUpdate(table, cusId, ACCOUNT_ID, to_string(cusId), changes); });
+    }
+
+    void displayDetails() const
+    {
+        static const Listing listing{"", "", {{"model", false}, {"condition", false}}, [](string &out, const vector<string> &car)
+                                     { out += "Model: " + car[0] + ", Condition: " + car[1] + "\n"; }};
+        Renderer::open()->record(listing, {model, condition});
+    }
+
+    static int dueDate(int carId)
+    {
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db))
+            return -1;
+        string sql = "SELECT rentedOn FROM cars WHERE id = ?";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement for searching", db);
+            sqlite3_finalize(stmt);
+            sqlite3_close(db);
+            return -1;
+        }
+
+        // Bind the value of id to the prepared statement
+        sqlite3_bind_int(stmt, 1, carId);
+
+        // Execute the statement
         if (sqlite3_step(stmt) != SQLITE_ROW)
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
+            Log::error("Error executing statement", db);
+            sqlite3_finalize(stmt);
+            sqlite3_close(db);
+            return -1;
+        }
+
+        int rentedOn = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        if (rentedOn == -1)
+            return -1;
+        return rentedOn + RENT_DAYS_ALLOWED;
+    }
+};
+
+// Checkout holds. Picking a car inserts a row into the holds table that keeps
+// every other renter (in any process) from holding or renting the car until
+// it expires; the holder then converts it into the rental in one transaction.
+// Expired holds stop counting as soon as their time passes, and a timer wheel
+// lets the process that placed them delete their rows without polling.
+class HoldManager
+{
+private:
+    struct Hold
+    {
+        int carId;
+        int holder;
+        string table;
+    };
+
+    static const int TICK_MS = 10;
+
+    string file;
+    TimerWheel wheel;
+    unordered_map<uint64_t, Hold> active; // Token -> hold placed by this process
+    mt19937_64 tokens;
+    mutex lock;
+
+    static int64_t now()
+    {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Deletes the rows of holds whose time is up; rows that were converted or replaced are left alone
+    void expire(sqlite3 *db)
+    {
+        vector<uint64_t> fired;
+        vector<pair<uint64_t, int>> expired;
+        {
+            lock_guard<mutex> guard(lock);
+            wheel.advance(now() / TICK_MS, fired);
+            for (uint64_t token : fired)
+            {
+                auto it = active.find(token);
+                if (it == active.end())
+                    continue;
+                expired.push_back({token, it->second.carId});
+                active.erase(it);
+            }
+        }
+        if (expired.empty())
+            return;
+
+        bool ownDb = db == nullptr;
+        if (ownDb && !Db::connectToDatabase(&db, file))
+            return;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "DELETE FROM holds WHERE carId = ? AND token = ?", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            for (const auto &hold : expired)
+            {
+                sqlite3_bind_int(stmt, 1, hold.second);
+                sqlite3_bind_int64(stmt, 2, (sqlite3_int64)hold.first);
+                sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (ownDb)
+            sqlite3_close(db);
+    }
+
+public:
+    explicit HoldManager(const string &file = Db::getDatabaseFile())
+        : file(file), wheel(now() / TICK_MS), tokens(random_device{}()) {}
+
+    // Holds of the main database
+    static HoldManager &checkout()
+    {
+        static HoldManager holds;
+        return holds;
+    }
+
+    size_t activeCount()
+    {
+        expire(nullptr);
+        lock_guard<mutex> guard(lock);
+        return active.size();
+    }
+
+    // Holds an available car for ttlMs; returns the hold's token, or 0 if the car is unavailable or held
+    uint64_t place(int carId, int holder, const string &table, sqlite3 *db = nullptr, int ttlMs = HOLD_SECONDS * 1000)
+    {
+        expire(db);
+        bool ownDb = db == nullptr;
+        if (ownDb && !Db::connectToDatabase(&db, file))
+            return 0;
+
+        uint64_t token;
+        {
+            lock_guard<mutex> guard(lock);
+            do
+            {
+                token = tokens() >> 1; // Kept positive as a SQLite integer
+            } while (token == 0);
+        }
+        int64_t time = now();
+        int64_t expiresAt = time + ttlMs;
+
+        // Takes over an expired hold, but never a live one
+        string sql = "INSERT INTO holds (carId, holder, holderTable, token, expiresAt) "
+                     "SELECT id, ?, ?, ?, ? FROM cars WHERE id = ? AND available > 0 "
+                     "ON CONFLICT(carId) DO UPDATE SET holder = excluded.holder, holderTable = excluded.holderTable, "
+                     "token = excluded.token, expiresAt = excluded.expiresAt WHERE holds.expiresAt <= ?";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return 0;
+        }
+        sqlite3_bind_int(stmt, 1, holder);
+        sqlite3_bind_text(stmt, 2, table.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)token);
+        sqlite3_bind_int64(stmt, 4, expiresAt);
+        sqlite3_bind_int(stmt, 5, carId);
+        sqlite3_bind_int64(stmt, 6, time);
+        bool placed = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == 1;
+        if (!placed && sqlite3_errcode(db) != SQLITE_OK && sqlite3_errcode(db) != SQLITE_DONE)
+            Log::error("Error placing hold", db);
+        sqlite3_finalize(stmt);
+        if (ownDb)
+            sqlite3_close(db);
+        if (!placed)
+            return 0;
+
+        lock_guard<mutex> guard(lock);
+        active[token] = {carId, holder, table};
+        wheel.schedule(token, expiresAt / TICK_MS + 1);
+        return token;
+    }
+
+    // Rents the held car if the hold is still live, releasing the hold in the same transaction
+    bool convert(uint64_t token, int date, sqlite3 *db = nullptr, bool report = true)
+    {
+        expire(db);
+        Hold hold;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = active.find(token);
+            if (it == active.end())
+            {
+                if (report)
+                    cout << "Your hold has expired. Please choose the car again." << endl;
+                return false;
+            }
+            hold = it->second;
+        }
+        bool ownDb = db == nullptr;
+        if (ownDb && !Db::connectToDatabase(&db, file))
+            return false;
+
+        // Inside a caller's transaction (a group commit batch) this joins it
+        bool rented = Contention::write(db, "convert", [&]
+                                        {
+            sqlite3_stmt *stmt;
+            bool live = false;
+            if (sqlite3_prepare_v2(db, "DELETE FROM holds WHERE carId = ? AND token = ? AND expiresAt > ?", -1, &stmt, nullptr) == SQLITE_OK)
+            {
+                sqlite3_bind_int(stmt, 1, hold.carId);
+                sqlite3_bind_int64(stmt, 2, (sqlite3_int64)token);
+                sqlite3_bind_int64(stmt, 3, now());
+                live = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == 1;
+                sqlite3_finalize(stmt);
+            }
+            if (!live && report)
+                cout << "Your hold has expired. Please choose the car again." << endl;
+            return live && Car::rent(hold.holder, hold.carId, date, hold.table, db, report); });
+        if (!rented)
+            CarColumns::fleet().refresh(hold.carId, db);
+        if (ownDb)
+            sqlite3_close(db);
+
+        lock_guard<mutex> guard(lock);
+        active.erase(token);
+        return rented;
+    }
+
+    // Gives up a hold before it expires
+    void release(uint64_t token, sqlite3 *db = nullptr)
+    {
+        expire(db);
+        Hold hold;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = active.find(token);
+            if (it == active.end())
+                return;
+            hold = it->second;
+            active.erase(it);
+        }
+        bool ownDb = db == nullptr;
+        if (ownDb && !Db::connectToDatabase(&db, file))
+            return;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "DELETE FROM holds WHERE carId = ? AND token = ?", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            sqlite3_bind_int(stmt, 1, hold.carId);
+            sqlite3_bind_int64(stmt, 2, (sqlite3_int64)token);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+        if (ownDb)
+            sqlite3_close(db);
+    }
+
+    // Times the timer wheel alone, then holds competing for a scratch fleet
+    // from several threads: placing, converting, releasing and expiring
+    static void benchmark(int holds, int threads)
+    {
+        mt19937 rng(253);
+        TimerWheel timers;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < holds * 100; i++)
+        {
+            timers.schedule(i, 1 + rng() % 200000);
+        }
+        vector<uint64_t> fired;
+        timers.advance(200001, fired);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Timer wheel: " << fired.size() << " timers scheduled and fired in " << seconds * 1000 << " ms ("
+             << (long long)(fired.size() / seconds) << " timers/sec)" << endl;
+
+        const string scratch = "holds.db";
+        remove(scratch.c_str());
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, scratch))
+            return;
+        sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CarDb::schema.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CustomerDb::schema.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CarDb::holdsSchema.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+        for (int i = 0; i < holds; i++)
+        {
+            sqlite3_exec(db, "INSERT INTO cars (model, year) VALUES ('bench', '2024');", nullptr, nullptr, nullptr);
+        }
+        for (int i = 0; i < threads; i++)
+        {
+            sqlite3_exec(db, "INSERT INTO customers (name) VALUES ('bench');", nullptr, nullptr, nullptr);
+        }
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+
+        // Every thread tries to hold every car, so each car has threads competing for it
+        HoldManager manager(scratch);
+        const int ttlMs = 500;
+        vector<vector<uint64_t>> placed(threads);
+        atomic<int> conflicts(0);
+        auto inThreads = [threads](const function<void(int, sqlite3 *)> &work)
+        {
+            vector<thread> workers;
+            for (int t = 0; t < threads; t++)
+            {
+                workers.emplace_back([&work, t]
+                                     {
+                    sqlite3 *conn;
+                    if (!Db::connectToDatabase(&conn, "holds.db"))
+                        return;
+                    sqlite3_busy_timeout(conn, 5000);
+                    sqlite3_exec(conn, "PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr);
+                    work(t, conn);
+                    sqlite3_close(conn); });
+            }
+            for (thread &worker : workers)
+            {
+                worker.join();
+            }
+        };
+
+        start = chrono::steady_clock::now();
+        inThreads([&](int t, sqlite3 *conn)
+                  {
+            for (int carId = 1; carId <= holds; carId++)
+            {
+                uint64_t token = manager.place(carId, t + 1, "customers", conn, ttlMs);
+                if (token != 0)
+                    placed[t].push_back(token);
+                else
+                    conflicts++;
+            } });
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Placed " << manager.activeCount() << " holds, refused " << conflicts << " competing ones, in "
+             << seconds * 1000 << " ms (" << (long long)((long long)holds * threads / seconds) << " attempts/sec)" << endl;
+
+        // Convert a third, release a third, and leave the rest to expire
+        atomic<int> rented(0);
+        atomic<int> released(0);
+        start = chrono::steady_clock::now();
+        inThreads([&](int t, sqlite3 *conn)
+                  {
+            for (size_t i = 0; i < placed[t].size(); i++)
+            {
+                if (i % 3 == 0)
+                    rented += manager.convert(placed[t][i], 1, conn, false);
+                else if (i % 3 == 1)
+                {
+                    manager.release(placed[t][i], conn);
+                    released++;
+                }
+            } });
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Converted " << rented << " holds into rentals and released " << released << " in " << seconds * 1000 << " ms" << endl;
+
+        this_thread::sleep_for(chrono::milliseconds(ttlMs + 2 * TICK_MS));
+        size_t left = manager.activeCount();
+        int rows = -1;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT count(*) FROM holds", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                rows = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        cout << "After " << ttlMs << " ms: " << left << " holds active, " << rows << " hold rows left" << endl;
+
+        sqlite3_close(db);
+        remove(scratch.c_str());
+        remove((scratch + "-wal").c_str());
+        remove((scratch + "-shm").c_str());
+    }
+};
+
+// Depot check-in of many returned cars at once. Rows are read from a file
+// (or typed in) and applied in batched transactions with the same charges as
+// Car::returnCar; a row that fails is rolled back on its own and reported.
+class BulkReturn
+{
+public:
+    struct Row
+    {
+        int line = 0;
+        int renter = 0;
+        int carId = 0;
+        int date = 0;
+        int condition = 0;
+        string table = "customers";
+    };
+
+    struct Result
+    {
+        Row row;
+        bool returned = false;
+        int fine = 0;
+        string error;
+    };
+
+    // Rows are "renter car date condition [customers|employees]", separated
+    // by spaces or commas; blank lines and lines starting with # are skipped
+    static bool parse(const string &text, int line, Row &row)
+    {
+        string fields = text;
+        replace(fields.begin(), fields.end(), ',', ' ');
+        istringstream in(fields);
+        string extra;
+        row = Row();
+        row.line = line;
+        if (!(in >> row.renter >> row.carId >> row.date >> row.condition))
+            return false;
+        if (in >> row.table && in >> extra)
+            return false;
+        return row.table == "customers" || row.table == "employees";
+    }
+
+    static vector<Result> apply(const vector<Row> &rows, int batchSize = 500, sqlite3 *db = nullptr)
+    {
+        vector<Result> results;
+        results.reserve(rows.size());
+        // Only close the connection if it was opened here
+        bool ownDb = db == nullptr;
+        if (ownDb)
+        {
+            if (!Db::connectToDatabase(&db))
+                return results;
+        }
+
+        sqlite3_stmt *findCar;
+        sqlite3_stmt *freeCar;
+        if (sqlite3_prepare_v2(db, "SELECT rentedBy, rentedOn, condition FROM cars WHERE id = ?", -1, &findCar, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "UPDATE cars SET available=available+1, rentedBy=-1 WHERE id=? AND rentedBy=?", -1, &freeCar, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            if (ownDb)
+                sqlite3_close(db);
+            return results;
+        }
+        map<string, sqlite3_stmt *> charge; // One renter update per table
+        bool prepared = true;
+        for (const char *table : {"customers", "employees"})
+        {
+            string column = Car::recordColumn(table);
+            string sql = "UPDATE " + string(table) + " SET rentedCars=rentedCars-1, fineDue=fineDue+?, " + column + "=" + column + "-? WHERE id=?";
+            prepared = sqlite3_prepare_v2(db, sql.c_str(), -1, &charge[table], nullptr) == SQLITE_OK && prepared;
+        }
+        if (!prepared)
+        {
+            Log::error("Error preparing statement", db);
+            sqlite3_finalize(findCar);
+            sqlite3_finalize(freeCar);
+            for (auto &statement : charge)
+            {
+                sqlite3_finalize(statement.second);
+            }
+            if (ownDb)
+                sqlite3_close(db);
+            return results;
+        }
+
+        for (size_t first = 0; first < rows.size(); first += batchSize)
+        {
+            size_t last = min(rows.size(), first + (size_t)batchSize);
+            // A busy database retries the whole batch
+            vector<Result> batch;
+            bool committed = Contention::write(db, "bulkReturn", [&]
+                                               {
+                batch.clear();
+                for (size_t i = first; i < last; i++)
+                {
+                    Result result;
+                    result.row = rows[i];
+                    const Row &row = rows[i];
+
+                    // The same checks and charges as a single return
+                    ReturnCharges charges;
+                    sqlite3_bind_int(findCar, 1, row.carId);
+                    if (row.condition < 0 || row.condition > 100)
+                        result.error = "condition must be between 0 and 100";
+                    else if (sqlite3_step(findCar) != SQLITE_ROW)
+                        result.error = "no such car";
+                    else if (sqlite3_column_int(findCar, 0) != row.renter)
+                        result.error = "car is not rented by this renter";
+                    else if (!Car::computeCharges(sqlite3_column_int(findCar, 1), sqlite3_column_int(findCar, 2), row.date, row.condition, row.table == "employees",
+                                                  RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges))
+                        result.error = "return date is before the rental date";
+                    sqlite3_reset(findCar);
+                    if (!result.error.empty())
+                    {
+                        batch.push_back(result);
+                        continue;
+                    }
+
+                    sqlite3_exec(db, "SAVEPOINT checkin;", nullptr, nullptr, nullptr);
+                    History::advanceClock(row.date, db);
+                    sqlite3_stmt *account = charge[row.table];
+                    sqlite3_bind_int(freeCar, 1, row.carId);
+                    sqlite3_bind_int(freeCar, 2, row.renter);
+                    sqlite3_bind_int(account, 1, charges.total());
+                    sqlite3_bind_int(account, 2, charges.recordDeduction > 0 ? 1 : 0);
+                    sqlite3_bind_int(account, 3, row.renter);
+                    if (sqlite3_step(freeCar) != SQLITE_DONE || sqlite3_changes(db) != 1)
+                        result.error = "could not free the car";
+                    else if (sqlite3_step(account) != SQLITE_DONE || sqlite3_changes(db) != 1)
+                        result.error = "no such " + row.table.substr(0, row.table.size() - 1);
+                    sqlite3_reset(freeCar);
+                    sqlite3_reset(account);
+                    result.returned = result.error.empty();
+                    result.fine = result.returned ? charges.total() : 0;
+                    sqlite3_exec(db, result.returned ? "RELEASE checkin;" : "ROLLBACK TO checkin; RELEASE checkin;", nullptr, nullptr, nullptr);
+                    batch.push_back(result);
+                }
+                return true; });
+            if (!committed)
+            {
+                batch.clear();
+                for (size_t i = first; i < last; i++)
+                {
+                    batch.push_back({rows[i], false, 0, "batch could not be committed"});
+                }
+            }
+            results.insert(results.end(), batch.begin(), batch.end());
+        }
+        sqlite3_finalize(findCar);
+        sqlite3_finalize(freeCar);
+        for (auto &statement : charge)
+        {
+            sqlite3_finalize(statement.second);
+        }
+        for (const Result &result : results)
+        {
+            if (result.returned)
+                CarColumns::fleet().refresh(result.row.carId, db);
+        }
+        if (ownDb)
+            sqlite3_close(db);
+        return results;
+    }
+
+    // Rows of a file ("-" reads rows typed in until an empty line); unreadable
+    // lines are reported and counted in rejected
+    static bool read(const string &path, vector<Row> &rows, int &rejected)
+    {
+        ifstream file;
+        if (path != "-")
+        {
+            file.open(path);
+            if (!file)
+            {
+                cout << "Cannot open " << path << endl;
+                return false;
+            }
+        }
+        else
+        {
+            cout << "Enter one return per line: renter car date condition [customers|employees]. End with an empty line." << endl;
+        }
+        istream &in = path == "-" ? cin : file;
+
+        string text;
+        int line = 0;
+        rejected = 0;
+        while (getline(in, text))
+        {
+            line++;
+            text.erase(0, text.find_first_not_of(" \t"));
+            if (path == "-" && (text.empty() || text == "done"))
+                break;
+            if (text.empty() || text[0] == '#')
+                continue;
+            Row row;
+            if (!parse(text, line, row))
+            {
+                cout << "Line " << line << ": FAILED, cannot read \"" << text << "\"" << endl;
+                rejected++;
+                continue;
+            }
+            rows.push_back(row);
+        }
+        return true;
+    }
+
+    // Checks in every row of a file ("-" reads rows typed in until an empty line)
+    static void run(const string &path, int batchSize = 500)
+    {
+        vector<Row> rows;
+        int rejected;
+        if (!read(path, rows, rejected))
+            return;
+
+        auto start = chrono::steady_clock::now();
+        vector<Result> results = apply(rows, batchSize);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        int returned = 0;
+        long long fines = 0;
+        for (const Result &result : results)
+        {
+            cout << "Line " << result.row.line << ": car " << result.row.carId << " from " << result.row.table << " ID " << result.row.renter << ": ";
+            if (result.returned)
+                cout << "returned, charged $" << result.fine << endl;
+            else
+                cout << "FAILED, " << result.error << endl;
+            returned += result.returned;
+            fines += result.fine;
+        }
+        cout << "Returned " << returned << " of " << rows.size() + rejected << " cars, charged $" << fines << " in total." << endl;
+        cout << "Applied " << rows.size() << " rows in " << (rows.size() + batchSize - 1) / batchSize << " transactions in "
+             << seconds * 1000 << " ms (" << (long long)(rows.size() / max(seconds, 1e-9)) << " rows/sec)" << endl;
+    }
+};
+
+// Prices returns without changing anything: what a renter would owe for a car
+// returned on a date in a condition. Rental state comes from the in-memory
+// fleet copy and the fines from Car::computeCharges, so a quote is what
+// returnCar would charge for the same input as of the last write this process
+// saw.
+class QuoteEngine
+{
+public:
+    using Request = BulkReturn::Row;
+
+    struct Quote
+    {
+        Request request;
+        bool valid = false;
+        string error;
+        int rentedOn = -1;
+        int rentedCondition = 0;
+        ReturnCharges charges;
+    };
+
+    static Quote quote(const Request &request, CarColumns &columns)
+    {
+        Quote result;
+        result.request = request;
+        int renter;
+        if (request.condition < 0 || request.condition > 100)
+            result.error = "condition must be between 0 and 100";
+        else if (!columns.rental(request.carId, renter, result.rentedOn, result.rentedCondition))
+            result.error = "no such car";
+        else if (renter != request.renter)
+            result.error = "car is not rented by this renter";
+        else if (!Car::computeCharges(result.rentedOn, result.rentedCondition, request.date, request.condition, request.table == "employees",
+                                      RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, result.charges))
+            result.error = "date is before the rental date (day " + to_string(result.rentedOn) + ")";
+        result.valid = result.error.empty();
+        return result;
+    }
+
+    static vector<Quote> quoteAll(const vector<Request> &requests)
+    {
+        vector<Quote> quotes;
+        quotes.reserve(requests.size());
+        CarColumns &columns = fleet();
+        for (const Request &request : requests)
+        {
+            quotes.push_back(quote(request, columns));
+        }
+        return quotes;
+    }
+
+    static Quote quote(const Request &request)
+    {
+        return quote(request, fleet());
+    }
+
+    static void print(const Quote &quote)
+    {
+        const Request &request = quote.request;
+        if (!quote.valid)
+        {
+            cout << "No quote for car " << request.carId << ": " << quote.error << "." << endl;
+            return;
+        }
+        const ReturnCharges &charges = quote.charges;
+        cout << "Returning car " << request.carId << " on day " << request.date << " in " << request.condition << "% condition:" << endl;
+        cout << "  Rent for " << charges.rentDays << " days from day " << quote.rentedOn << ": $" << charges.rent;
+        if (request.table == "employees")
+            cout << " (after the " << EMPLOYEE_DISCOUNT * 100 << "% employee discount)";
+        cout << endl;
+        cout << "  Overdue fine: $" << charges.overdueFine << endl;
+        cout << "  Damage fine (from " << quote.rentedCondition << "%): $" << charges.damageFine << endl;
+        cout << "  Total: $" << charges.total() << endl;
+        if (charges.recordDeduction > 0)
+            cout << "  The renter's record would drop by 1." << endl;
+    }
+
+    // Quotes every row of a file in the bulk return format ("-" reads rows typed in)
+    static void run(const string &path)
+    {
+        vector<Request> requests;
+        int rejected;
+        if (!BulkReturn::read(path, requests, rejected))
+            return;
+        int priced = 0;
+        long long total = 0;
+        for (const Quote &quote : quoteAll(requests))
+        {
+            cout << "Line " << quote.request.line << ": car " << quote.request.carId << " from " << quote.request.table << " ID " << quote.request.renter << ": ";
+            if (quote.valid)
+                cout << "$" << quote.charges.total() << " (rent $" << quote.charges.rent << ", overdue $" << quote.charges.overdueFine
+                     << ", damage $" << quote.charges.damageFine << ")" << endl;
+            else
+                cout << "FAILED, " << quote.error << endl;
+            priced += quote.valid;
+            total += quote.valid ? quote.charges.total() : 0;
+        }
+        cout << "Quoted " << priced << " of " << requests.size() + rejected << " returns, $" << total << " in total." << endl;
+    }
+
+    // Quotes per second over a synthetic fleet of count rented cars
+    static void benchmark(int count)
+    {
+        CarColumns columns;
+        mt19937 rng(253);
+        vector<Request> requests(count);
+        for (int id = 1; id <= count; id++)
+        {
+            columns.add(id, "Car", 2020, 0, 50 + rng() % 51, rng() % 1000 + 1, rng() % 30);
+            Request &request = requests[id - 1];
+            request.carId = id;
+            request.date = 30 + rng() % 10;
+            request.condition = rng() % 101;
+        }
+        // Every renter id is tried, so most quotes are refused like a guess at a kiosk
+        for (Request &request : requests)
+        {
+            request.renter = rng() % 1000 + 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        int valid = 0;
+        for (const Request &request : requests)
+        {
+            valid += quote(request, columns).valid;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Quoted " << count << " returns (" << valid << " priced) in " << seconds * 1000 << " ms ("
+             << (long long)(count / max(seconds, 1e-9)) << " quotes/sec)" << endl;
+    }
+
+private:
+    static CarColumns &fleet()
+    {
+        CarColumns &columns = CarColumns::fleet();
+        if (!columns.isLoaded())
+        {
+            sqlite3 *db;
+            if (!Db::connectToDatabase(&db))
+                return columns;
+            columns.load(db);
             sqlite3_close(db);
-            return {};
         }
+        return columns;
+    }
+};
+
+#ifdef __unix__
+// Several processes renting and returning their own car on one scratch
+// database, first with no busy handling and then with Contention's
+class ContentionBenchmark
+{
+public:
+    static void run(int processes, int operations)
+    {
+        const string scratch = "contention.db";
+        for (const char *suffix : {"", "-wal", "-shm"})
+        {
+            remove((scratch + suffix).c_str());
+        }
+        sqlite3 *db;
+        if (sqlite3_open(scratch.c_str(), &db) != SQLITE_OK)
+            return;
+        string sql = "PRAGMA journal_mode=WAL;" + CarDb::schema + ";" + CustomerDb::schema + ";BEGIN;";
+        for (int i = 0; i < processes; i++)
+        {
+            sql += "INSERT INTO cars (model, year) VALUES ('bench', '2024'); INSERT INTO customers (name) VALUES ('bench');";
+        }
+        sql += "COMMIT;";
+        sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_close(db);
+
+        cout << "Busy handling\t\tOps/sec\tFailed calls\tRetries\tGave up\tBusy waits\tWaited (ms)" << endl;
+        for (bool handled : {false, true})
+        {
+            int timeout = Contention::busyTimeoutMs;
+            int attempts = Contention::maxAttempts;
+            if (!handled)
+            {
+                Contention::busyTimeoutMs = 0;
+                Contention::maxAttempts = 1;
+            }
+            int results[2];
+            if (pipe(results) != 0)
+                return;
+            auto start = chrono::steady_clock::now();
+            vector<pid_t> children;
+            for (int p = 0; p < processes; p++)
+            {
+                pid_t child = fork();
+                if (child == 0)
+                {
+                    // Each child has its own connection and counters
+                    close(results[0]);
+                    FILE *null = freopen("/dev/null", "w", stdout);
+                    (void)null;
+                    FILE *quiet = freopen("/dev/null", "w", stderr);
+                    (void)quiet;
+                    Contention::Metrics &counters = Contention::metrics();
+                    counters.operations = counters.retries = counters.giveUps = counters.busyWaits = counters.waitMicros = 0;
+                    long long failed = 0;
+                    sqlite3 *conn;
+                    if (Db::connectToDatabase(&conn, scratch))
+                    {
+                        SqliteEngine::keep(conn);
+                        // Failed calls are repeated (up to a limit), so both runs do the same work
+                        for (int i = 0; i < operations; i++)
+                        {
+                            for (int tries = 0; tries < 1000 && !Car::rent(p + 1, p + 1, 1, "customers", conn); tries++)
+                                failed++;
+                            for (int tries = 0; tries < 1000 && !Car::returnCar(p + 1, p + 1, 2, 100, "customers", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, conn); tries++)
+                                failed++;
+                        }
+                        SqliteEngine::release(conn);
+                        sqlite3_close(conn);
+                    }
+                    long long report[5] = {failed, counters.retries, counters.giveUps, counters.busyWaits, counters.waitMicros / 1000};
+                    ssize_t written = ::write(results[1], report, sizeof(report));
+                    _exit(written == sizeof(report) ? 0 : 1);
+                }
+                if (child > 0)
+                    children.push_back(child);
+            }
+            close(results[1]);
+            long long totals[5] = {0, 0, 0, 0, 0};
+            long long report[5];
+            while (read(results[0], report, sizeof(report)) == sizeof(report))
+            {
+                for (int i = 0; i < 5; i++)
+                {
+                    totals[i] += report[i];
+                }
+            }
+            close(results[0]);
+            for (pid_t child : children)
+            {
+                waitpid(child, nullptr, 0);
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            Contention::busyTimeoutMs = timeout;
+            Contention::maxAttempts = attempts;
+            long long done = 2LL * processes * operations;
+            cout << (handled ? "handler + retries" : "none\t") << "\t" << (long long)(done / seconds) << "\t" << totals[0] << "\t\t"
+                 << totals[1] << "\t" << totals[2] << "\t" << totals[3] << "\t\t" << totals[4] << endl;
+        }
+        for (const char *suffix : {"", "-wal", "-shm"})
+        {
+            remove((scratch + suffix).c_str());
+        }
+    }
+};
+#endif
+
+#ifdef __unix__
+// A rented-cars report read twice per round, once from cars and once from
+// customers, while a child process keeps renting and returning every car.
+// Inside a ReadSnapshot the two totals must always agree; read on a plain
+// connection they drift apart whenever a rental commits in between.
+class SnapshotBenchmark
+{
+private:
+    static long long total(sqlite3 *db, const string &sql)
+    {
+        sqlite3_stmt *stmt;
+        long long result = -1;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            return result;
+        }
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            result = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        return result;
+    }
+
+    // The customer listing between the two totals gives the writer time to commit
+    static bool consistent(sqlite3 *db, RowSink &sink)
+    {
+        long long rented = 0;
+        if (!CarDb::forEachCar("available = 0", 0, [&](const CarRow &)
+                               { rented++; },
+                               db))
+            return false;
+        CustomerDb::display(sink, db);
+        return rented == total(db, "SELECT SUM(rentedCars) FROM customers");
+    }
+
+public:
+    static bool run(int reports)
+    {
+        const int renters = 50;
+        const string scratch = "snapshot.db";
+        for (const char *suffix : {"", "-wal", "-shm"})
+        {
+            remove((scratch + suffix).c_str());
+        }
+        sqlite3 *db;
+        if (sqlite3_open(scratch.c_str(), &db) != SQLITE_OK)
+            return false;
+        string sql = "PRAGMA journal_mode=WAL;" + CarDb::schema + ";" + CustomerDb::schema + ";BEGIN;";
+        for (int i = 0; i < renters; i++)
+        {
+            sql += "INSERT INTO cars (model, year) VALUES ('bench', '2024'); INSERT INTO customers (name) VALUES ('bench');";
+        }
+        sql += "COMMIT;";
+        sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_close(db);
+
+        int stop[2];
+        int results[2];
+        if (pipe(stop) != 0)
+            return false;
+        if (pipe(results) != 0)
+            return false;
+        auto start = chrono::steady_clock::now();
+        pid_t writer = fork();
+        if (writer == 0)
+        {
+            // The writer runs until the stop pipe is closed
+            close(stop[1]);
+            close(results[0]);
+            FILE *null = freopen("/dev/null", "w", stdout);
+            (void)null;
+            long long operations = 0;
+            sqlite3 *conn;
+            if (Db::connectToDatabase(&conn, scratch))
+            {
+                SqliteEngine::keep(conn);
+                pollfd stopped{stop[0], POLLIN, 0};
+                while (poll(&stopped, 1, 0) == 0)
+                {
+                    for (int i = 1; i <= renters; i++)
+                    {
+                        operations += Car::rent(i, i, 1, "customers", conn, false);
+                    }
+                    for (int i = 1; i <= renters; i++)
+                    {
+                        operations += Car::returnCar(i, i, 2, 100, "customers", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, conn);
+                    }
+                }
+                SqliteEngine::release(conn);
+                sqlite3_close(conn);
+            }
+            ssize_t written = ::write(results[1], &operations, sizeof(operations));
+            _exit(written == sizeof(operations) ? 0 : 1);
+        }
+        close(stop[0]);
+        close(results[1]);
+        if (writer < 0)
+        {
+            close(stop[1]);
+            close(results[0]);
+            return false;
+        }
+
+        ostream discard(nullptr);
+        unique_ptr<RowSink> sink = Renderer::open(FORMAT_CSV, discard);
+        int inconsistent[2] = {0, 0};
+        for (int i = 0; i < reports; i++)
+        {
+            {
+                ReadSnapshot snapshot(scratch);
+                if (snapshot.handle() == nullptr || !consistent(snapshot.handle(), *sink))
+                    inconsistent[0]++;
+            }
+            sqlite3 *conn;
+            if (!Db::connectToDatabase(&conn, scratch))
+                break;
+            if (!consistent(conn, *sink))
+                inconsistent[1]++;
+            sqlite3_close(conn);
+        }
+
+        close(stop[1]);
+        long long operations = 0;
+        if (read(results[0], &operations, sizeof(operations)) != sizeof(operations))
+            operations = 0;
+        close(results[0]);
+        waitpid(writer, nullptr, 0);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << "Reads\t\tReports\tInconsistent" << endl;
+        cout << "snapshot\t" << reports << "\t" << inconsistent[0] << endl;
+        cout << "separate\t" << reports << "\t" << inconsistent[1] << endl;
+        cout << "Writer: " << operations << " rentals and returns (" << (long long)(operations / seconds) << "/sec) during the reports." << endl;
+        for (const char *suffix : {"", "-wal", "-shm"})
+        {
+            remove((scratch + suffix).c_str());
+        }
+        return inconsistent[0] == 0;
+    }
+};
+#endif
+
+// Catalog of branch shards. Every branch owns a separate database file, and
+// fleet-wide queries fan out over all shards on a thread pool. Rentals,
+// returns and record changes of a session go to the file of the branch it
+// works in through a Connection.
+class ShardRouter
+{
+private:
+    string catalog;             // Database file holding the shards table
+    map<string, string> shards; // branch -> database file
+    ThreadPool pool;
+
+    static bool execute(sqlite3 *db, const string &sql)
+    {
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            Log::error("Error executing statement", errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    inline static const string schema = "CREATE TABLE IF NOT EXISTS shards (branch TEXT PRIMARY KEY, file TEXT NOT NULL)";
+
+    // The catalog lives in the main database unless another file is given
+    ShardRouter(const string &catalog = Db::getDatabaseFile()) : catalog(catalog)
+    {
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, catalog))
+            return;
+        execute(db, schema);
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT branch, file FROM shards", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            sqlite3_close(db);
+            return;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            string branch = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            string file = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            shards[branch] = file;
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+
+    bool addBranch(const string &branch, const string &file)
+    {
+        // Create the tables in the shard file
+        sqlite3 *shard;
+        if (!Db::connectToDatabase(&shard, file))
+            return false;
+        execute(shard, "PRAGMA journal_mode=WAL;");
+        bool created = execute(shard, CarDb::schema) && execute(shard, CustomerDb::schema) && execute(shard, EmployeeDb::schema);
+        if (created)
+            CarDb::createSearchIndex(shard);
+        sqlite3_close(shard);
+        if (!created)
+            return false;
+
+        // Record the mapping in the catalog
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, catalog))
+            return false;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO shards (branch, file) VALUES (?, ?)", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            Log::error("Error preparing statement", db);
+            sqlite3_close(db);
+            return false;
+        }
+        sqlite3_bind_text(stmt, 1, branch.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, file.c_str(), -1, SQLITE_TRANSIENT);
+        bool added = sqlite3_step(stmt) == SQLITE_DONE;
+        if (!added)
+        {
+            Log::error("Error adding branch", db);
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+
+        if (added)
+            shards[branch] = file;
+        return added;
+    }
+
+    const map<string, string> &branches() const
+    {
+        return shards;
+    }
+
+    // Database file of the branch, or empty if there is no such branch
+    string fileOf(const string &branch) const
+    {
+        auto it = shards.find(branch);
+        return it == shards.end() ? "" : it->second;
+    }
+
+    // Asks which branch a console session works in; "main" goes back to the
+    // main database. An unknown name leaves branch as it was.
+    void askBranch(string &branch) const
+    {
+        string name;
+        cout << "Enter branch name (main for the main database): ";
+        cin >> name;
+        if (name != "main" && shards.count(name) == 0)
+        {
+            cout << "No branch " << name << "." << endl;
+            return;
+        }
+        branch = name == "main" ? "" : name;
+        if (branch.empty())
+            cout << "Working in the main database." << endl;
+        else
+            cout << "Working in branch " << branch << " (" << shards.at(branch) << ")." << endl;
+    }
+
+    // Connection to the database file that owns a branch's rows. The main
+    // database (an empty branch) has no handle, so callers given nullptr open
+    // it themselves as before.
+    class Connection
+    {
+    private:
+        sqlite3 *db = nullptr;
+        bool opened = true;
+
+    public:
+        Connection(const ShardRouter &router, const string &branch)
+        {
+            if (branch.empty())
+                return;
+            string file = router.fileOf(branch);
+            opened = !file.empty() && Db::connectToDatabase(&db, file);
+            if (!opened)
+            {
+                if (db != nullptr)
+                    sqlite3_close(db);
+                db = nullptr;
+                cout << "Cannot open the database of branch " << branch << "." << endl;
+            }
+        }
+
+        ~Connection()
+        {
+            if (db != nullptr)
+                sqlite3_close(db);
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        sqlite3 *handle() const
+        {
+            return db;
+        }
+
+        // The branch's file could not be opened, so nothing may fall back to the main database
+        bool failed() const
+        {
+            return !opened;
+        }
+    };
+
+    // Available cars whose model contains the given text, from every branch.
+    // Each result is {branch, id, model, year, condition}.
+    vector<vector<string>> searchAvailable(const string &model)
+    {
+        vector<future<vector<vector<string>>>> pending;
+        for (const auto &shard : shards)
+        {
+            string branch = shard.first;
+            string file = shard.second;
+            pending.push_back(pool.submit([branch, file, model]
+                                          {
+                vector<vector<string>> found;
+                sqlite3 *db;
+                if (!Db::connectToDatabase(&db, file))
+                    return found;
+                sqlite3_stmt *stmt;
+                string sql = "SELECT id, model, year, condition FROM cars WHERE available=1 AND model LIKE ?";
+                if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                {
+                    Log::error("Error preparing statement for " + branch, db);
+                    sqlite3_close(db);
+                    return found;
+                }
+                string pattern = "%" + model + "%";
+                sqlite3_bind_text(stmt, 1, pattern.c_str(), -1, SQLITE_TRANSIENT);
+                while (sqlite3_step(stmt) == SQLITE_ROW)
+                {
+                    found.push_back({branch,
+                                     to_string(sqlite3_column_int(stmt, 0)),
+                                     reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+                                     reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+                                     to_string(sqlite3_column_int(stmt, 3))});
+                }
+                sqlite3_finalize(stmt);
+                sqlite3_close(db);
+                return found; }));
+        }
+
+        // Merge the per-shard results in branch order
+        vector<vector<string>> merged;
+        for (auto &result : pending)
+        {
+            for (vector<string> &car : result.get())
+            {
+                merged.push_back(move(car));
+            }
+        }
+        return merged;
+    }
+
+    // Outstanding fines of all customers and employees across every branch
+    long long totalDues()
+    {
+        vector<future<long long>> pending;
+        for (const auto &shard : shards)
+        {
+            string branch = shard.first;
+            string file = shard.second;
+            pending.push_back(pool.submit([branch, file]
+                                          {
+                long long dues = 0;
+                sqlite3 *db;
+                if (!Db::connectToDatabase(&db, file))
+                    return dues;
+                sqlite3_stmt *stmt;
+                string sql = "SELECT (SELECT IFNULL(SUM(fineDue), 0) FROM customers) + (SELECT IFNULL(SUM(fineDue), 0) FROM employees)";
+                if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                {
+                    Log::error("Error preparing statement for " + branch, db);
+                    sqlite3_close(db);
+                    return dues;
+                }
+                if (sqlite3_step(stmt) == SQLITE_ROW)
+                {
+                    dues = sqlite3_column_int64(stmt, 0);
+                }
+                sqlite3_finalize(stmt);
+                sqlite3_close(db);
+                return dues; }));
+        }
+
+        long long total = 0;
+        for (auto &result : pending)
+        {
+            total += result.get();
+        }
+        return total;
+    }
+
+    // Registers three scratch branch files in a scratch catalog, gives each
+    // its own cars and dues, and checks that a router reloaded from the
+    // catalog merges exactly those rows. Then adds, rents and returns a car
+    // through a connection to one branch and checks that only that branch's
+    // file changed.
+    static bool verify()
+    {
+        const string catalog = "branches.db";
+        const vector<string> names = {"east", "north", "west"};
+        vector<string> files = {catalog};
+        for (const string &name : names)
+        {
+            files.push_back("branch-" + name + ".db");
+        }
+        auto removeFiles = [&files]
+        {
+            for (const string &file : files)
+            {
+                for (const char *suffix : {"", "-wal", "-shm"})
+                {
+                    remove((file + suffix).c_str());
+                }
+            }
+        };
+        removeFiles();
+
+        bool ok = true;
+        {
+            ShardRouter router(catalog);
+            size_t expectedCars = 0;
+            long long expectedDues = 0;
+            for (size_t b = 0; b < names.size() && ok; b++)
+            {
+                ok = router.addBranch(names[b], files[b + 1]);
+                // Branch b has b + 2 cars, the last of them rented out, and one customer owing 100 * (b + 1)
+                SqliteEngine engine(files[b + 1]);
+                ok = ok && engine.transaction([&]
+                                              {
+                    for (size_t i = 0; i < b + 2; i++)
+                    {
+                        if (CarDb::add(engine, {"Shard " + names[b], "2024", i == b + 1 ? "0" : "1", "-1", "-1", "100"}) < 0)
+                            return false;
+                    }
+                    return engine.insert("customers", {"", "Shard", "5000", "0", to_string(100 * (b + 1)), "5", "123"}) > 0; });
+                expectedCars += b + 1;
+                expectedDues += 100 * (b + 1);
+            }
+
+            ShardRouter reloaded(catalog);
+            if (ok && reloaded.branches() != router.branches())
+            {
+                cout << "The reloaded catalog does not list every branch." << endl;
+                ok = false;
+            }
+            vector<vector<string>> found = reloaded.searchAvailable("Shard");
+            if (ok && found.size() != expectedCars)
+            {
+                cout << "Fleet search found " << found.size() << " cars instead of " << expectedCars << "." << endl;
+                ok = false;
+            }
+            for (size_t i = 0; ok && i < found.size(); i++)
+            {
+                // Each car comes from its own branch's file, in branch order
+                if (found[i][2] != "Shard " + found[i][0] || (i > 0 && found[i][0] < found[i - 1][0]))
+                {
+                    cout << "Car " << found[i][1] << " of branch " << found[i][0] << " is out of place." << endl;
+                    ok = false;
+                }
+            }
+            long long dues = reloaded.totalDues();
+            if (ok && dues != expectedDues)
+            {
+                cout << "Dues across the branches were $" << dues << " instead of $" << expectedDues << "." << endl;
+                ok = false;
+            }
+
+            // Cars and customers of a branch file as text, to tell which files a write changed
+            auto contents = [](const string &file)
+            {
+                string rows;
+                sqlite3 *db;
+                if (!Db::connectToDatabase(&db, file))
+                    return rows;
+                sqlite3_stmt *stmt;
+                const char *sql = "SELECT (SELECT group_concat(id || ',' || available || ',' || rentedBy, ';') FROM cars), "
+                                  "(SELECT group_concat(id || ',' || rentedCars || ',' || fineDue, ';') FROM customers)";
+                if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK)
+                {
+                    if (sqlite3_step(stmt) == SQLITE_ROW)
+                    {
+                        for (int column = 0; column < 2; column++)
+                        {
+                            const unsigned char *text = sqlite3_column_text(stmt, column);
+                            rows += text == nullptr ? "" : reinterpret_cast<const char *>(text);
+                            rows += "|";
+                        }
+                    }
+                    sqlite3_finalize(stmt);
+                }
+                sqlite3_close(db);
+                return rows;
+            };
+            vector<string> before;
+            for (size_t b = 0; b < names.size(); b++)
+            {
+                before.push_back(contents(files[b + 1]));
+            }
+
+            // The customer of the middle branch rents a new car and returns it damaged
+            const size_t target = 1;
+            bool written = false;
+            {
+                Connection shard(reloaded, names[target]);
+                int carId = -1;
+                if (shard.handle() != nullptr)
+                {
+                    SqliteEngine engine(shard.handle());
+                    carId = CarDb::add(engine, {"Shard " + names[target], "2024", "1", "-1", "-1", "100"});
+                }
+                written = carId > 0 && Car::rent(1, carId, 10, "customers", shard.handle(), false) &&
+                          Car::returnCar(1, carId, 12, 90, "customers", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, shard.handle(), false);
+            }
+            if (ok && !written)
+            {
+                cout << "Renting and returning a car in branch " << names[target] << " failed." << endl;
+                ok = false;
+            }
+            for (size_t b = 0; ok && b < names.size(); b++)
+            {
+                if ((contents(files[b + 1]) != before[b]) != (b == target))
+                {
+                    cout << "Writes to branch " << names[target] << (b == target ? " did not change its file." : " changed the file of branch " + names[b] + ".") << endl;
+                    ok = false;
+                }
+            }
+            found = reloaded.searchAvailable("Shard");
+            if (ok && found.size() != expectedCars + 1)
+            {
+                cout << "Fleet search found " << found.size() << " cars instead of " << expectedCars + 1 << " after the write." << endl;
+                ok = false;
+            }
+            if (ok && reloaded.totalDues() <= expectedDues)
+            {
+                cout << "The damage fine in branch " << names[target] << " is missing from the dues." << endl;
+                ok = false;
+            }
+        }
+        removeFiles();
+        cout << (ok ? "Fleet search, dues and writes to one branch matched all " + to_string(names.size()) + " branch files." : "Branch check failed.") << endl;
+        return ok;
+    }
+};
 
-        vector<string> car;
-        car.push_back(to_string(sqlite3_column_int(stmt, 0)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5)));
-        car.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 6)));
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return car;
+// Background checks of the rental invariants that separate statements keep in
+// step: a car is unavailable exactly while someone who exists has it rented,
+// and an account's rentedCars matches the cars with its id in rentedBy. Each
+// step reads one slice of ids of one table, so a pass over a large database
+// is spread out within a budget of rows per second, and the position in each
+// table is kept in audit_cursor so a later run resumes where this one
+// stopped. Anomalies are logged, counted and, when repair is on, fixed.
+//
+// rentedBy does not say whether the renter is a customer or an employee, so
+// for an id present in both tables only the sum of the two counters can be
+// checked, and it is only repaired when the id has no cars at all.
+class ConsistencyAuditor
+{
+public:
+    struct Finding
+    {
+        string table;
+        int id = -1;
+        string problem;
+        bool shared = false;     // The id is both a customer's and an employee's
+        bool ambiguous = false;  // Cannot be repaired without knowing who rented which car
+        bool repaired = false;
+    };
+
+    inline static atomic<int> rowsPerSecond{2000}; // Read budget of the background thread
+    inline static atomic<int> sliceRows{200};
+    inline static atomic<bool> repair{true};
+    inline static atomic<int> passIntervalSeconds{300}; // Rest between passes over a table
+
+private:
+    inline static const vector<string> tables = {"cars", "customers", "employees"};
+    static constexpr size_t KEPT_FINDINGS = 20;
+
+    thread worker;
+    mutex lock; // Guards the fields below
+    condition_variable wake;
+    bool stopping = false;
+    map<string, int> cursors;  // Next id to check per table
+    map<string, int> passes;   // Completed passes per table
+    long long checked = 0;
+    long long anomalies = 0;
+    long long repaired = 0;
+    deque<Finding> recent;
+    int unsavedSlices = 0;
+
+    static bool exec(sqlite3 *db, const char *sql)
+    {
+        return sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK;
     }
 
-    static void displayCar(int id)
+    void loadCursors(sqlite3 *db)
     {
-        vector<string> car = searchCar(id);
-        cout << "Car Model: " << car[1] << " (" << car[2] << "), " << "ID: " << id << ", ";
-        if (car[3] == "1")
+        exec(db, "CREATE TABLE IF NOT EXISTS audit_cursor (tableName TEXT PRIMARY KEY, nextId INTEGER NOT NULL, passes INTEGER NOT NULL)");
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT tableName, nextId, passes FROM audit_cursor", -1, &stmt, nullptr) != SQLITE_OK)
+            return;
+        lock_guard<mutex> guard(lock);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
         {
-            cout << "Available, ";
+            string table = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            cursors[table] = sqlite3_column_int(stmt, 1);
+            passes[table] = sqlite3_column_int(stmt, 2);
         }
-        else
+        sqlite3_finalize(stmt);
+    }
+
+    void saveCursors(sqlite3 *db)
+    {
+        map<string, int> next, done;
         {
-            cout << "Rented by: " << car[4] << ", on Day: " << car[5] << ", ";
+            lock_guard<mutex> guard(lock);
+            next = cursors;
+            done = passes;
+            unsavedSlices = 0;
         }
-        cout << "Condition: " << car[6] << "%" << endl;
+        Contention::write(db, "auditCursor", [&]
+                          {
+            sqlite3_stmt *stmt;
+            if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO audit_cursor VALUES (?, ?, ?)", -1, &stmt, nullptr) != SQLITE_OK)
+                return false;
+            bool ok = true;
+            for (const string &table : tables)
+            {
+                sqlite3_bind_text(stmt, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int(stmt, 2, next[table]);
+                sqlite3_bind_int(stmt, 3, done[table]);
+                ok = sqlite3_step(stmt) == SQLITE_DONE && ok;
+                sqlite3_reset(stmt);
+            }
+            sqlite3_finalize(stmt);
+            return ok; });
     }
 
-    void add(const vector<string> car, sqlite3 *db = nullptr)
+    // Anomalies among up to limit rows of table from id first; last is the
+    // highest id read, or -1 once the table has no rows left
+    static bool scan(const string &table, int first, int limit, sqlite3 *db, vector<Finding> &found, int &last, int &rows)
     {
-        if (db == nullptr)
+        string sql;
+        if (table == "cars")
+            sql = "SELECT id, available, rentedBy, rentedBy = -1 OR EXISTS (SELECT 1 FROM customers WHERE id = cars.rentedBy) "
+                  "OR EXISTS (SELECT 1 FROM employees WHERE id = cars.rentedBy) FROM cars WHERE id >= ? ORDER BY id LIMIT ?";
+        else
         {
-            if (!connectToDatabase(&db))
-                return;
+            string other = table == "customers" ? "employees" : "customers";
+            sql = "SELECT id, rentedCars, (SELECT count(*) FROM cars WHERE rentedBy = t.id), (SELECT rentedCars FROM " + other +
+                  " WHERE id = t.id) FROM " + table + " AS t WHERE id >= ? ORDER BY id LIMIT ?";
         }
-        string sql = "INSERT INTO cars (model, year, available, rentedBy, rentedOn, condition) VALUES (?, ?, ?, ?, ?, ?)";
         sqlite3_stmt *stmt;
         if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
         {
-            cerr << "Error preparing statement for adding cars: " << sqlite3_errmsg(db) << endl;
-            return;
+            Log::error("Error preparing audit of " + table, db);
+            return false;
         }
-
-        // Bind the values of t to the prepared statement
-        sqlite3_bind_text(stmt, 1, car[0].c_str(), -1, SQLITE_TRANSIENT); // Model
-        sqlite3_bind_text(stmt, 2, car[1].c_str(), -1, SQLITE_TRANSIENT); // Year
-        sqlite3_bind_text(stmt, 3, car[2].c_str(), -1, SQLITE_TRANSIENT); // Available
-        sqlite3_bind_text(stmt, 4, car[3].c_str(), -1, SQLITE_TRANSIENT); // RentedBy
-        sqlite3_bind_text(stmt, 5, car[4].c_str(), -1, SQLITE_TRANSIENT); // RentedOn
-        sqlite3_bind_text(stmt, 6, car[5].c_str(), -1, SQLITE_TRANSIENT); // Condition
-
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+        sqlite3_bind_int(stmt, 1, first);
+        sqlite3_bind_int(stmt, 2, limit);
+        last = -1;
+        rows = 0;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
         {
-            cerr << "Error inserting " << tablename << ": " << sqlite3_errmsg(db) << endl;
+            rows++;
+            last = sqlite3_column_int(stmt, 0);
+            Finding finding;
+            finding.table = table;
+            finding.id = last;
+            if (table == "cars")
+            {
+                int available = sqlite3_column_int(stmt, 1);
+                int rentedBy = sqlite3_column_int(stmt, 2);
+                bool renterExists = sqlite3_column_int(stmt, 3) != 0;
+                if (available < 0)
+                    finding.problem = "available is " + to_string(available);
+                else if (!renterExists)
+                    finding.problem = "rented by " + to_string(rentedBy) + ", who no longer exists";
+                else if (rentedBy == -1 && available == 0)
+                    finding.problem = "unavailable but not rented";
+                else if (rentedBy != -1 && available > 0)
+                    finding.problem = "rented by " + to_string(rentedBy) + " but available";
+            }
+            else
+            {
+                int counter = sqlite3_column_int(stmt, 1);
+                int cars = sqlite3_column_int(stmt, 2);
+                bool shared = sqlite3_column_type(stmt, 3) != SQLITE_NULL;
+                int otherCounter = sqlite3_column_int(stmt, 3);
+                // Ids in both tables are checked once, with the customers
+                if (shared && table == "employees")
+                    continue;
+                finding.shared = shared;
+                if (!shared && counter != cars)
+                    finding.problem = "rentedCars is " + to_string(counter) + " but " + to_string(cars) + " cars are rented";
+                else if (shared && counter + otherCounter != cars)
+                {
+                    finding.problem = "rentedCars of the customer and employee with this id add up to " + to_string(counter + otherCounter) +
+                                      " but " + to_string(cars) + " cars are rented";
+                    finding.ambiguous = cars > 0;
+                    if (finding.ambiguous)
+                        finding.problem += " (cannot tell whose)";
+                }
+            }
+            if (!finding.problem.empty())
+                found.push_back(finding);
         }
-        cout << "Car " << car[0] << "(" << car[1] << "), "
-             << "Available: " << car[2] << ", rentedBy: " << car[3] << ", rentedOn: " << car[4] << ", Condition: " << car[5] << ", added successfully." << endl;
         sqlite3_finalize(stmt);
+        return true;
     }
 
-    static void update(int id, const vector<string> &car, sqlite3 *db = nullptr)
+    // Brings one row back in line with the other tables, as of now
+    static bool fix(const Finding &finding, sqlite3 *db)
     {
-        if (db == nullptr)
+        if (finding.ambiguous)
+            return false;
+        vector<string> statements;
+        string rented = "(rentedBy <> -1 AND (EXISTS (SELECT 1 FROM customers WHERE id = cars.rentedBy) OR "
+                        "EXISTS (SELECT 1 FROM employees WHERE id = cars.rentedBy)))";
+        if (finding.table == "cars")
+            statements.push_back("UPDATE cars SET available = CASE WHEN " + rented + " THEN 0 ELSE 1 END, "
+                                 "rentedBy = CASE WHEN " + rented + " THEN rentedBy ELSE -1 END WHERE id = ?1");
+        else if (!finding.shared)
+            statements.push_back("UPDATE " + finding.table + " SET rentedCars = (SELECT count(*) FROM cars WHERE rentedBy = ?1) WHERE id = ?1");
+        else
         {
-            if (!connectToDatabase(&db))
-                return;
+            for (const char *table : {"customers", "employees"})
+                statements.push_back("UPDATE " + string(table) + " SET rentedCars = 0 WHERE id = ?1 AND NOT EXISTS (SELECT 1 FROM cars WHERE rentedBy = ?1)");
         }
-        if (searchTable(id, "cars", db))
-        {
-            string sql = "UPDATE cars SET model = ?, year = ?, available = ?, rentedBy = ?, rentedOn = ?, condition = ? WHERE id = ?;";
-
-            sqlite3_stmt *stmt;
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        Log::Context context("audit", finding.id);
+        return Contention::write(db, "audit", [&]
+                                 {
+            for (const string &sql : statements)
             {
-                cerr << "Error preparing statement for updating: " << sqlite3_errmsg(db) << endl;
-                return;
+                sqlite3_stmt *stmt;
+                if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+                {
+                    Log::error("Error preparing repair", db);
+                    return false;
+                }
+                sqlite3_bind_int(stmt, 1, finding.id);
+                bool done = sqlite3_step(stmt) == SQLITE_DONE;
+                if (!done)
+                    Log::error("Error repairing " + finding.table, db);
+                sqlite3_finalize(stmt);
+                if (!done)
+                    return false;
             }
+            return true; });
+    }
 
-            // Bind the values of car to the prepared statement
-            sqlite3_bind_text(stmt, 1, car[1].c_str(), -1, SQLITE_TRANSIENT); // Model
-            sqlite3_bind_text(stmt, 2, car[2].c_str(), -1, SQLITE_TRANSIENT); // Year
-            sqlite3_bind_text(stmt, 3, car[3].c_str(), -1, SQLITE_TRANSIENT); // Available
-            sqlite3_bind_text(stmt, 4, car[4].c_str(), -1, SQLITE_TRANSIENT); // RentedBy
-            sqlite3_bind_text(stmt, 5, car[5].c_str(), -1, SQLITE_TRANSIENT); // RentedOn
-            sqlite3_bind_text(stmt, 6, car[6].c_str(), -1, SQLITE_TRANSIENT); // Condition
-            sqlite3_bind_int(stmt, 7, id);                                    // ID
+    // Checks a slice of table from id first; next is where the following
+    // slice starts (0 once the table is done) and the rows read are returned
+    int step(const string &table, int first, int limit, sqlite3 *db, int &next, vector<Finding> *report = nullptr)
+    {
+        vector<Finding> found;
+        int last;
+        int rows;
+        next = 0;
+        if (!scan(table, first, limit, db, found, last, rows))
+            return 0;
+        if (rows == limit)
+            next = last + 1;
+        for (Finding &finding : found)
+        {
+            finding.repaired = repair && fix(finding, db);
+            if (finding.repaired)
+                CarColumns::fleet().refresh(finding.id, db);
+            Log::Context context("audit", finding.id);
+            Log::write(LEVEL_WARNING, table + ": " + finding.problem, finding.repaired ? "repaired" : "not repaired");
+        }
 
-            // Execute the statement
-            if (sqlite3_step(stmt) != SQLITE_DONE)
+        lock_guard<mutex> guard(lock);
+        checked += rows;
+        anomalies += found.size();
+        for (const Finding &finding : found)
+        {
+            repaired += finding.repaired;
+            recent.push_back(finding);
+            if (recent.size() > KEPT_FINDINGS)
+                recent.pop_front();
+            if (report != nullptr)
+                report->push_back(finding);
+        }
+        return rows;
+    }
+
+    void run()
+    {
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db))
+            return;
+        loadCursors(db);
+        size_t turn = 0;
+        int rows = 0;
+        map<string, chrono::steady_clock::time_point> restUntil;
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            // Wait long enough after each slice to stay within the budget
+            int delayMs = rows * 1000 / max(1, rowsPerSecond.load());
+            if (wake.wait_for(guard, chrono::milliseconds(max(delayMs, 100)), [this]
+                              { return stopping; }))
+                break;
+            const string &table = tables[turn++ % tables.size()];
+            rows = 0;
+            if (chrono::steady_clock::now() < restUntil[table])
+                continue;
+            int first = cursors[table];
+            guard.unlock();
+            int following;
+            rows = step(table, first, sliceRows, db, following);
+            guard.lock();
+            cursors[table] = following;
+            if (following == 0)
             {
-                cerr << "Error updating car: " << sqlite3_errmsg(db) << endl;
+                // Start over after a rest, so small tables are not rechecked back to back
+                passes[table]++;
+                restUntil[table] = chrono::steady_clock::now() + chrono::seconds(passIntervalSeconds);
+            }
+            if (++unsavedSlices >= 30)
+            {
+                guard.unlock();
+                saveCursors(db);
+                guard.lock();
             }
-
-            sqlite3_finalize(stmt);
         }
+        guard.unlock();
+        saveCursors(db);
+        sqlite3_close(db);
     }
 
-    static void display(sqlite3 *db = nullptr)
+public:
+    ConsistencyAuditor()
+    {
+        worker = thread(&ConsistencyAuditor::run, this);
+    }
+
+    ~ConsistencyAuditor()
     {
-        if (db == nullptr)
         {
-            if (!connectToDatabase(&db))
-                return;
+            lock_guard<mutex> guard(lock);
+            stopping = true;
         }
+        wake.notify_all();
+        worker.join();
+    }
 
-        string sql = "SELECT * FROM cars WHERE available=1";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    // Checks every row of every table now, ignoring the budget
+    vector<Finding> auditAll()
+    {
+        vector<Finding> found;
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db))
+            return found;
+        for (const string &table : tables)
         {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
+            int next = 0;
+            do
+            {
+                step(table, next, 1000, db, next, &found);
+            } while (next != 0);
         }
+        sqlite3_close(db);
+        return found;
+    }
 
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+    void report()
+    {
+        lock_guard<mutex> guard(lock);
+        cout << "Auditing " << sliceRows << " rows per slice, at most " << rowsPerSecond << " rows/sec, a pass per table every "
+             << passIntervalSeconds << " s, repairs " << (repair ? "on" : "off") << endl;
+        for (const string &table : tables)
         {
-            cout << "No cars available to rent." << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
+            cout << table << ": next id " << cursors[table] << ", " << passes[table] << " passes completed" << endl;
         }
-
-        // Display all available car details
-        cout << "Displaying all available cars:" << endl;
-        do
+        cout << "Rows checked: " << checked << ", anomalies: " << anomalies << ", repaired: " << repaired << endl;
+        for (const Finding &finding : recent)
         {
-            int carId = sqlite3_column_int(stmt, 0);
-            string model = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            string year = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            string condition = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 6));
+            print(finding);
+        }
+    }
 
-            cout << carId << ". " << model << " (" << year << ")"
-                 << ", Condition: " << condition << "%" << endl;
-        } while (sqlite3_step(stmt) == SQLITE_ROW);
+    static void print(const Finding &finding)
+    {
+        cout << finding.table << " " << finding.id << ": " << finding.problem << (finding.repaired ? " (repaired)" : "") << endl;
+    }
+};
 
-        sqlite3_finalize(stmt);
+// Online hot copy of the database made with the sqlite3_backup API. Pages are
+// copied from a background thread in small batches whose size adapts so each
+// batch stays within the latency budget, pausing between batches so rent and
+// return statements get the database in between. A write from another
+// connection makes SQLite restart the copy, so after a few restarts the rest
+// is copied in one step. Copies are verified with an integrity check once
+// complete.
+class OnlineBackup
+{
+private:
+    static constexpr int MAX_RESTARTS = 3;
+    int latencyBudgetMs;
+    thread worker;
+    thread scheduler;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    atomic<bool> running{false};
+    atomic<int> copiedPages{0};
+    atomic<int> totalPages{0};
+    string status = "No backup has run.";
+
+    void setStatus(const string &message)
+    {
+        lock_guard<mutex> guard(lock);
+        status = message;
     }
 
-    static void displayAll(sqlite3 *db = nullptr)
+    static bool verify(const string &destination)
     {
-        if (db == nullptr)
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, destination))
+            return false;
+        sqlite3_stmt *stmt;
+        bool ok = false;
+        if (sqlite3_prepare_v2(db, "PRAGMA integrity_check", -1, &stmt, nullptr) == SQLITE_OK)
         {
-            if (!connectToDatabase(&db))
-                return;
+            ok = sqlite3_step(stmt) == SQLITE_ROW && string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))) == "ok";
+            sqlite3_finalize(stmt);
         }
+        sqlite3_close(db);
+        return ok;
+    }
 
-        string sql = "SELECT * FROM cars";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    void copy(const string &destination)
+    {
+        sqlite3 *source;
+        sqlite3 *target;
+        if (!Db::connectToDatabase(&source))
         {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
+            setStatus("Backup failed: could not open the database.");
+            running = false;
             return;
         }
-
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        if (!Db::connectToDatabase(&target, destination))
         {
-            cout << "No cars available." << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
+            sqlite3_close(source);
+            setStatus("Backup failed: could not open " + destination + ".");
+            running = false;
             return;
         }
 
-        // Display all available car details
-        cout << "Displaying all cars:" << endl;
-        do
+        auto start = chrono::steady_clock::now();
+        sqlite3_backup *backup = sqlite3_backup_init(target, "main", source, "main");
+        int rc = SQLITE_ERROR;
+        int restarts = 0;
+        if (backup != nullptr)
         {
-            int carId = sqlite3_column_int(stmt, 0);
-            string model = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            string year = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            string available = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
-            string rentedBy = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4));
-            string rentedOn = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5));
-            string condition = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 6));
-
-            cout << carId << ". " << model << " (" << year << "), ";
-            if (available == "1")
+            int pagesPerStep = 16;
+            do
             {
-                cout << "Available, ";
-            }
-            else
+                auto stepStart = chrono::steady_clock::now();
+                // Past the restart limit, take the read lock until the copy is done
+                rc = sqlite3_backup_step(backup, restarts >= MAX_RESTARTS ? -1 : pagesPerStep);
+                double stepMs = chrono::duration<double, milli>(chrono::steady_clock::now() - stepStart).count();
+
+                int copied = copiedPages;
+                totalPages = sqlite3_backup_pagecount(backup);
+                copiedPages = totalPages - sqlite3_backup_remaining(backup);
+                if (copiedPages < copied)
+                    restarts++; // A write from another connection started the copy over
+
+                // Size the next batch so one step stays within the budget
+                if (stepMs > latencyBudgetMs && pagesPerStep > 1)
+                    pagesPerStep /= 2;
+                else if (stepMs < latencyBudgetMs / 2.0 && pagesPerStep < 4096)
+                    pagesPerStep *= 2;
+
+                if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+                    this_thread::sleep_for(chrono::milliseconds(latencyBudgetMs));
+            } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+            sqlite3_backup_finish(backup);
+        }
+        string error = sqlite3_errmsg(target);
+        sqlite3_close(target);
+        sqlite3_close(source);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (rc != SQLITE_DONE)
+            setStatus("Backup to " + destination + " failed: " + error);
+        else if (!verify(destination))
+            setStatus("Backup to " + destination + " failed the integrity check.");
+        else
+            setStatus("Backup to " + destination + " completed and verified: " + to_string(totalPages) + " pages in " + to_string(seconds) + " s" +
+                      (restarts > 0 ? " after " + to_string(restarts) + " restart(s)." : "."));
+        running = false;
+    }
+
+public:
+    OnlineBackup(int latencyBudgetMs = 5) : latencyBudgetMs(max(1, latencyBudgetMs)) {}
+
+    // Whether destination is the database itself, however the path is written
+    // (./car_rental.db, through a symlink, ...)
+    static bool isDatabase(const string &destination)
+    {
+        error_code error;
+        filesystem::path database = filesystem::weakly_canonical(Db::getDatabaseFile(), error);
+        filesystem::path target = filesystem::weakly_canonical(destination, error);
+        if (error)
+            return destination == Db::getDatabaseFile();
+        return database == target;
+    }
+
+    ~OnlineBackup()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (scheduler.joinable())
+            scheduler.join();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Starts a backup in the background; false if one is already running
+    bool start(const string &destination)
+    {
+        if (running.exchange(true))
+            return false;
+        if (worker.joinable())
+            worker.join();
+        copiedPages = 0;
+        totalPages = 0;
+        setStatus("Backup to " + destination + " in progress.");
+        worker = thread(&OnlineBackup::copy, this, destination);
+        return true;
+    }
+
+    // Backs up to destination every intervalSeconds until the program exits
+    bool schedule(const string &destination, int intervalSeconds)
+    {
+        if (scheduler.joinable())
+            return false;
+        scheduler = thread([this, destination, intervalSeconds]
+                           {
+            unique_lock<mutex> guard(lock);
+            while (!wake.wait_for(guard, chrono::seconds(intervalSeconds), [this] { return stopping; }))
             {
-                cout << "Rented by: " << rentedBy << ", on Day: " << rentedOn << ", ";
-            }
-            cout << "Condition: " << condition << "%" << endl;
-        } while (sqlite3_step(stmt) == SQLITE_ROW);
+                guard.unlock();
+                start(destination);
+                guard.lock();
+            } });
+        return true;
+    }
 
-        sqlite3_finalize(stmt);
+    string progress()
+    {
+        lock_guard<mutex> guard(lock);
+        if (running && totalPages > 0)
+            return status + " " + to_string(copiedPages) + "/" + to_string(totalPages) + " pages copied.";
+        return status;
     }
 };
 
-class CustomerDb : public Db
+// Group-commit writer. Callers submit mutations to a queue and one writer
+// thread applies them in a shared transaction, committing every windowMs
+// milliseconds or every maxBatch mutations, whichever comes first. Each
+// mutation runs in its own savepoint so a failing one does not undo the rest,
+// and its future completes only once the transaction holding it committed.
+class GroupCommitWriter
 {
 private:
-    vector<vector<string>> defaultData = {
-        {"Linus", "5000", "0", "0", "5"},
-        {"Elon", "50000", "0", "0", "10"},
-        {"Steve", "10000", "0", "0", "7"},
-        {"Bill", "25000", "0", "0", "8"},
-        {"John", "100", "0", "0", "3"}};
+    struct Mutation
+    {
+        function<bool(sqlite3 *)> apply;
+        promise<bool> done;
+    };
+
+    sqlite3 *db = nullptr;
+    int windowMs;
+    size_t maxBatch;
+    deque<Mutation> pending;
+    mutex lock;
+    condition_variable cv;
+    bool stopping = false;
+    thread writer;
+
+    static bool execute(sqlite3 *db, const char *sql)
+    {
+        return sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK;
+    }
 
-    void load(sqlite3 *db)
+    void loop()
     {
-        if (isTableEmpty(db, tablename))
+        while (true)
         {
-            cout << "Loading customers..." << endl;
-            for (vector<string> data : defaultData)
+            vector<Mutation> batch;
             {
-                add(data, db);
+                unique_lock<mutex> guard(lock);
+                cv.wait(guard, [this]
+                        { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+
+                // Let the batch fill up until the window closes or it is full
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(windowMs);
+                cv.wait_until(guard, deadline, [this]
+                              { return stopping || pending.size() >= maxBatch; });
+                while (!pending.empty() && batch.size() < maxBatch)
+                {
+                    batch.push_back(move(pending.front()));
+                    pending.pop_front();
+                }
+            }
+
+            vector<bool> applied(batch.size(), false);
+            // Taking the write lock up front lets the busy handler wait for other processes
+            bool committed = execute(db, "BEGIN IMMEDIATE;");
+            for (size_t i = 0; committed && i < batch.size(); i++)
+            {
+                execute(db, "SAVEPOINT mutation;");
+                applied[i] = batch[i].apply(db);
+                if (!applied[i])
+                    execute(db, "ROLLBACK TO mutation;");
+                execute(db, "RELEASE mutation;");
+            }
+            if (committed && !execute(db, "COMMIT;"))
+            {
+                Log::error("Error committing batch", db);
+                execute(db, "ROLLBACK;");
+                committed = false;
+            }
+            CarColumns::fleet().settle(db);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                batch[i].done.set_value(committed && applied[i]);
             }
         }
     }
 
 public:
-    CustomerDb()
+    GroupCommitWriter(const string &file = Db::getDatabaseFile(), int windowMs = 2, size_t maxBatch = 256)
+        : windowMs(windowMs), maxBatch(max<size_t>(1, maxBatch))
     {
-        tablename = "customers";
-        sqlite3 *db;
-        connectToDatabase(&db);
-        string sql = "CREATE TABLE IF NOT EXISTS customers (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, money INTEGER NOT NULL DEFAULT 5000, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue INTEGER NOT NULL DEFAULT 0, customerRecord INTEGER NOT NULL DEFAULT 5, password TEXT NOT NULL DEFAULT 123)";
-        createTable(db, sql);
-        load(db);
+        if (!Db::connectToDatabase(&db, file))
+            return;
+        SqliteEngine::keep(db);
+        writer = thread(&GroupCommitWriter::loop, this);
     }
 
-    static vector<string> searchCus(int id)
+    ~GroupCommitWriter()
     {
-        sqlite3 *db;
-        if (!connectToDatabase(&db))
-            return {};
-        string sql = "SELECT * FROM customers WHERE id = ?";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            lock_guard<mutex> guard(lock);
+            stopping = true;
         }
+        cv.notify_all();
+        if (writer.joinable())
+            writer.join();
+        SqliteEngine::release(db);
+        sqlite3_close(db);
+    }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, id);
+    GroupCommitWriter(const GroupCommitWriter &) = delete;
+    GroupCommitWriter &operator=(const GroupCommitWriter &) = delete;
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+    // The writer of this process for the main database, made on first use.
+    // Rentals, returns and dues updates go through it, so writes from
+    // threads of one process share commits.
+    static GroupCommitWriter &shared()
+    {
+        static GroupCommitWriter writer;
+        return writer;
+    }
+
+    // Queues a mutation; the future is true once it has been durably committed
+    future<bool> submit(function<bool(sqlite3 *)> apply)
+    {
+        Mutation mutation;
+        mutation.apply = move(apply);
+        future<bool> result = mutation.done.get_future();
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            lock_guard<mutex> guard(lock);
+            if (!writer.joinable())
+            {
+                mutation.done.set_value(false);
+                return result;
+            }
+            pending.push_back(move(mutation));
         }
+        cv.notify_one();
+        return result;
+    }
 
-        vector<string> cus;
-        cus.push_back(to_string(sqlite3_column_int(stmt, 0)));
-        cus.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
-        cus.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)));
-        cus.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3)));
-        cus.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4)));
-        cus.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5)));
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return cus;
+    future<bool> rent(int cusId, int carId, int date, string table)
+    {
+        return submit([=](sqlite3 *db)
+                      { return CarDb::searchRentableCar(carId, db) && Car::rent(cusId, carId, date, table, db); });
+    }
+
+    future<bool> rentHeld(uint64_t token, int date)
+    {
+        return submit([=](sqlite3 *db)
+                      { return HoldManager::checkout().convert(token, date, db); });
+    }
+
+    future<bool> returnCar(int cusId, int carId, int date, int condition, string table)
+    {
+        return submit([=](sqlite3 *db)
+                      { return Car::returnCar(cusId, carId, date, condition, table, RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, db); });
+    }
+
+    future<bool> updateDues(int id, int money, int dues, string table)
+    {
+        return submit([=](sqlite3 *db)
+                      { return Db::updateDues(id, money, dues, table, db); });
+    }
+
+    future<bool> updateCustomer(int id, vector<string> cus)
+    {
+        return submit([=](sqlite3 *db)
+                      { return CustomerDb::update(id, cus, db); });
+    }
+
+    future<bool> updateEmployee(int id, vector<string> emp)
+    {
+        return submit([=](sqlite3 *db)
+                      { return EmployeeDb::update(id, emp, db); });
     }
 
-    void add(const vector<string> cus, sqlite3 *db = nullptr)
+    // Throughput of dues updates from concurrent callers for several batch windows
+    static void benchmark(int clients, int operationsPerClient)
     {
-        if (db == nullptr)
+        const string scratch = "groupcommit.db";
+        remove(scratch.c_str());
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, scratch))
+            return;
+        sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CustomerDb::schema.c_str(), nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+        for (int i = 0; i < clients; i++)
         {
-            if (!connectToDatabase(&db))
-                return;
+            sqlite3_exec(db, "INSERT INTO customers (name) VALUES ('bench');", nullptr, nullptr, nullptr);
         }
-        string sql = "INSERT INTO customers (name, money, rentedCars, fineDue, customerRecord) VALUES (?, ?, ?, ?, ?)";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(db);
+
+        cout << "Batch window (ms)\tMax batch\tOps/sec" << endl;
+        for (int window : {0, 1, 2, 5, 10})
         {
-            cerr << "Error preparing statement for adding customers: " << sqlite3_errmsg(db) << endl;
-            return;
+            // A zero window with batches of one is the commit-per-mutation baseline
+            size_t batch = window == 0 ? 1 : 1024;
+            GroupCommitWriter writer(scratch, window, batch);
+            auto start = chrono::steady_clock::now();
+            vector<thread> callers;
+            for (int c = 0; c < clients; c++)
+            {
+                callers.emplace_back([&writer, c, operationsPerClient]
+                                     {
+                    for (int i = 0; i < operationsPerClient; i++)
+                    {
+                        writer.updateDues(c + 1, 5000 - i, i, "customers").get();
+                    } });
+            }
+            for (thread &caller : callers)
+            {
+                caller.join();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << window << "\t\t\t" << batch << "\t\t" << (long long)(clients * operationsPerClient / seconds) << endl;
         }
+        remove(scratch.c_str());
+        remove((scratch + "-wal").c_str());
+        remove((scratch + "-shm").c_str());
+    }
+};
 
-        // Bind the values of t to the prepared statement
-        sqlite3_bind_text(stmt, 1, cus[0].c_str(), -1, SQLITE_TRANSIENT); // Name
-        sqlite3_bind_text(stmt, 2, cus[1].c_str(), -1, SQLITE_TRANSIENT); // Money
-        sqlite3_bind_text(stmt, 3, cus[2].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
-        sqlite3_bind_text(stmt, 4, cus[3].c_str(), -1, SQLITE_TRANSIENT); // fineDue
-        sqlite3_bind_text(stmt, 5, cus[4].c_str(), -1, SQLITE_TRANSIENT); // record
+// What-if simulation of random rentals and returns. The same seeded workload
+// can run on any storage engine, so engines can be compared both for speed
+// and for ending up in the same state.
+class FleetSimulation
+{
+public:
+    struct Result
+    {
+        int rentals = 0;
+        int returns = 0;
+        double seconds = 0;
+    };
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_DONE)
-        {
-            cerr << "Error inserting " << tablename << ": " << sqlite3_errmsg(db) << endl;
-        }
-        cout << "Customer " << cus[0] << " added successfully." << endl;
-        sqlite3_finalize(stmt);
+    static void seed(StorageEngine &engine, int fleetSize)
+    {
+        CarDb::seed(engine, fleetSize);
+        CustomerDb::seed(engine);
+        EmployeeDb::seed(engine);
     }
 
-    void update(int id, const vector<string> &cus, sqlite3 *db = nullptr)
+    static int countRows(StorageEngine &engine, const string &table)
     {
-        if (db == nullptr)
-        {
-            if (!connectToDatabase(&db))
-                return;
-        }
-        if (search(id, db))
-        {
-            string sql = "UPDATE " + tablename + " SET name = ?, money = ?, rentedCars = ?, fineDue = ?, customerRecord = ? WHERE id = ?;";
+        int count = 0;
+        engine.scan(table, [&count](const vector<string> &)
+                    { count++; return true; });
+        return count;
+    }
 
-            sqlite3_stmt *stmt;
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    static Result run(StorageEngine &engine, int operations, int fleetSize, unsigned seed)
+    {
+        Result result;
+        mt19937 rng(seed);
+        int customers = countRows(engine, "customers");
+        int employees = countRows(engine, "employees");
+        vector<string> renterTable(fleetSize + 1); // cars.rentedBy does not say which table
+        int day = 0;
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < operations; i++)
+        {
+            int carId = rng() % fleetSize + 1;
+            vector<string> car;
+            if (!engine.get("cars", carId, car))
+                continue;
+            if (car[CAR_AVAILABLE] == "1")
             {
-                cerr << "Error preparing statement for updating: " << sqlite3_errmsg(db) << endl;
-                return;
+                bool employee = rng() % 4 == 0;
+                string table = employee ? "employees" : "customers";
+                int renter = rng() % (employee ? employees : customers) + 1;
+                if (Car::rent(engine, renter, carId, day, table))
+                {
+                    renterTable[carId] = table;
+                    result.rentals++;
+                }
             }
-
-            // Bind the values of t to the prepared statement
-            sqlite3_bind_text(stmt, 1, cus[1].c_str(), -1, SQLITE_TRANSIENT); // Name
-            sqlite3_bind_text(stmt, 2, cus[2].c_str(), -1, SQLITE_TRANSIENT); // Money
-            sqlite3_bind_text(stmt, 3, cus[3].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
-            sqlite3_bind_text(stmt, 4, cus[4].c_str(), -1, SQLITE_TRANSIENT); // fineDue
-            sqlite3_bind_text(stmt, 5, cus[5].c_str(), -1, SQLITE_TRANSIENT); // record
-            sqlite3_bind_int(stmt, 6, id);                                    // ID
-
-            // Execute the statement
-            if (sqlite3_step(stmt) != SQLITE_DONE)
+            else
             {
-                cerr << "Error updating customers: " << sqlite3_errmsg(db) << endl;
-                return;
+                int date = stoi(car[CAR_RENTED_ON]) + rng() % 10;
+                int condition = max(0, stoi(car[CAR_CONDITION]) - (int)(rng() % 3));
+                ReturnCharges charges;
+                if (Car::returnCar(engine, stoi(car[CAR_RENTED_BY]), carId, date, condition, renterTable[carId], RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges))
+                    result.returns++;
             }
-            cout << "Customer " << cus[0] << " updated successfully." << endl;
-            sqlite3_finalize(stmt);
-        }
-        else{
-            cout << "Customer not found." << endl;
+            if (i % 100 == 99)
+                day++;
         }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
     }
 
-    static void display(sqlite3 *db = nullptr)
+    static bool sameState(StorageEngine &a, StorageEngine &b)
     {
-        if (db == nullptr)
+        for (const char *table : {"cars", "customers", "employees"})
         {
-            if (!connectToDatabase(&db))
-                return;
+            vector<vector<string>> rowsA;
+            vector<vector<string>> rowsB;
+            a.scan(table, [&rowsA](const vector<string> &row)
+                   { rowsA.push_back(row); return true; });
+            b.scan(table, [&rowsB](const vector<string> &row)
+                   { rowsB.push_back(row); return true; });
+            if (rowsA != rowsB)
+            {
+                cout << "Engines diverged in table " << table << "." << endl;
+                return false;
+            }
         }
+        return true;
+    }
 
-        string sql = "SELECT * FROM customers";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-        {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
-        }
+    // A fixed script of car CRUD, rentals and returns, including steps that
+    // must fail; outcomes gets what every step returned
+    static void script(StorageEngine &engine, vector<bool> &outcomes)
+    {
+        seed(engine, 6);
+        ReturnCharges charges;
+        int added = CarDb::add(engine, {"McLaren 720S", "2022", "1", "-1", "-1", "100"});
+        outcomes.push_back(added == 7);
+        outcomes.push_back(CarDb::update(engine, 2, vector<string>{"2", "Ferrari F8 Tributo", "2023", "1", "-1", "-1", "95"}));
+        outcomes.push_back(Car::rent(engine, 1, 2, 0, "customers"));
+        outcomes.push_back(Car::rent(engine, 2, 2, 0, "customers")); // Already rented
+        outcomes.push_back(Car::rent(engine, 9, 3, 0, "customers")); // No such customer
+        outcomes.push_back(Car::rent(engine, 1, added, 1, "employees"));
+        outcomes.push_back(Car::returnCar(engine, 2, 2, 3, 90, "customers", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges)); // Wrong renter
+        outcomes.push_back(Car::returnCar(engine, 1, 2, RENT_DAYS_ALLOWED + 5, 80, "customers", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges)); // Late and damaged
+        outcomes.push_back(Car::returnCar(engine, 1, added, 0, 100, "employees", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges)); // Before the rental
+        outcomes.push_back(Car::returnCar(engine, 1, added, 4, 100, "employees", RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, charges));
+        outcomes.push_back(Car::rent(engine, 3, 2, 20, "customers"));
+        outcomes.push_back(CarDb::erase(engine, 3));
+        outcomes.push_back(CarDb::erase(engine, 3)); // Already deleted
+        outcomes.push_back(CarDb::update(engine, 3, vector<string>{"3", "Porsche 911", "2021", "1", "-1", "-1", "100"}));
+        outcomes.push_back(CarDb::add(engine, {"Aston Martin DB11", "2020", "1", "-1", "-1", "90"}) == added + 1);
+    }
 
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+    // Runs the script on the in-memory engine and on a scratch SQLite file
+    // and compares what each step returned and the final rows
+    static bool checkScript()
+    {
+        const string scratch = "script.db";
+        remove(scratch.c_str());
+
+        MemoryEngine memory;
+        vector<bool> inMemory;
+        script(memory, inMemory);
+
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, scratch))
+            return false;
+        for (const string &sql : {CarDb::schema, CustomerDb::schema, EmployeeDb::schema})
         {
-            cout << "No customers." << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
+            sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
         }
-
-        // Display all available car details
-        cout << "Displaying all customers:" << endl;
-        do
+        bool same;
         {
-            int cusId = sqlite3_column_int(stmt, 0);
-            string name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            string money = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            string rentedCars = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
-            string fineDue = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4));
-            string record = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5));
-            // Additional car details can be displayed if available in the table
-
-            cout << cusId << ". " << name << ", $" << money << ", " << rentedCars << " cars rented, Fine Due: $" << fineDue << ", Customer Record: " << record << endl;
-        } while (sqlite3_step(stmt) == SQLITE_ROW);
+            SqliteEngine sqlite(db);
+            vector<bool> onDisk;
+            script(sqlite, onDisk);
+            same = inMemory == onDisk;
+            if (!same)
+                cout << "Engines returned different results for the script." << endl;
+            same = sameState(memory, sqlite) && same;
+        }
+        sqlite3_close(db);
+        remove(scratch.c_str());
+        cout << (same ? "The CRUD and rental script ended in the same rows on both engines." : "The CRUD and rental script diverged between the engines.") << endl;
+        return same;
+    }
 
-        sqlite3_finalize(stmt);
+    static void report(const string &engine, const Result &result, int operations)
+    {
+        cout << engine << ": " << result.rentals << " rentals, " << result.returns << " returns in "
+             << result.seconds * 1000 << " ms (" << (long long)(operations / max(result.seconds, 1e-9)) << " ops/sec)" << endl;
     }
 
-    static void displayCustomer(int id)
+    // Runs one workload on the in-memory engine and on a scratch SQLite file
+    static void compareEngines(int operations, int fleetSize, unsigned workloadSeed = 253)
     {
-        vector<string> cus = searchCus(id);
-        cout << "Customer Name: " << cus[1] << ", ID: " << id << endl;
-        cout << "Money: " << cus[2] << " Rented Cars: " << cus[3] << endl;
-        cout << "Fine Due: " << cus[4] << ", Customer Record: " << cus[5] << endl;
+        const string scratch = "simulation.db";
+        remove(scratch.c_str());
+
+        MemoryEngine memory;
+        seed(memory, fleetSize);
+        Result inMemory = run(memory, operations, fleetSize, workloadSeed);
+        report("In-memory engine", inMemory, operations);
+
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, scratch))
+            return;
+        for (const string &sql : {CarDb::schema, CustomerDb::schema, EmployeeDb::schema})
+        {
+            sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+        }
+        sqlite3_exec(db, "PRAGMA synchronous=OFF;", nullptr, nullptr, nullptr);
+        {
+            SqliteEngine sqlite(db);
+            sqlite.transaction([&sqlite, fleetSize]
+                               { seed(sqlite, fleetSize); return true; });
+            Result onDisk = run(sqlite, operations, fleetSize, workloadSeed);
+            report("SQLite engine", onDisk, operations);
+
+            if (sameState(memory, sqlite))
+                cout << "Both engines ended in the same state." << endl;
+        }
+        sqlite3_close(db);
+        remove(scratch.c_str());
     }
 };
 
-class EmployeeDb : public Db
+// Writes a large, realistic database for scale testing. Rows are generated in
+// fixed-size chunks on a thread pool, each chunk from its own seed, so the
+// output depends only on the options and not on the number of threads. One
+// connection inserts the chunks in order with fast-load pragmas, and the
+// search index, triggers and aggregates are built once at the end.
+class DatasetGenerator
 {
+public:
+    struct Options
+    {
+        string file = FILENAME;
+        long long cars = 1000000;
+        long long customers = 100000;
+        long long employees = 1000;
+        unsigned seed = 253;
+        double skew = 1.0;     // Zipf exponent of model popularity; 0 is uniform
+        double rented = 0.3;   // Share of cars out on rent
+        double overdue = 0.2;  // Share of rentals past the allowed days
+        int today = 365;       // Day number the rentals are relative to
+        double area = 1000;    // Cars are spread evenly over an area x area square
+        size_t threads = thread::hardware_concurrency();
+        bool force = false;    // Replace an existing file
+    };
+
 private:
-    vector<vector<string>> defaultData = {
-        {"Emp1", "500", "0", "0", "7"},
-        {"Emp2", "5000", "0", "0", "5"},
-        {"Emp3", "1000", "0", "0", "6"},
-        {"Emp4", "2500", "0", "0", "8"},
-        {"Emp5", "10", "0", "0", "3"}};
+    struct GeneratedCar
+    {
+        int model;
+        int year;
+        int rentedBy;
+        int rentedOn;
+        int condition;
+        double x;
+        double y;
+    };
 
-    void load(sqlite3 *db)
+    struct GeneratedAccount
     {
-        if (isTableEmpty(db, tablename))
+        int name;
+        int money;
+        int fineDue;
+        int record;
+    };
+
+    static const long long CHUNK = 1 << 16;
+
+    inline static const vector<string> models = {
+        "Toyota Corolla", "Honda Civic", "Ford F-150", "Toyota Camry", "Tesla Model 3", "Honda CR-V", "Nissan Altima",
+        "Chevrolet Silverado", "Hyundai Elantra", "Volkswagen Golf", "BMW 3 Series", "Mercedes C-Class", "Audi A4",
+        "Kia Sportage", "Mazda CX-5", "Subaru Outback", "Jeep Wrangler", "Tesla Model Y", "Ford Mustang", "Volvo XC90",
+        "Porsche 911", "Ferrari F8", "Lamborghini Aventador", "Koenigsegg Agera", "Bugatti Veyron", "Rolls Royce Spectre"};
+    inline static const vector<string> names = {
+        "Linus", "Elon", "Steve", "Bill", "John", "Ada", "Grace", "Alan", "Margaret", "Dennis", "Ken", "Barbara",
+        "Donald", "Edsger", "Frances", "Tim", "Radia", "Guido", "Bjarne", "Anita"};
+
+    static mt19937_64 chunkRng(unsigned seed, int table, long long chunk)
+    {
+        seed_seq sequence{seed, (unsigned)table, (unsigned)chunk, (unsigned)(chunk >> 32)};
+        return mt19937_64(sequence);
+    }
+
+    // Generates chunks on the pool and hands them to insert in order, with
+    // a bounded number in flight so memory stays flat
+    template <typename Row>
+    static void produce(ThreadPool &pool, size_t window, long long count, const function<vector<Row>(long long first, long long last)> &generate,
+                        const function<void(long long first, const vector<Row> &rows)> &insert)
+    {
+        deque<pair<long long, future<vector<Row>>>> pending;
+        long long next = 0;
+        while (next < count || !pending.empty())
         {
-            cout << "Loading employees..." << endl;
-            for (vector<string> data : defaultData)
+            while (next < count && pending.size() < window)
             {
-                add(data, db);
+                long long first = next;
+                long long last = min(count, first + CHUNK);
+                pending.push_back({first, pool.submit([&generate, first, last]
+                                                      { return generate(first, last); })});
+                next = last;
             }
+            vector<Row> rows = pending.front().second.get();
+            insert(pending.front().first, rows);
+            pending.pop_front();
         }
     }
 
-public:
-    EmployeeDb()
+    static bool exec(sqlite3 *db, const string &sql)
     {
-        tablename = "employees";
-        sqlite3 *db;
-        connectToDatabase(&db);
-        string sql = "CREATE TABLE IF NOT EXISTS employees (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, money INTEGER NOT NULL DEFAULT 500, rentedCars INTEGER NOT NULL DEFAULT 0, fineDue INTEGER NOT NULL DEFAULT 0, employeeRecord INTEGER NOT NULL DEFAULT 7, password TEXT NOT NULL DEFAULT 123)";
-        createTable(db, sql);
-        load(db);
+        char *errmsg;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK)
+        {
+            cerr << "Error generating data: " << errmsg << endl;
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
     }
 
-    static vector<string> searchEmp(int i)
+    static void report(const string &what, long long rows, chrono::steady_clock::time_point start)
     {
-        sqlite3 *db;
-        if (!connectToDatabase(&db))
-            return {};
-        string sql = "SELECT * FROM employees WHERE id = ?";
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Inserted " << rows << " " << what << " in " << seconds << " s (" << (long long)(rows / max(seconds, 1e-9)) << " rows/sec)" << endl;
+    }
+
+    static bool loadAccounts(sqlite3 *db, ThreadPool &pool, const Options &options, const string &table, long long count, int tableIndex)
+    {
+        string record = table == "employees" ? "employeeRecord" : "customerRecord";
+        string sql = "INSERT INTO " + table + " (id, name, money, rentedCars, fineDue, " + record + ", password) VALUES (?, ?, ?, 0, ?, ?, '123')";
         sqlite3_stmt *stmt;
         if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
+            return false;
         }
+        bool ok = true;
+        auto start = chrono::steady_clock::now();
+        produce<GeneratedAccount>(
+            pool, options.threads * 2, count,
+            [&](long long first, long long last)
+            {
+                mt19937_64 rng = chunkRng(options.seed, tableIndex, first / CHUNK);
+                uniform_int_distribution<int> name(0, names.size() - 1);
+                uniform_real_distribution<double> logMoney(log(100.0), log(100000.0));
+                uniform_int_distribution<int> dues(10, 2000);
+                binomial_distribution<int> record(10, 0.7);
+                bernoulli_distribution owes(0.2);
+                vector<GeneratedAccount> rows(last - first);
+                for (GeneratedAccount &row : rows)
+                {
+                    row.name = name(rng);
+                    row.money = (int)exp(logMoney(rng));
+                    row.fineDue = owes(rng) ? dues(rng) : 0;
+                    row.record = record(rng);
+                }
+                return rows;
+            },
+            [&](long long first, const vector<GeneratedAccount> &rows)
+            {
+                for (size_t i = 0; i < rows.size() && ok; i++)
+                {
+                    sqlite3_bind_int64(stmt, 1, first + i + 1);
+                    sqlite3_bind_text(stmt, 2, names[rows[i].name].c_str(), -1, SQLITE_STATIC);
+                    sqlite3_bind_int(stmt, 3, rows[i].money);
+                    sqlite3_bind_int(stmt, 4, rows[i].fineDue);
+                    sqlite3_bind_int(stmt, 5, rows[i].record);
+                    ok = sqlite3_step(stmt) == SQLITE_DONE;
+                    sqlite3_reset(stmt);
+                }
+            });
+        if (!ok)
+            cerr << "Error inserting " << table << ": " << sqlite3_errmsg(db) << endl;
+        sqlite3_finalize(stmt);
+        report(table, count, start);
+        return ok;
+    }
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, i);
+    static bool loadCars(sqlite3 *db, ThreadPool &pool, const Options &options)
+    {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "INSERT INTO cars (id, model, year, available, rentedBy, rentedOn, condition, x, y) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
+            return false;
+        }
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        // Popularity of the model at rank r is proportional to 1 / r^skew
+        vector<double> cumulative(models.size());
+        double sum = 0;
+        for (size_t rank = 0; rank < models.size(); rank++)
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            sum += 1 / pow(rank + 1, options.skew);
+            cumulative[rank] = sum;
+        }
+        vector<string> years(30);
+        for (int age = 0; age < 30; age++)
+        {
+            years[age] = to_string(2024 - age);
         }
 
-        vector<string> emp;
-        emp.push_back(to_string(sqlite3_column_int(stmt, 0)));
-        emp.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
-        emp.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)));
-        emp.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3)));
-        emp.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4)));
-        emp.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5)));
+        bool ok = true;
+        auto start = chrono::steady_clock::now();
+        produce<GeneratedCar>(
+            pool, options.threads * 2, options.cars,
+            [&](long long first, long long last)
+            {
+                mt19937_64 rng = chunkRng(options.seed, 0, first / CHUNK);
+                uniform_real_distribution<double> popularity(0, sum);
+                geometric_distribution<int> age(0.15);
+                exponential_distribution<double> wear(0.1);
+                bernoulli_distribution rented(options.rented);
+                bernoulli_distribution overdue(options.overdue);
+                uniform_int_distribution<int> renter(1, max<long long>(1, options.customers));
+                uniform_int_distribution<int> withinAllowed(0, RENT_DAYS_ALLOWED);
+                uniform_int_distribution<int> late(RENT_DAYS_ALLOWED + 1, RENT_DAYS_ALLOWED + 30);
+                uniform_real_distribution<double> coordinate(0, options.area);
+                vector<GeneratedCar> rows(last - first);
+                for (GeneratedCar &row : rows)
+                {
+                    row.model = lower_bound(cumulative.begin(), cumulative.end(), popularity(rng)) - cumulative.begin();
+                    row.model = min<int>(row.model, models.size() - 1);
+                    row.year = min(age(rng), 29);
+                    row.condition = 100 - min(60, (int)wear(rng));
+                    row.rentedBy = -1;
+                    row.rentedOn = -1;
+                    row.x = coordinate(rng);
+                    row.y = coordinate(rng);
+                    if (options.customers > 0 && rented(rng))
+                    {
+                        row.rentedBy = renter(rng);
+                        row.rentedOn = options.today - (overdue(rng) ? late(rng) : withinAllowed(rng));
+                    }
+                }
+                return rows;
+            },
+            [&](long long first, const vector<GeneratedCar> &rows)
+            {
+                for (size_t i = 0; i < rows.size() && ok; i++)
+                {
+                    sqlite3_bind_int64(stmt, 1, first + i + 1);
+                    sqlite3_bind_text(stmt, 2, models[rows[i].model].c_str(), -1, SQLITE_STATIC);
+                    sqlite3_bind_text(stmt, 3, years[rows[i].year].c_str(), -1, SQLITE_STATIC);
+                    sqlite3_bind_int(stmt, 4, rows[i].rentedBy == -1 ? 1 : 0);
+                    sqlite3_bind_int(stmt, 5, rows[i].rentedBy);
+                    sqlite3_bind_int(stmt, 6, rows[i].rentedOn);
+                    sqlite3_bind_int(stmt, 7, rows[i].condition);
+                    sqlite3_bind_double(stmt, 8, rows[i].x);
+                    sqlite3_bind_double(stmt, 9, rows[i].y);
+                    ok = sqlite3_step(stmt) == SQLITE_DONE;
+                    sqlite3_reset(stmt);
+                }
+            });
+        if (!ok)
+            cerr << "Error inserting cars: " << sqlite3_errmsg(db) << endl;
         sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return emp;
+        report("cars", options.cars, start);
+        return ok;
     }
 
-    void add(const vector<string> emp, sqlite3 *db = nullptr)
+public:
+    // Reads "--generate [--cars N] [--customers N] ..." style arguments
+    static bool parse(int argc, char *argv[], Options &options)
     {
-        if (db == nullptr)
+        for (int i = 2; i < argc; i++)
         {
-            if (!connectToDatabase(&db))
-                return;
+            string name = argv[i];
+            if (name == "--force")
+            {
+                options.force = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+            {
+                cout << "Missing value for " << name << endl;
+                return false;
+            }
+            string value = argv[++i];
+            try
+            {
+                if (name == "--out")
+                    options.file = value;
+                else if (name == "--cars")
+                    options.cars = stoll(value);
+                else if (name == "--customers")
+                    options.customers = stoll(value);
+                else if (name == "--employees")
+                    options.employees = stoll(value);
+                else if (name == "--seed")
+                    options.seed = stoul(value);
+                else if (name == "--skew")
+                    options.skew = stod(value);
+                else if (name == "--rented")
+                    options.rented = stod(value);
+                else if (name == "--overdue")
+                    options.overdue = stod(value);
+                else if (name == "--today")
+                    options.today = stoi(value);
+                else if (name == "--area")
+                    options.area = stod(value);
+                else if (name == "--threads")
+                    options.threads = stoul(value);
+                else
+                {
+                    cout << "Unknown option " << name << endl;
+                    return false;
+                }
+            }
+            catch (const exception &)
+            {
+                cout << "Invalid value for " << name << ": " << value << endl;
+                return false;
+            }
         }
-        string sql = "INSERT INTO employees (name, money, rentedCars, fineDue, employeeRecord) VALUES (?, ?, ?, ?, ?)";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        if (options.cars < 0 || options.customers < 0 || options.employees < 0 || options.cars > INT_MAX || options.customers > INT_MAX ||
+            options.employees > INT_MAX || options.rented < 0 || options.rented > 1 || options.overdue < 0 || options.overdue > 1 || options.skew < 0)
         {
-            cerr << "Error preparing statement for adding employees: " << sqlite3_errmsg(db) << endl;
-            return;
+            cout << "Invalid options." << endl;
+            return false;
         }
+        if (options.threads == 0)
+            options.threads = 2;
+        return true;
+    }
 
-        // Bind the values of t to the prepared statement
-        sqlite3_bind_text(stmt, 1, emp[0].c_str(), -1, SQLITE_TRANSIENT); // Name
-        sqlite3_bind_text(stmt, 2, emp[1].c_str(), -1, SQLITE_TRANSIENT); // Money
-        sqlite3_bind_text(stmt, 3, emp[2].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
-        sqlite3_bind_text(stmt, 4, emp[3].c_str(), -1, SQLITE_TRANSIENT); // fineDue
-        sqlite3_bind_text(stmt, 5, emp[4].c_str(), -1, SQLITE_TRANSIENT); // record
+    static bool generate(const Options &options)
+    {
+        FILE *existing = fopen(options.file.c_str(), "rb");
+        if (existing != nullptr)
+        {
+            fclose(existing);
+            if (!options.force)
+            {
+                cout << options.file << " already exists. Use --force to replace it." << endl;
+                return false;
+            }
+        }
+        for (const char *suffix : {"", "-wal", "-shm", "-journal", ".snapshot"})
+        {
+            remove((options.file + suffix).c_str());
+        }
 
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+        auto start = chrono::steady_clock::now();
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, options.file))
+            return false;
+        // Nothing is readable until the load finishes, so durability can wait for the final sync
+        bool ok = exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; PRAGMA locking_mode=EXCLUSIVE; PRAGMA cache_size=-262144; PRAGMA temp_store=MEMORY;") &&
+                  exec(db, CustomerDb::schema + ";" + EmployeeDb::schema + ";" + CarDb::schema + ";") && exec(db, "BEGIN;");
         {
-            cerr << "Error inserting " << tablename << ": " << sqlite3_errmsg(db) << endl;
+            ThreadPool pool(options.threads);
+            ok = ok && loadAccounts(db, pool, options, "customers", options.customers, 1);
+            ok = ok && loadAccounts(db, pool, options, "employees", options.employees, 2);
+            ok = ok && loadCars(db, pool, options);
         }
-        cout << "Employee " << emp[0] << " added successfully." << endl;
-        sqlite3_finalize(stmt);
-    }
+        // Rentals were drawn per car, so each customer's count is added up afterwards
+        ok = ok && exec(db, "UPDATE customers SET rentedCars = rented.cars FROM (SELECT rentedBy, count(*) AS cars FROM cars WHERE rentedBy > 0 GROUP BY rentedBy) AS rented "
+                            "WHERE customers.id = rented.rentedBy;");
+        ok = ok && exec(db, "COMMIT;");
+        sqlite3_close(db);
+        if (!ok)
+            return false;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Generated " << options.cars + options.customers + options.employees << " rows in " << seconds << " s" << endl;
 
-    void update(int id, const vector<string> &emp, sqlite3 *db = nullptr)
-    {
-        if (db == nullptr)
+        // The usual first-start setup adds the search index, triggers and aggregates over the loaded rows
+        auto setup = chrono::steady_clock::now();
+        Db::setDatabaseFile(options.file);
         {
-            if (!connectToDatabase(&db))
-                return;
+            CarDb cars;
+            CustomerDb customers;
+            EmployeeDb employees;
         }
-        if (search(id, db))
+        Db::stampSchema();
+        if (Db::connectToDatabase(&db))
         {
-            string sql = "UPDATE " + tablename + " SET name = ?, money = ?, rentedCars = ?, fineDue = ?, employeeRecord = ? WHERE id = ?;";
+            FleetSnapshot::save(db);
+            sqlite3_close(db);
+        }
+        cout << "Built indexes, triggers, aggregates and the startup snapshot in "
+             << chrono::duration<double>(chrono::steady_clock::now() - setup).count() << " s" << endl;
+        cout << "Wrote " << options.file << " in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        return true;
+    }
+};
 
-            sqlite3_stmt *stmt;
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-            {
-                cerr << "Error preparing statement for updating: " << sqlite3_errmsg(db) << endl;
-                return;
-            }
+// Records an interactive session to a trace file: every input line with the
+// time it was read, and at each command prompt a hash of the output printed
+// since the previous prompt. Replaying the input must reproduce the hashes.
+// The line answering a password prompt is recorded as "secret" without its
+// text.
+class SessionTrace
+{
+private:
+    // Passes input through line by line, writing each line to the trace as it is read
+    class RecordingInput : public streambuf
+    {
+    private:
+        streambuf *source;
+        string line;
 
-            // Bind the values of t to the prepared statement
-            sqlite3_bind_text(stmt, 1, emp[1].c_str(), -1, SQLITE_TRANSIENT); // Name
-            sqlite3_bind_text(stmt, 2, emp[2].c_str(), -1, SQLITE_TRANSIENT); // Money
-            sqlite3_bind_text(stmt, 3, emp[3].c_str(), -1, SQLITE_TRANSIENT); // rentedCars
-            sqlite3_bind_text(stmt, 4, emp[4].c_str(), -1, SQLITE_TRANSIENT); // fineDue
-            sqlite3_bind_text(stmt, 5, emp[5].c_str(), -1, SQLITE_TRANSIENT); // record
-            sqlite3_bind_int(stmt, 6, id);                                    // ID
-
-            // Execute the statement
-            if (sqlite3_step(stmt) != SQLITE_DONE)
+    protected:
+        int underflow() override
+        {
+            if (gptr() < egptr())
+                return traits_type::to_int_type(*gptr());
+            line.clear();
+            int c;
+            while ((c = source->sbumpc()) != traits_type::eof())
             {
-                cerr << "Error updating employees: " << sqlite3_errmsg(db) << endl;
-                return;
+                line += (char)c;
+                if (c == '\n')
+                    break;
             }
-            cout << "Employee " << emp[0] << " updated successfully." << endl;
-            sqlite3_finalize(stmt);
-        }
-        else{
-            cout << "Employee not found." << endl;
+            if (line.empty())
+                return traits_type::eof();
+            string text = line.back() == '\n' ? line.substr(0, line.size() - 1) : line;
+            if (output->promptsForSecret())
+                fprintf(file, "secret %lld\n", elapsed());
+            else
+                fprintf(file, "in %lld %s\n", elapsed(), text.c_str());
+            setg(&line[0], &line[0], &line[0] + line.size());
+            return traits_type::to_int_type(*gptr());
         }
-    }
 
-    static void display(sqlite3 *db = nullptr)
+    public:
+        explicit RecordingInput(streambuf *source) : source(source) {}
+    };
+
+    // Passes output through while hashing it a line at a time
+    class HashingOutput : public streambuf
     {
-        if (db == nullptr)
+    private:
+        streambuf *target;
+        string line;
+        string previous; // The last complete line
+
+    protected:
+        int overflow(int c) override
         {
-            if (!connectToDatabase(&db))
-                return;
+            if (c == traits_type::eof())
+                return traits_type::not_eof(c);
+            line += (char)c;
+            if (c == '\n')
+                endLine();
+            return target->sputc((char)c);
         }
 
-        string sql = "SELECT * FROM employees";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        int sync() override
         {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
+            return target->pubsync();
         }
 
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+    public:
+        explicit HashingOutput(streambuf *target) : target(target) {}
+
+        // Lines reporting timings are hashed without their digits, so runs can match
+        void endLine()
         {
-            cout << "No employees." << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return;
+            previous = line;
+            if (line.find(" ms") != string::npos || line.find("/sec") != string::npos || line.find(" s (") != string::npos)
+                line.erase(remove_if(line.begin(), line.end(), ::isdigit), line.end());
+            hash = fnv1a(line.data(), line.size(), hash);
+            lines++;
+            line.clear();
         }
 
-        // Display all available car details
-        cout << "Displaying all employees" << endl;
-        do
+        void flush()
         {
-            int empId = sqlite3_column_int(stmt, 0);
-            string name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            string money = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            string rentedCars = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
-            string fineDue = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4));
-            string record = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5));
-            // Additional car details can be displayed if available in the table
-
-            cout << empId << ". " << name << ", $" << money << ", " << rentedCars << " cars rented, Fine Due: $" << fineDue << ", Employee Record: " << record << endl;
-        } while (sqlite3_step(stmt) == SQLITE_ROW);
-
-        sqlite3_finalize(stmt);
-    }
+            if (!line.empty())
+                endLine();
+        }
 
-    static void displayEmployee(int id)
+        // Whether the text before the input being read asks for a password
+        bool promptsForSecret() const
+        {
+            const string &prompt = line.empty() ? previous : line;
+            return prompt.rfind("Enter", 0) == 0 && prompt.find("Password") != string::npos;
+        }
+    };
+
+    inline static FILE *file = nullptr;
+    inline static chrono::steady_clock::time_point started;
+    inline static RecordingInput *input = nullptr;
+    inline static HashingOutput *output = nullptr;
+    inline static streambuf *originalInput = nullptr;
+    inline static streambuf *originalOutput = nullptr;
+    inline static uint64_t hash = 14695981039346656037ULL;
+    inline static int lines = 0;
+
+    static long long elapsed()
     {
-        vector<string> cus = searchEmp(id);
-        cout << "Employee Name: " << cus[1] << ", ID: " << id << endl;
-        cout << "Money: " << cus[2] << " Rented Cars: " << cus[3] << endl;
-        cout << "Fine Due: " << cus[4] << ", Employee Record: " << cus[5] << endl;
-        cout << "Employee Discount: " << EMPLOYEE_DISCOUNT * 100 << "%" << endl;
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
     }
-};
-
-// Base class for users
-class User
-{
-protected:
-    string name;
-    int id;
-    string password;
 
-    User(int i) : id(i)
+public:
+    static bool start(const string &path)
     {
-        password = "123";
+        file = fopen(path.c_str(), "w");
+        if (file == nullptr)
+        {
+            cerr << "Cannot write trace file " << path << endl;
+            return false;
+        }
+        started = chrono::steady_clock::now();
+        long long now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        fprintf(file, "start %lld %s\n", now, Db::getDatabaseFile().c_str());
+        originalInput = cin.rdbuf();
+        originalOutput = cout.rdbuf();
+        input = new RecordingInput(originalInput);
+        output = new HashingOutput(originalOutput);
+        cin.rdbuf(input);
+        cout.rdbuf(output);
+        atexit(stop); // Also covers exit() from inside a command
+        return true;
     }
 
-    User(string n, int i, string p) : name(n), id(i), password(p) {}
-
-    virtual void displayDetails() const
+    // Ends the output of the previous command; called before each command prompt
+    static void checkpoint()
     {
-        cout << "Name: " << name << ", ID: " << id << endl;
+        if (file == nullptr)
+            return;
+        output->flush();
+        fprintf(file, "out %lld %016llx %d\n", elapsed(), (unsigned long long)hash, lines);
+        fflush(file);
+        hash = 14695981039346656037ULL;
+        lines = 0;
     }
 
-public:
-
-    bool checkPassword(string pass)
+    static void stop()
     {
-        return pass == password;
+        if (file == nullptr)
+            return;
+        cout.flush();
+        checkpoint();
+        cin.rdbuf(originalInput);
+        cout.rdbuf(originalOutput);
+        fclose(file);
+        file = nullptr;
     }
 };
 
-// Class for cars
-class Car
+// Re-runs recorded sessions against a copy of the database. Each session is
+// a child process of this program fed its recorded input at the recorded
+// pace (scaled by speed, or as fast as possible), itself recording a trace
+// that is then compared with the original prompt by prompt. Sessions run in
+// separate processes because the in-memory indexes are per process.
+class TraceReplay
 {
-private:
-    string model;
-    string condition;
-
 public:
-    Car(string m, string c) : model(m), condition(c) {}
-
-    static bool rent(int cusId, int carId, int date, string table, sqlite3 *db = nullptr)
+    struct Segment
     {
-        if (db == nullptr)
-        {
-            if (!Db::connectToDatabase(&db))
-                return false;
-        }
+        vector<pair<long long, string>> input; // Lines read, with their time in ms
+        long long end = 0;                     // Time of the prompt closing the segment
+        string hash;
+        int lines = 0;
+    };
 
-        // Update car availability and user rented cars
-        sqlite3_stmt *stmt;
-        string sql = "UPDATE cars SET available=available-1, rentedBy=?, rentedOn=? WHERE id=?";
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_int(stmt, 1, cusId);
-        sqlite3_bind_int(stmt, 2, date);
-        sqlite3_bind_int(stmt, 3, carId);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+    struct Options
+    {
+        vector<string> traces;
+        string database = FILENAME;
+        double speed = 1; // 0 replays as fast as possible
+        size_t parallel = 1;
+        string password; // Typed wherever the recording has a secret line
+    };
+
+    static bool load(const string &path, vector<Segment> &segments, const string &password = "")
+    {
+        ifstream in(path);
+        if (!in)
         {
-            cerr << "Error updating car availability: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
+            cout << "Cannot open trace " << path << endl;
             return false;
         }
-
-        sql = "UPDATE " + table + " SET rentedCars=rentedCars+1 WHERE id=?";
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_int(stmt, 1, cusId);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+        segments.assign(1, Segment());
+        string text;
+        while (getline(in, text))
         {
-            cerr << "Error updating " + table + " rented cars: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return false;
+            istringstream fields(text);
+            string kind;
+            long long time;
+            fields >> kind >> time;
+            if (kind == "in")
+            {
+                segments.back().input.push_back({time, text.substr(min(text.size(), text.find(' ', 3) + 1))});
+            }
+            else if (kind == "secret")
+            {
+                segments.back().input.push_back({time, password});
+            }
+            else if (kind == "out")
+            {
+                segments.back().end = time;
+                fields >> segments.back().hash >> segments.back().lines;
+                segments.push_back(Segment());
+            }
         }
-        sqlite3_finalize(stmt);
-        cout << "Car rented successfully." << endl;
+        segments.pop_back(); // Input after the last prompt was never answered
         return true;
     }
 
-    static vector<int> checkRents(int cusId, string table, sqlite3 *db = nullptr)
+    static bool parse(int argc, char *argv[], Options &options)
     {
-        if (db == nullptr)
-        {
-            if (!Db::connectToDatabase(&db))
-                return {};
-        }
-        // Check if customer has rented cars
-        string sql = "SELECT * FROM cars WHERE rentedBy=?";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-        {
-            cerr << "Error preparing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
-        }
-
-        sqlite3_bind_int(stmt, 1, cusId);
-
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        for (int i = 2; i < argc; i++)
         {
-            cout << "You haven't rented any cars." << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return {};
+            string name = argv[i];
+            if (name.rfind("--", 0) != 0)
+            {
+                options.traces.push_back(name);
+                continue;
+            }
+            if (i + 1 >= argc)
+                return false;
+            string value = argv[++i];
+            if (name == "--db")
+                options.database = value;
+            else if (name == "--speed")
+                options.speed = value == "max" ? 0 : atof(value.c_str());
+            else if (name == "--parallel")
+                options.parallel = max(1, atoi(value.c_str()));
+            else if (name == "--password")
+                options.password = value;
+            else
+                return false;
         }
-
-        vector<int> rentedCars;
-
-        // Display all rented car details
-        cout << "Your rented cars:" << endl;
-        do
-        {
-            int car_id = sqlite3_column_int(stmt, 0);
-            string model = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            string year = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            int due = dueDate(car_id);
-
-            cout << car_id << ". " << model << " (" << year << "), Due Date: " << due << endl;
-            rentedCars.push_back(car_id);
-
-        } while (sqlite3_step(stmt) == SQLITE_ROW);
-
-        sqlite3_finalize(stmt);
-        return rentedCars;
+        return !options.traces.empty() && options.speed >= 0;
     }
 
-    static bool returnCar(int cusId, int carId, int date, int condition, string table, int daysAllowed, int rentPerDay, double employeeDiscount, sqlite3 *db = nullptr)
+    static bool run(const Options &options)
     {
-        if (db == nullptr)
+#ifdef __unix__
+        // Sessions change the copy, never the original
+        string copy = "replay.db";
+        for (const char *suffix : {"", "-wal", "-shm", ".snapshot"})
         {
-            if (!Db::connectToDatabase(&db))
-                return false;
+            remove((copy + suffix).c_str());
         }
-
-        sqlite3_stmt *stmt;
-
-        vector<string> car = CarDb::searchCar(carId);
-        int rentedOn = stoi(car[5]);
-        int rentDays = date - rentedOn;
-        if (rentDays < 0)
+        sqlite3 *db;
+        if (!Db::connectToDatabase(&db, options.database))
+            return false;
+        string sql = "VACUUM INTO '" + copy + "'";
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
         {
-            cout << "Invalid return date. Please enter a date after the rental date." << endl;
+            cerr << "Error copying " << options.database << ": " << sqlite3_errmsg(db) << endl;
+            sqlite3_close(db);
             return false;
         }
-        int fine = rentDays * rentPerDay;
-        if (table == "employees")
+        sqlite3_close(db);
+        if (Db::connectToDatabase(&db, copy))
         {
-            fine = (1 - employeeDiscount) * fine;
+            // The copy is not in WAL mode, and sessions would block each other without it
+            sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+            sqlite3_close(db);
         }
-        int recordDuction = 0;
-        if (rentDays > daysAllowed)
-        {
-            cout << "You have exceeded the allowed rental period. A fine of $10 per day will be added to your account." << endl;
-            fine += 10 * (rentDays - daysAllowed);
 
-            recordDuction += 1;
-        }
-        if (condition < stoi(car[6]))
+        vector<vector<Segment>> recorded(options.traces.size());
+        for (size_t i = 0; i < options.traces.size(); i++)
         {
-            cout << "The condition of the car is worse than when you rented it. A fine of $20 per % difference will be added to your account." << endl;
-            fine += 20 * (stoi(car[6]) - condition);
-
-            recordDuction += 2;
+            if (!load(options.traces[i], recorded[i], options.password))
+                return false;
         }
 
-        if (recordDuction > 0)
+        // A session that exits early closes its end of the pipe; writing to it
+        // must fail with EPIPE instead of killing the replay
+        void (*previousHandler)(int) = signal(SIGPIPE, SIG_IGN);
+        auto start = chrono::steady_clock::now();
+        vector<future<bool>> sessions;
+        vector<char> endedEarly(options.traces.size(), false);
         {
-            string sql = "UPDATE " + table + " SET customerRecord=customerRecord-1 WHERE id=?";
-            sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-            sqlite3_bind_int(stmt, 1, cusId);
-            if (sqlite3_step(stmt) != SQLITE_DONE)
+            ThreadPool pool(options.parallel);
+            for (size_t i = 0; i < options.traces.size(); i++)
             {
-                cerr << "Error updating " + table + " customer record: " << sqlite3_errmsg(db) << endl;
-                sqlite3_finalize(stmt);
-                sqlite3_close(db);
-                return false;
+                sessions.push_back(pool.submit([&, i]
+                                               { return replaySession(recorded[i], options.traces[i] + ".replay", copy, options.speed, endedEarly[i]); }));
+            }
+            for (auto &session : sessions)
+            {
+                session.wait();
             }
-            sqlite3_finalize(stmt);
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        signal(SIGPIPE, previousHandler);
 
-        // Update car availability and user rented cars
-
-        string sql = "UPDATE cars SET available=available+1, rentedBy=-1 WHERE id=?";
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_int(stmt, 1, carId);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
+        int divergences = 0;
+        long long recordedSpan = 0;
+        for (size_t i = 0; i < options.traces.size(); i++)
         {
-            cerr << "Error updating car availability: " << sqlite3_errmsg(db) << endl;
-            return false;
-        }
-        sql = "UPDATE " + table + " SET rentedCars=rentedCars-1, fineDue=fineDue+? WHERE id=?";
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_int(stmt, 1, fine);
-        sqlite3_bind_int(stmt, 2, cusId);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
-        {
-            cerr << "Error updating " + table + " rented cars: " << sqlite3_errmsg(db) << endl;
-            return false;
+            vector<Segment> replayed;
+            if (!sessions[i].get() || !load(options.traces[i] + ".replay", replayed))
+            {
+                cout << options.traces[i] << ": replay failed" << endl;
+                divergences++;
+                continue;
+            }
+            if (endedEarly[i])
+            {
+                cout << options.traces[i] << ": the session exited before reading all of its input" << endl;
+                divergences++;
+            }
+            divergences += compare(options.traces[i], recorded[i], replayed);
+            if (!recorded[i].empty())
+                recordedSpan = max(recordedSpan, recorded[i].back().end);
         }
-
-        sqlite3_finalize(stmt);
-        cout << "Car returned successfully." << endl;
-        return true;
+        cout << "Replayed " << options.traces.size() << " sessions in " << seconds << " s (recorded over " << recordedSpan / 1000.0 << " s), "
+             << divergences << " divergences" << endl;
+        return divergences == 0;
+#else
+        cout << "Replay needs fork and exec, which this platform does not provide." << endl;
+        return false;
+#endif
     }
 
-    void displayDetails() const
+private:
+    // Prompt by prompt comparison; returns the number of prompts that differ
+    static int compare(const string &name, const vector<Segment> &recorded, const vector<Segment> &replayed)
     {
-        cout << "Model: " << model << ", Condition: " << condition << endl;
+        int divergences = 0;
+        vector<double> latencies;
+        // Prompt 0 is the startup output, which depends on the state of the startup snapshot
+        for (size_t i = 1; i < max(recorded.size(), replayed.size()); i++)
+        {
+            string command = recorded.size() > i && !recorded[i].input.empty() ? recorded[i].input[0].second : "(none)";
+            if (i >= recorded.size() || i >= replayed.size())
+            {
+                cout << name << ": prompt " << i << " (" << command << ") exists only in the " << (i >= recorded.size() ? "replay" : "recording") << endl;
+                divergences++;
+                continue;
+            }
+            if (recorded[i].hash != replayed[i].hash)
+            {
+                cout << name << ": prompt " << i << " (" << command << ") printed different output ("
+                     << recorded[i].lines << " lines recorded, " << replayed[i].lines << " replayed)" << endl;
+                divergences++;
+            }
+            // Time from the last input of the command to the next prompt
+            if (!replayed[i].input.empty())
+                latencies.push_back(replayed[i].end - replayed[i].input.back().first);
+        }
+        sort(latencies.begin(), latencies.end());
+        cout << name << ": " << recorded.size() << " prompts, " << divergences << " divergences";
+        if (!latencies.empty())
+        {
+            cout << ", command latency p50 " << latencies[latencies.size() / 2] << " ms, p95 " << latencies[latencies.size() * 95 / 100]
+                 << " ms, max " << latencies.back() << " ms";
+        }
+        cout << endl;
+        return divergences;
     }
 
-    static int dueDate(int carId)
+#ifdef __unix__
+    // False if the session could not be run; endedEarly is set when it
+    // stopped reading before the end of its input
+    static bool replaySession(const vector<Segment> &segments, const string &trace, const string &database, double speed, char &endedEarly)
     {
-        sqlite3 *db;
-        if (!Db::connectToDatabase(&db))
-            return -1;
-        string sql = "SELECT rentedOn FROM cars WHERE id = ?";
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        int pipeFds[2];
+        if (pipe(pipeFds) != 0)
+            return false;
+        pid_t child = fork();
+        if (child < 0)
+            return false;
+        if (child == 0)
         {
-            cerr << "Error preparing statement for searching: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return -1;
+            dup2(pipeFds[0], STDIN_FILENO);
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+            FILE *null = freopen("/dev/null", "w", stdout);
+            (void)null;
+            execl("/proc/self/exe", "Assign1", "--db", database.c_str(), "--record", trace.c_str(), (char *)nullptr);
+            _exit(127);
         }
+        close(pipeFds[0]);
 
-        // Bind the value of id to the prepared statement
-        sqlite3_bind_int(stmt, 1, carId);
-
-        // Execute the statement
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        auto start = chrono::steady_clock::now();
+        bool ok = true;
+        for (size_t s = 0; s < segments.size() && ok && !endedEarly; s++)
         {
-            cerr << "Error executing statement: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return -1;
+            for (const auto &line : segments[s].input)
+            {
+                if (speed > 0)
+                    this_thread::sleep_until(start + chrono::microseconds((long long)(line.first * 1000 / speed)));
+                string text = line.second + "\n";
+                if (write(pipeFds[1], text.data(), text.size()) == (ssize_t)text.size())
+                    continue;
+                if (errno == EPIPE)
+                    endedEarly = true;
+                else
+                    ok = false;
+                break;
+            }
         }
-
-        int rentedOn = sqlite3_column_int(stmt, 0);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        if (rentedOn == -1)
-            return -1;
-        return rentedOn + RENT_DAYS_ALLOWED;
+        close(pipeFds[1]); // End of input ends the session
+        int status;
+        waitpid(child, &status, 0);
+        return ok && WIFEXITED(status);
     }
+#endif
 };
 
 // Class for manager
@@ -1155,60 +8653,69 @@ private:
     EmployeeDb employees;
 
 public:
-    Manager(string n, int i, string p) : User(n, i, p) {}
+    Manager(string n, int i, string p) : User(n, i, p)
+    {
+        Db::stampSchema();
+    }
 
-    void addCustomer(vector<string> cus)
+    // db is a branch's database; nullptr works on the main one
+    void addCustomer(const vector<string> &cus, sqlite3 *db = nullptr)
     {
         // Code to add a customer
-        customers.add(cus);
+        customers.add(cus, db);
     }
 
-    void updateCustomer(int id, const vector<string> &cus)
+    template <typename Row>
+    void updateCustomer(int id, const Row &cus, sqlite3 *db = nullptr)
     {
         // Code to update a customer
-        customers.update(id, cus);
+        customers.update(id, cus, db);
     }
 
-    void deleteCustomer(int id)
+    void deleteCustomer(int id, sqlite3 *db = nullptr)
     {
         // Code to delete a customer
-        customers.deleteRecord(id);
+        customers.deleteRecord(id, db);
     }
 
-    void addEmployee(vector<string> emp)
+    // db is a branch's database; nullptr works on the main one
+    void addEmployee(const vector<string> &emp, sqlite3 *db = nullptr)
     {
         // Code to add an employee
-        employees.add(emp);
+        employees.add(emp, db);
     }
 
-    void updateEmployee(int id, const vector<string> &emp)
+    template <typename Row>
+    void updateEmployee(int id, const Row &emp, sqlite3 *db = nullptr)
     {
         // Code to update an employee
-        employees.update(id, emp);
+        employees.update(id, emp, db);
     }
 
-    void deleteEmployee(int id)
+    void deleteEmployee(int id, sqlite3 *db = nullptr)
     {
         // Code to delete an employee
-        employees.deleteRecord(id);
+        employees.deleteRecord(id, db);
     }
 
-    void addCar(vector<string> car)
+    // db is a branch's database; nullptr works on the main one
+    void addCar(const vector<string> &car, sqlite3 *db = nullptr)
     {
         // Code to add a car
-        cars.add(car);
+        cars.add(car, db);
     }
 
-    void updateCar(int id, const vector<string> &car)
+    template <typename Row>
+    void updateCar(int id, const Row &car, sqlite3 *db = nullptr)
     {
         // Code to update a car
-        cars.update(id, car);
+        cars.update(id, car, db);
     }
 
-    void deleteCar(int id)
+    void deleteCar(int id, sqlite3 *db = nullptr)
     {
         // Code to delete a car
-        cars.deleteRecord(id);
+        cars.deleteRecord(id, db);
     }
 
     static bool rent(int cusId, int carId, string table, sqlite3 *db = nullptr)
@@ -1216,9 +8723,57 @@ public:
         int date;
         cout << "Enter today's date (int)" << endl;
         cin >> date;
+        if (db == nullptr)
+            return GroupCommitWriter::shared().rent(cusId, carId, date, table).get();
         return Car::rent(cusId, carId, date, table, db);
     }
 
+    // Rents a whole cart at once and reports each item
+    static bool rentCart(int cusId, const vector<CartItem> &items, string table, sqlite3 *db = nullptr)
+    {
+        int date;
+        cout << "Enter today's date (int)" << endl;
+        cin >> date;
+        vector<CartResult> results;
+        bool rented = Car::rentCart(cusId, items, date, table, results, db);
+        int cars = 0;
+        for (const CartResult &result : results)
+        {
+            if (result.item.model.empty())
+                cout << "Car " << result.item.carId << ": ";
+            else
+                cout << result.item.quantity << " x " << result.item.model << ": ";
+            if (!result.error.empty())
+            {
+                cout << "FAILED, " << result.error << endl;
+                continue;
+            }
+            cout << (rented ? "cars" : "OK, cars");
+            for (int carId : result.claimed)
+            {
+                cout << " " << carId;
+            }
+            cars += result.claimed.size();
+            cout << endl;
+        }
+        if (rented)
+            cout << "Rented " << cars << " cars successfully." << endl;
+        else
+            cout << "Nothing was rented." << endl;
+        return rented;
+    }
+
+    // Rents the car reserved by a checkout hold
+    static bool rentHeld(uint64_t token, sqlite3 *db = nullptr)
+    {
+        int date;
+        cout << "Enter today's date (int)" << endl;
+        cin >> date;
+        if (db == nullptr)
+            return GroupCommitWriter::shared().rentHeld(token, date).get();
+        return HoldManager::checkout().convert(token, date, db);
+    }
+
     static vector<int> checkRents(int cusId, string table, sqlite3 *db = nullptr)
     {
         return Car::checkRents(cusId, table, db);
@@ -1237,51 +8792,162 @@ public:
             cout << "Invalid condition. Please enter a value between 0 and 100." << endl;
             return false;
         }
+        if (db == nullptr)
+            return GroupCommitWriter::shared().returnCar(cusId, carId, date, condition, table).get();
         return Car::returnCar(cusId, carId, date, condition, table, RENT_DAYS_ALLOWED, RENT_PER_DAY, EMPLOYEE_DISCOUNT, db);
     }
 
-    static void updateDues(int cusId, int money, int dues, string table)
+    static bool updateDues(int cusId, int money, int dues, string table)
     {
-        Db::updateDues(cusId, money, dues, table);
-        return;
+        return GroupCommitWriter::shared().updateDues(cusId, money, dues, table).get();
     }
 
-    void displayAvailableCars()
+    void displayAvailableCars(sqlite3 *db = nullptr)
     {
         // Code to display all cars
-        cars.display();
+        if (db != nullptr)
+        {
+            cars.display(db);
+            return;
+        }
+        ReadSnapshot snapshot;
+        if (snapshot.handle() != nullptr)
+            cars.display(snapshot.handle());
     }
 
-    void displayAllCars()
+    void displayAllCars(sqlite3 *db = nullptr)
     {
         // Code to display all cars
-        cars.displayAll();
+        if (db != nullptr)
+        {
+            cars.displayAll(db);
+            return;
+        }
+        ReadSnapshot snapshot;
+        if (snapshot.handle() != nullptr)
+            cars.displayAll(snapshot.handle());
     }
 
     void displayDetails() const override
     {
-        User::displayDetails();
-        cout << "Role: Manager" << endl;
+        User::displayDetails("Manager", {}, {}, "");
+    }
+
+    void searchCars()
+    {
+        CarQuery query;
+        cout << "Enter part of the model name (or * for any model): ";
+        cin >> query.model;
+        if (query.model == "*")
+            query.model = "";
+        cout << "Enter the range of years (from to): ";
+        cin >> query.minYear >> query.maxYear;
+        cout << "Enter the minimum condition (0-100%): ";
+        cin >> query.minCondition;
+        query.availableOnly = askConfirmation("Only show available cars?");
+
+        vector<int> found = CarDb::searchCars(query);
+        if (found.empty())
+        {
+            cout << "No cars match the search." << endl;
+            return;
+        }
+        cout << found.size() << " cars match the search:" << endl;
+        const size_t shown = 20;
+        vector<int> page(found.begin(), found.begin() + min(shown, found.size()));
+        vector<string> values;
+        unique_ptr<RowSink> sink = Renderer::open();
+        sink->begin(CarDb::carListing());
+        for (const optional<CarRow> &car : CarDb::searchCars(page))
+        {
+            if (!car)
+                continue;
+            Renderer::values(*car, values);
+            sink->row(values);
+        }
+        sink->end();
+        if (found.size() > shown)
+            cout << "... and " << found.size() - shown << " more." << endl;
+    }
+
+    void displayAllCustomers(sqlite3 *db = nullptr)
+    {
+        if (db != nullptr)
+        {
+            CustomerDb::display(db);
+            return;
+        }
+        ReadSnapshot snapshot;
+        if (snapshot.handle() != nullptr)
+            CustomerDb::display(snapshot.handle());
+    }
+
+    void displayAllEmployees(sqlite3 *db = nullptr)
+    {
+        if (db != nullptr)
+        {
+            EmployeeDb::display(db);
+            return;
+        }
+        ReadSnapshot snapshot;
+        if (snapshot.handle() != nullptr)
+            EmployeeDb::display(snapshot.handle());
     }
 
-    void displayAllCustomers()
+    void displayReport()
     {
-        CustomerDb::display();
+        // Cars, customers and employees all come from the same snapshot
+        ReadSnapshot snapshot;
+        if (snapshot.handle() == nullptr)
+            return;
+        CarDb::displayAll(snapshot.handle());
+        cout << endl;
+        CustomerDb::display(snapshot.handle());
+        cout << endl;
+        EmployeeDb::display(snapshot.handle());
     }
 
-    void displayAllEmployees()
+    // Fleet and account totals from the counter tables, without scanning any table
+    void displayDashboard()
     {
-        EmployeeDb::display();
+        ReadSnapshot snapshot;
+        if (snapshot.handle() == nullptr)
+            return;
+        int total = 0;
+        int available = 0;
+        cout << "Model\tCars\tAvailable\tRented" << endl;
+        for (const Aggregates::ModelCount &count : Aggregates::models(snapshot.handle()))
+        {
+            cout << count.model << "\t" << count.total << "\t" << count.available << "\t\t" << count.total - count.available << endl;
+            total += count.total;
+            available += count.available;
+        }
+        cout << "Fleet: " << total << " cars, " << available << " available, " << total - available << " rented" << endl;
+
+        for (const char *table : {"customers", "employees"})
+        {
+            int accounts = 0;
+            long long fines = 0;
+            cout << endl;
+            cout << "Record\t" << table << "\tAt or below\tFines due" << endl;
+            for (const Aggregates::RecordBucket &bucket : Aggregates::records(table, snapshot.handle()))
+            {
+                accounts += bucket.accounts;
+                fines += bucket.fineDue;
+                cout << bucket.record << "\t" << bucket.accounts << "\t\t" << accounts << "\t\t$" << bucket.fineDue << endl;
+            }
+            cout << "Total: " << accounts << " " << table << ", $" << fines << " of fines due" << endl;
+        }
     }
 
-    void displayCustomer(int id)
+    void displayCustomer(int id, sqlite3 *db = nullptr)
     {
-        CustomerDb::displayCustomer(id);
+        CustomerDb::displayCustomer(id, db);
     }
 
-    void displayEmployee(int id)
+    void displayEmployee(int id, sqlite3 *db = nullptr)
     {
-        EmployeeDb::displayEmployee(id);
+        EmployeeDb::displayEmployee(id, db);
     }
 };
 
@@ -1297,11 +8963,13 @@ protected:
     }
 
 public:
-    void rentCar()
+    // shard is the database of the branch the session works in; branches
+    // have no checkout holds, so their cars are rented right after confirming
+    void rentCar(sqlite3 *shard = nullptr)
     {
         // Code to rent a car
-        sqlite3 *db;
-        if (!Db::connectToDatabase(&db))
+        sqlite3 *db = shard;
+        if (shard == nullptr && !Db::connectToDatabase(&db))
             return;
 
         CarDb::display(db);
@@ -1310,30 +8978,99 @@ public:
         cout << "Enter the ID of the car you want to rent: ";
         cin >> carId;
 
-        // Validate user input
-        bool foundCar = CarDb::searchRentableCar(carId, db);
+        // Validate user input
+        bool foundCar = CarDb::searchRentableCar(carId, db);
+
+        if (!foundCar)
+        {
+            cout << "Invalid car ID. Please choose from the list above." << endl;
+            if (shard == nullptr)
+                sqlite3_close(db);
+            return;
+        }
+
+        if (shard != nullptr)
+        {
+            if (askConfirmation("Do you want to rent this car?"))
+                Manager::rent(id, carId, table, shard);
+            return;
+        }
 
-        if (!foundCar)
+        // Reserve the car while the renter confirms
+        uint64_t hold = HoldManager::checkout().place(carId, id, table, db);
+        if (hold == 0)
         {
-            cout << "Invalid car ID. Please choose from the list above." << endl;
+            cout << "This car is on hold for another renter. Please choose another car." << endl;
             sqlite3_close(db);
             return;
         }
+        cout << "The car is held for you for " << HOLD_SECONDS << " seconds." << endl;
 
         // Ask for confirmation and rent car
         if (askConfirmation("Do you want to rent this car?"))
         {
-            Manager::rent(id, carId, table, db);
+            Manager::rentHeld(hold);
+        }
+        else
+        {
+            HoldManager::checkout().release(hold, db);
         }
 
         sqlite3_close(db);
     }
 
-    void returnCar()
+    void rentCart(sqlite3 *shard = nullptr)
+    {
+        // Code to rent several cars at once
+        vector<CartItem> items;
+        string line;
+        getline(cin, line); // Rest of the command line
+        cout << "Enter one cart item per line: a car ID, or a quantity and a model (e.g. 2 Ferrari F8)." << endl;
+        cout << "Enter 'done' or an empty line to finish." << endl;
+        while (getline(cin, line))
+        {
+            line.erase(0, line.find_first_not_of(" \t"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line == "done")
+                break;
+            CartItem item;
+            size_t space = line.find(' ');
+            string number = line.substr(0, space);
+            bool valid = number.size() <= 9 && number.find_first_not_of("0123456789") == string::npos;
+            if (valid && space == string::npos)
+            {
+                item.carId = stoi(number);
+            }
+            else if (valid)
+            {
+                item.quantity = stoi(number);
+                item.model = line.substr(line.find_first_not_of(' ', space));
+            }
+            if (!valid || item.quantity <= 0)
+            {
+                cout << "Invalid cart item: " << line << endl;
+                continue;
+            }
+            items.push_back(item);
+        }
+        if (items.empty())
+        {
+            cout << "Your cart is empty." << endl;
+            return;
+        }
+
+        // Ask for confirmation once for the whole cart
+        if (askConfirmation("Do you want to rent the " + to_string(items.size()) + " items in your cart?"))
+        {
+            Manager::rentCart(id, items, table, shard);
+        }
+    }
+
+    void returnCar(sqlite3 *shard = nullptr)
     {
         // Code to return a car
-        sqlite3 *db;
-        if (!Db::connectToDatabase(&db))
+        sqlite3 *db = shard;
+        if (shard == nullptr && !Db::connectToDatabase(&db))
             return;
 
         // Check and display rented cars
@@ -1341,6 +9078,8 @@ public:
         if (rentedCars.size() == 0)
         {
             cout << "You haven't rented any cars." << endl;
+            if (shard == nullptr)
+                sqlite3_close(db);
             return;
         }
 
@@ -1363,17 +9102,46 @@ public:
         if (!foundCar)
         {
             cout << "Invalid car ID. Please choose from the list above." << endl;
-            sqlite3_close(db);
+            if (shard == nullptr)
+                sqlite3_close(db);
             return;
         }
 
         // Ask for confirmation and return car
         if (askConfirmation("Do you want to return this car?"))
         {
-            Manager::returnCar(id, chosenId, table, db);
+            Manager::returnCar(id, chosenId, table, shard);
         }
 
-        sqlite3_close(db);
+        if (shard == nullptr)
+            sqlite3_close(db);
+    }
+
+    void quoteReturn()
+    {
+        // Code to price a return without making it
+        vector<int> rentedCars = Manager::checkRents(id, table);
+        if (rentedCars.size() == 0)
+        {
+            cout << "You haven't rented any cars." << endl;
+            return;
+        }
+
+        QuoteEngine::Request request;
+        request.table = table;
+        request.renter = id;
+        cout << "Enter the ID of the car you want a quote for: ";
+        cin >> request.carId;
+        if (find(rentedCars.begin(), rentedCars.end(), request.carId) == rentedCars.end())
+        {
+            cout << "Invalid car ID. Please choose from the list above." << endl;
+            return;
+        }
+        cout << "Enter the return date (int): ";
+        cin >> request.date;
+        cout << "Enter the condition (0-100%) on return: ";
+        cin >> request.condition;
+        QuoteEngine::print(QuoteEngine::quote(request));
     }
 
     void browseRentedCars()
@@ -1389,52 +9157,46 @@ class Customer : public RentableUser
 public:
     Customer(int id) : RentableUser(id, "customers")
     {
-        vector<string> cus = CustomerDb::searchCus(id);
-        name = cus[1];
+        ArenaRow cus = CustomerDb::searchCus(id);
+        name = string(cus[1]);
     }
 
     void clear_dues()
     {
-        vector<string> cus = CustomerDb::searchCus(id);
-
-        int money = stoi(cus[2]);
-        int dues = stoi(cus[4]);
+        SettlementResult result;
+        if (!DuesSettlement::settleAccount("customers", id, result))
+            return;
 
-        if (dues == 0)
+        if (result.paid == 0 && result.dues == 0)
         {
             cout << "You don't have any outstanding dues." << endl;
             return;
         }
 
-        if (money >= dues)
+        if (result.dues == 0)
         {
-            money -= dues;
-            dues = 0;
             cout << "Dues cleared successfully." << endl;
         }
         else
         {
             cout << "ALERT!!! You don't have enough money to clear your dues." << endl;
             cout << "Please add money to your account." << endl;
-            cout << "Cleared " << money << " of your dues. " << dues - money << " is still pending." << endl;
-            dues -= money;
-            money = 0;
+            cout << "Cleared " << result.paid << " of your dues. " << result.dues << " is still pending." << endl;
         }
-        Manager::updateDues(id, money, dues, "customers");
         return;
     }
 
     void displayDetails() const override
     {
-        vector<string> cus = CustomerDb::searchCus(id);
-        if (cus.size() == 0)
+        ArenaRow cus(RequestArena::resource());
+        if (!Db::searchRow("customers", id, cus))
         {
             cout << "Invalid Customer ID" << endl;
             exit(1);
         }
-        User::displayDetails();
-        cout << "Role: Customer" << endl;
-        cout << "Money: " << cus[2] << " Rented Cars: " << cus[3] << ", Fine Due: " << cus[4] << ", Customer Record: " << cus[5] << endl;
+        string text = "Money: " + string(cus[2]) + " Rented Cars: " + string(cus[3]) + ", Fine Due: " + string(cus[4]) + ", Customer Record: " + string(cus[5]) + "\n";
+        User::displayDetails("Customer", {{"money", true}, {"rentedCars", true}, {"fineDue", true}, {"record", true}},
+                             {string(cus[2]), string(cus[3]), string(cus[4]), string(cus[5])}, text);
     }
 };
 
@@ -1446,64 +9208,121 @@ public:
 
     void clear_dues()
     {
-        vector<string> emp = EmployeeDb::searchEmp(id);
-
-        int money = stoi(emp[2]);
-        int dues = stoi(emp[4]);
+        SettlementResult result;
+        if (!DuesSettlement::settleAccount("employees", id, result))
+            return;
 
-        if (dues == 0)
+        if (result.paid == 0 && result.dues == 0)
         {
             cout << "You don't have any outstanding dues." << endl;
             return;
         }
 
-        if (money >= dues)
+        if (result.dues == 0)
         {
-            money -= dues;
-            dues = 0;
             cout << "Dues cleared successfully." << endl;
         }
         else
         {
             cout << "ALERT!!! You don't have enough money to clear your dues." << endl;
             cout << "Please add money to your account." << endl;
-            cout << "Cleared " << money << " of your dues. " + dues - money << " is still pending." << endl;
-            dues -= money;
-            money = 0;
+            cout << "Cleared " << result.paid << " of your dues. " << result.dues << " is still pending." << endl;
         }
-        Manager::updateDues(id, money, dues, "employees");
         return;
     }
 
     void displayDetails() const override
     {
-        vector<string> emp = EmployeeDb::searchEmp(id);
-        if (emp.size() == 0)
+        ArenaRow emp(RequestArena::resource());
+        if (!Db::searchRow("employees", id, emp))
         {
             cout << "Invalid Employee ID" << endl;
             exit(1);
         }
-        User::displayDetails();
-        cout << "Role: Employee" << endl;
-        cout << "Money: " << emp[2] << ", Rented Cars: " << emp[3] << ", Fine Due: " << emp[4] << ", Employee Record: " << emp[5] << endl;
+        string text = "Money: " + string(emp[2]) + ", Rented Cars: " + string(emp[3]) + ", Fine Due: " + string(emp[4]) + ", Employee Record: " + string(emp[5]) + "\n";
+        User::displayDetails("Employee", {{"money", true}, {"rentedCars", true}, {"fineDue", true}, {"record", true}},
+                             {string(emp[2]), string(emp[3]), string(emp[4]), string(emp[5])}, text);
     }
 };
 
-int main()
+int main(int argc, char *argv[])
 {
+    RequestArena::configureSqlite();
+    if (argc > 1 && string(argv[1]) == "--generate")
+    {
+        DatasetGenerator::Options options;
+        if (!DatasetGenerator::parse(argc, argv, options))
+        {
+            cout << "Usage: " << argv[0] << " --generate [--out file] [--cars N] [--customers N] [--employees N] [--seed N]"
+                 << " [--skew X] [--rented X] [--overdue X] [--today N] [--area X] [--threads N] [--force]" << endl;
+            return 1;
+        }
+        return DatasetGenerator::generate(options) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "--replay")
+    {
+        TraceReplay::Options options;
+        if (!TraceReplay::parse(argc, argv, options))
+        {
+            cout << "Usage: " << argv[0] << " --replay trace... [--db file] [--speed N|max] [--parallel N] [--password text]" << endl;
+            return 1;
+        }
+        return TraceReplay::run(options) ? 0 : 1;
+    }
+    string trace;
+    string logFile;
+    for (int i = 1; i < argc; i += 2)
+    {
+        string name = argv[i];
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << name << endl;
+            cout << "Usage: " << argv[0] << " [--db file] [--record trace] [--log file] [--format table|json|csv]" << endl;
+            return 1;
+        }
+        if (name == "--db")
+        {
+            Db::setDatabaseFile(argv[i + 1]);
+        }
+        else if (name == "--log")
+        {
+            logFile = argv[i + 1];
+        }
+        else if (name == "--record")
+        {
+            trace = argv[i + 1];
+        }
+        else if (name != "--format" || !Renderer::parseFormat(argv[i + 1], Renderer::format))
+        {
+            cout << "Usage: " << argv[0] << " [--db file] [--record trace] [--log file] [--format table|json|csv]" << endl;
+            return 1;
+        }
+    }
+    Log::setFile(logFile.empty() ? Db::getDatabaseFile() + ".log" : logFile);
+    if (!trace.empty() && !SessionTrace::start(trace))
+        return 1;
 
     sqlite3 *db;
     Db::connectToDatabase(&db);
 
     Manager manager("John Doe", 1, "123");
+    auto start = chrono::steady_clock::now();
+    ShardRouter shards;
+    OnlineBackup backups;
+    History::Pruner pruner;
+    ConsistencyAuditor auditor;
+    StartupProfile::record("branches", start);
+    StartupProfile::print();
+    SessionTrace::checkpoint(); // Startup output is not part of the session
 
     cout << "Enter your role (1/2/3): 1. Manager, 2. Customer, 3. Employee" << endl;
     int role;
     cin >> role;
-    vector<string> cus;
+    ArenaRow cus; // Read before any command, so on the heap
 
     int id;
     string command;
+    string branch; // Branch whose database file the session works in; empty for the main database
 
     if (role == 1)
     {
@@ -1521,8 +9340,16 @@ int main()
             cout << endl;
             cout << endl;
 
+            SessionTrace::checkpoint();
             cout << "Enter a command: (Type 'help' for commands list)" << endl;
-            cin >> command;
+            if (!(cin >> command))
+                break; // Input ended
+            RequestArena::Scope request; // Scratch memory for this command
+            Log::Context context(command.c_str());
+            // Rows of the branch the session works in are in the branch's own file
+            ShardRouter::Connection shard(shards, command == "useBranch" ? "" : branch);
+            if (shard.failed())
+                continue;
             cout << endl;
             cout << endl;
 
@@ -1546,21 +9373,21 @@ int main()
                 cin >> record;
 
                 vector<string> cus = {name, to_string(money), "0", to_string(dues), to_string(record)};
-                manager.addCustomer(cus);
+                manager.addCustomer(cus, shard.handle());
             }
             else if (command == "updateCustomer")
             {
                 int newId;
-                manager.displayAllCustomers();
+                manager.displayAllCustomers(shard.handle());
                 cout << "Enter the ID of the customer you want to update: ";
                 cin >> newId;
-                vector<string> cus = CustomerDb::searchCus(newId);
+                ArenaRow cus = CustomerDb::searchCus(newId, shard.handle());
                 if (cus.size() == 0)
                 {
                     cout << "Invalid Customer ID" << endl;
                     exit(1);
                 }
-                CustomerDb::displayCustomer(newId);
+                CustomerDb::displayCustomer(newId, shard.handle());
 
                 cout << "Enter new customer name (Previously: " << cus[1] << "): ";
                 cin >> cus[1];
@@ -1577,14 +9404,14 @@ int main()
                 cout << "Enter new customer record (Previously: " << cus[5] << "): ";
                 cin >> cus[5];
 
-                manager.updateCustomer(newId, cus);
+                manager.updateCustomer(newId, cus, shard.handle());
             }
             else if (command == "deleteCustomer")
             {
                 int newId;
                 cout << "Enter the ID of the customer you want to delete: ";
                 cin >> newId;
-                manager.deleteCustomer(newId);
+                manager.deleteCustomer(newId, shard.handle());
             }
             else if (command == "addEmployee")
             {
@@ -1606,21 +9433,21 @@ int main()
                 cin >> record;
 
                 vector<string> cus = {name, to_string(money), "0", to_string(dues), to_string(record)};
-                manager.addEmployee(cus);
+                manager.addEmployee(cus, shard.handle());
             }
             else if (command == "updateEmployee")
             {
                 int newId;
-                manager.displayAllEmployees();
+                manager.displayAllEmployees(shard.handle());
                 cout << "Enter the ID of the employee you want to update: ";
                 cin >> newId;
-                vector<string> cus = EmployeeDb::searchEmp(newId);
+                ArenaRow cus = EmployeeDb::searchEmp(newId, shard.handle());
                 if (cus.size() == 0)
                 {
                     cout << "Invalid Employee ID" << endl;
                     exit(1);
                 }
-                EmployeeDb::displayEmployee(newId);
+                EmployeeDb::displayEmployee(newId, shard.handle());
 
                 cout << "Enter new employee name (Previously: " << cus[1] << "): ";
                 cin >> cus[1];
@@ -1637,14 +9464,14 @@ int main()
                 cout << "Enter new employee record (Previously: " << cus[5] << "): ";
                 cin >> cus[5];
 
-                manager.updateEmployee(newId, cus);
+                manager.updateEmployee(newId, cus, shard.handle());
             }
             else if (command == "deleteEmployee")
             {
                 int newId;
                 cout << "Enter the ID of the employee you want to delete: ";
                 cin >> newId;
-                manager.deleteEmployee(newId);
+                manager.deleteEmployee(newId, shard.handle());
             }
             else if (command == "addCar")
             {
@@ -1670,21 +9497,21 @@ int main()
                 }
 
                 vector<string> car = {model, year, "1", "0", "0", to_string(condition)};
-                manager.addCar(car);
+                manager.addCar(car, shard.handle());
             }
             else if (command == "updateCar")
             {
                 int newId;
-                manager.displayAllCars();
+                manager.displayAllCars(shard.handle());
                 cout << "Enter the ID of the car you want to update: ";
                 cin >> newId;
-                vector<string> car = CarDb::searchCar(newId);
+                ArenaRow car = CarDb::searchCar(newId, shard.handle());
                 if (car.size() == 0)
                 {
                     cout << "Invalid Car ID" << endl;
                     exit(1);
                 }
-                CarDb::displayCar(newId);
+                CarDb::displayCar(newId, shard.handle());
 
                 string company;
 
@@ -1692,7 +9519,7 @@ int main()
                 cin >> company;
                 cout << "Enter new car model (Previously: " << car[1] << "): ";
                 cin >> car[1];
-                car[1] = company + " " + car[1];
+                car[1].insert(0, company + " ");
                 cout << "Enter new car year (Previously: " << car[2] << "): ";
                 cin >> car[2];
                 cout << "Enter new car available (Previously: " << car[3] << "): ";
@@ -1704,49 +9531,547 @@ int main()
                 cout << "Enter new car condition (Previously: " << car[6] << "): ";
                 cin >> car[6];
 
-                if (stoi(car[6]) < 0 || stoi(car[6]) > 100)
+                if (atoi(car[6].c_str()) < 0 || atoi(car[6].c_str()) > 100)
                 {
                     cout << "Invalid condition" << endl;
                     exit(1);
                 }
-                manager.updateCar(newId, car);
+                manager.updateCar(newId, car, shard.handle());
             }
             else if (command == "deleteCar")
             {
                 int newId;
                 cout << "Enter the ID of the car you want to delete: ";
                 cin >> newId;
-                manager.deleteCar(newId);
+                manager.deleteCar(newId, shard.handle());
             }
             else if (command == "displayAvailableCars")
             {
-                manager.displayAvailableCars();
+                manager.displayAvailableCars(shard.handle());
             }
             else if (command == "displayAllCars")
             {
-                manager.displayAllCars();
+                manager.displayAllCars(shard.handle());
             }
             else if (command == "displayAllCustomers")
             {
-                manager.displayAllCustomers();
+                manager.displayAllCustomers(shard.handle());
             }
             else if (command == "displayAllEmployees")
             {
-                manager.displayAllEmployees();
+                manager.displayAllEmployees(shard.handle());
             }
             else if (command == "displayCustomer")
             {
                 int newId;
                 cout << "Enter the ID of the customer you want to display: ";
                 cin >> newId;
-                manager.displayCustomer(newId);
+                manager.displayCustomer(newId, shard.handle());
             }
             else if (command == "displayEmployee")
             {
                 int newId;
                 cout << "Enter the ID of the employee you want to display: ";
                 cin >> newId;
-                manager.displayEmployee(newId);
+                manager.displayEmployee(newId, shard.handle());
+            }
+            else if (command == "report")
+            {
+                manager.displayReport();
+            }
+            else if (command == "simulate")
+            {
+                int operations;
+                int fleetSize;
+                cout << "Enter the number of rent/return operations to simulate: ";
+                cin >> operations;
+                cout << "Enter the fleet size: ";
+                cin >> fleetSize;
+                if (operations <= 0 || fleetSize <= 0)
+                {
+                    cout << "Invalid simulation size." << endl;
+                }
+                else
+                {
+                    FleetSimulation::compareEngines(operations, fleetSize);
+                    FleetSimulation::checkScript();
+                }
+            }
+            else if (command == "backup")
+            {
+                string file;
+                cout << "Enter the file to back up to: ";
+                cin >> file;
+                if (OnlineBackup::isDatabase(file))
+                {
+                    cout << "Cannot back up the database onto itself." << endl;
+                }
+                else if (backups.start(file))
+                {
+                    cout << "Backup started. Use backupStatus to check its progress." << endl;
+                }
+                else
+                {
+                    cout << "A backup is already running." << endl;
+                }
+            }
+            else if (command == "scheduleBackup")
+            {
+                string file;
+                int interval;
+                cout << "Enter the file to back up to: ";
+                cin >> file;
+                cout << "Enter the interval between backups (seconds): ";
+                cin >> interval;
+                if (OnlineBackup::isDatabase(file) || interval <= 0)
+                {
+                    cout << "Invalid backup schedule." << endl;
+                }
+                else if (backups.schedule(file, interval))
+                {
+                    cout << "Backups to " << file << " scheduled every " << interval << " seconds." << endl;
+                }
+                else
+                {
+                    cout << "A backup schedule is already set." << endl;
+                }
+            }
+            else if (command == "backupStatus")
+            {
+                cout << backups.progress() << endl;
+            }
+            else if (command == "log")
+            {
+                Log::report();
+                if (askConfirmation("Change the log level?"))
+                {
+                    string name;
+                    int level;
+                    cout << "Enter the lowest level to log (DEBUG, INFO, WARNING or ERROR): ";
+                    cin >> name;
+                    if (!Log::parseLevel(name, level))
+                    {
+                        cout << "Invalid level." << endl;
+                    }
+                    else
+                    {
+                        Log::minLevel = level;
+                    }
+                }
+            }
+            else if (command == "contention")
+            {
+                Contention::report();
+                if (askConfirmation("Change the settings?"))
+                {
+                    int timeout;
+                    int attempts;
+                    int backoff;
+                    cout << "Enter the busy timeout (ms): ";
+                    cin >> timeout;
+                    cout << "Enter the number of attempts per operation: ";
+                    cin >> attempts;
+                    cout << "Enter the first backoff (ms): ";
+                    cin >> backoff;
+                    if (timeout < 0 || attempts <= 0 || backoff < 0)
+                    {
+                        cout << "Invalid settings." << endl;
+                    }
+                    else
+                    {
+                        Contention::busyTimeoutMs = timeout;
+                        Contention::maxAttempts = attempts;
+                        Contention::backoffMs = backoff;
+                    }
+                }
+            }
+#ifdef __unix__
+            else if (command == "benchContention")
+            {
+                int processes;
+                int operations;
+                cout << "Enter the number of processes: ";
+                cin >> processes;
+                cout << "Enter the number of rentals per process (each followed by a return): ";
+                cin >> operations;
+                if (processes <= 0 || operations <= 0)
+                {
+                    cout << "Invalid benchmark size." << endl;
+                }
+                else
+                {
+                    ContentionBenchmark::run(processes, operations);
+                }
+            }
+            else if (command == "benchSnapshot")
+            {
+                int reports;
+                cout << "Enter the number of reports: ";
+                cin >> reports;
+                if (reports <= 0)
+                {
+                    cout << "Invalid benchmark size." << endl;
+                }
+                else if (!SnapshotBenchmark::run(reports))
+                {
+                    cout << "Snapshot reports were inconsistent." << endl;
+                }
+            }
+#endif
+            else if (command == "benchHolds")
+            {
+                int holds;
+                int threads;
+                cout << "Enter the number of cars to hold: ";
+                cin >> holds;
+                cout << "Enter the number of competing renters: ";
+                cin >> threads;
+                if (holds <= 0 || threads <= 0)
+                {
+                    cout << "Invalid benchmark size." << endl;
+                }
+                else
+                {
+                    HoldManager::benchmark(holds, threads);
+                }
+            }
+            else if (command == "benchGroupCommit")
+            {
+                int clients;
+                int operations;
+                cout << "Enter the number of concurrent callers: ";
+                cin >> clients;
+                cout << "Enter the number of mutations per caller: ";
+                cin >> operations;
+                if (clients <= 0 || operations <= 0)
+                {
+                    cout << "Invalid benchmark size." << endl;
+                }
+                else
+                {
+                    GroupCommitWriter::benchmark(clients, operations);
+                }
+            }
+            else if (command == "dashboard")
+            {
+                manager.displayDashboard();
+            }
+            else if (command == "verifyAggregates")
+            {
+                if (!Aggregates::verify(false) && askConfirmation("Rebuild the aggregates that differ?"))
+                {
+                    Aggregates::verify(true);
+                }
+            }
+            else if (command == "asOf")
+            {
+                string table;
+                int recordId;
+                int day;
+                cout << "Enter the table (cars/customers/employees): ";
+                cin >> table;
+                cout << "Enter the ID: ";
+                cin >> recordId;
+                cout << "Enter the day (int): ";
+                cin >> day;
+                CarRow car;
+                AccountRow account;
+                if (table == "cars")
+                {
+                    if (History::carAsOf(recordId, day, car))
+                        CarDb::displayCar(car);
+                    else
+                        cout << "No version of car " << recordId << " for day " << day << " (it did not exist or was pruned)." << endl;
+                }
+                else if (table == "customers" || table == "employees")
+                {
+                    if (History::accountAsOf(table, recordId, day, account))
+                    {
+                        cout << "Name: " << account.name << ", ID: " << account.id << endl;
+                        cout << "Money: " << account.money << " Rented Cars: " << account.rentedCars << endl;
+                        cout << "Fine Due: " << account.fineDue << ", Record: " << account.record << endl;
+                    }
+                    else
+                    {
+                        cout << "No version of " << table.substr(0, table.size() - 1) << " " << recordId << " for day " << day << " (it did not exist or was pruned)." << endl;
+                    }
+                }
+                else
+                {
+                    cout << "Invalid table." << endl;
+                }
+            }
+            else if (command == "audit")
+            {
+                auditor.report();
+                if (askConfirmation("Audit every row now?"))
+                {
+                    vector<ConsistencyAuditor::Finding> findings = auditor.auditAll();
+                    for (const ConsistencyAuditor::Finding &finding : findings)
+                    {
+                        ConsistencyAuditor::print(finding);
+                    }
+                    cout << findings.size() << " anomalies found." << endl;
+                }
+                if (askConfirmation("Change the audit settings?"))
+                {
+                    int rate;
+                    int slice;
+                    cout << "Enter the rows to check per second in the background: ";
+                    cin >> rate;
+                    cout << "Enter the rows per slice: ";
+                    cin >> slice;
+                    if (rate <= 0 || slice <= 0)
+                    {
+                        cout << "Invalid settings." << endl;
+                    }
+                    else
+                    {
+                        ConsistencyAuditor::rowsPerSecond = rate;
+                        ConsistencyAuditor::sliceRows = slice;
+                        ConsistencyAuditor::repair = askConfirmation("Repair anomalies?");
+                    }
+                }
+            }
+            else if (command == "history")
+            {
+                sqlite3 *historyDb;
+                if (Db::connectToDatabase(&historyDb))
+                {
+                    History::report(historyDb);
+                    if (askConfirmation("Change the retention and prune now?"))
+                    {
+                        int days;
+                        cout << "Enter the number of days to keep ended versions: ";
+                        cin >> days;
+                        if (days < 0)
+                        {
+                            cout << "Invalid number of days." << endl;
+                        }
+                        else
+                        {
+                            History::retentionDays = days;
+                            cout << "Pruned " << History::prune(days, historyDb) << " versions." << endl;
+                        }
+                    }
+                    sqlite3_close(historyDb);
+                }
+            }
+            else if (command == "quote")
+            {
+                QuoteEngine::Request request;
+                cout << "Enter the renter's table (customers/employees): ";
+                cin >> request.table;
+                cout << "Enter the renter's ID: ";
+                cin >> request.renter;
+                cout << "Enter the car ID: ";
+                cin >> request.carId;
+                cout << "Enter the return date (int): ";
+                cin >> request.date;
+                cout << "Enter the condition (0-100%) on return: ";
+                cin >> request.condition;
+                if (request.table != "customers" && request.table != "employees")
+                {
+                    cout << "Invalid table." << endl;
+                }
+                else
+                {
+                    QuoteEngine::print(QuoteEngine::quote(request));
+                }
+            }
+            else if (command == "quoteBatch")
+            {
+                string path;
+                getline(cin, path);
+                if (path.find_first_not_of(" \t") == string::npos)
+                {
+                    cout << "Enter the file of returns to quote (or - to type them in): ";
+                    getline(cin, path);
+                }
+                path.erase(0, path.find_first_not_of(" \t"));
+                path.erase(path.find_last_not_of(" \t\r") + 1);
+                QuoteEngine::run(path);
+            }
+            else if (command == "benchQuotes")
+            {
+                int count;
+                cout << "Enter the number of quotes: ";
+                cin >> count;
+                if (count <= 0)
+                {
+                    cout << "Invalid number of quotes." << endl;
+                }
+                else
+                {
+                    QuoteEngine::benchmark(count);
+                }
+            }
+            else if (command == "bulkReturn")
+            {
+                string path;
+                getline(cin, path);
+                if (path.find_first_not_of(" \t") == string::npos)
+                {
+                    cout << "Enter the file of returns (or - to type them in): ";
+                    getline(cin, path);
+                }
+                path.erase(0, path.find_first_not_of(" \t"));
+                path.erase(path.find_last_not_of(" \t\r") + 1);
+                BulkReturn::run(path);
+            }
+            else if (command == "settleDues")
+            {
+                string table;
+                SettlementFilter filter;
+                cout << "Enter the accounts to settle (customers/employees): ";
+                cin >> table;
+                cout << "Enter the minimum dues of accounts to settle: ";
+                cin >> filter.minDues;
+                cout << "Enter the first and last ID to settle: ";
+                cin >> filter.fromId >> filter.toId;
+                if (table != "customers" && table != "employees")
+                {
+                    cout << "Invalid accounts." << endl;
+                }
+                else
+                {
+                    vector<SettlementResult> results = DuesSettlement::settle(table, filter);
+                    long long paid = 0;
+                    long long pending = 0;
+                    for (const SettlementResult &result : results)
+                    {
+                        cout << "ID " << result.id << ": Paid $" << result.paid << ", Money left: $" << result.money << ", Dues pending: $" << result.dues << endl;
+                        paid += result.paid;
+                        pending += result.dues;
+                    }
+                    cout << "Settled " << results.size() << " accounts. Total paid: $" << paid << ", Total still pending: $" << pending << endl;
+                }
+            }
+            else if (command == "searchCars")
+            {
+                manager.searchCars();
+            }
+            else if (command == "nearest")
+            {
+                string line;
+                getline(cin, line);
+                CarDb::runNearest(line);
+            }
+            else if (command == "moveCar")
+            {
+                int carId;
+                double x, y;
+                cout << "Enter the ID of the car to move: ";
+                cin >> carId;
+                cout << "Enter its new location (x y): ";
+                cin >> x >> y;
+                if (CarDb::move(carId, x, y))
+                    cout << "Car " << carId << " moved to (" << x << ", " << y << ")." << endl;
+                else
+                    cout << "Invalid Car ID" << endl;
+            }
+            else if (command == "verifyNearest")
+            {
+                CarDb::verifyNearest();
+            }
+            else if (command == "benchNearest")
+            {
+                int count;
+                cout << "Enter the number of cars: ";
+                cin >> count;
+                if (count <= 0)
+                {
+                    cout << "Invalid number of cars." << endl;
+                }
+                else
+                {
+                    CarColumns::benchmarkNearest(count);
+                }
+            }
+            else if (command == "benchSearchCars")
+            {
+                int count;
+                cout << "Enter the number of cars to search over: ";
+                cin >> count;
+                if (count <= 0)
+                {
+                    cout << "Invalid number of cars." << endl;
+                }
+                else
+                {
+                    CarColumns::benchmark(count);
+                }
+            }
+#ifdef __unix__
+            else if (command == "benchListing")
+            {
+                CarDb::benchmarkListing();
+            }
+#endif
+            else if (command == "benchMultiGet")
+            {
+                int count;
+                cout << "Enter the number of car ids to look up: ";
+                cin >> count;
+                if (count <= 0)
+                {
+                    cout << "Invalid number of ids." << endl;
+                }
+                else
+                {
+                    CarDb::benchmarkMultiGet(count);
+                }
+            }
+            else if (command == "addBranch")
+            {
+                string branch;
+                string file;
+                cout << "Enter branch name: ";
+                cin >> branch;
+                cout << "Enter database file for the branch: ";
+                cin >> file;
+                if (shards.addBranch(branch, file))
+                {
+                    cout << "Branch " << branch << " added with database " << file << "." << endl;
+                }
+            }
+            else if (command == "listBranches")
+            {
+                if (shards.branches().empty())
+                {
+                    cout << "No branches." << endl;
+                }
+                for (const auto &shard : shards.branches())
+                {
+                    cout << shard.first << ": " << shard.second << endl;
+                }
+            }
+            else if (command == "searchFleet")
+            {
+                string model;
+                cout << "Enter the model to search for across all branches: ";
+                cin >> model;
+                vector<vector<string>> found = shards.searchAvailable(model);
+                if (found.empty())
+                {
+                    cout << "No matching cars available in any branch." << endl;
+                }
+                for (const vector<string> &car : found)
+                {
+                    cout << car[0] << ": " << car[1] << ". " << car[2] << " (" << car[3] << "), Condition: " << car[4] << "%" << endl;
+                }
+            }
+            else if (command == "fleetDues")
+            {
+                cout << "Total dues across all branches: $" << shards.totalDues() << endl;
+            }
+            else if (command == "verifyBranches")
+            {
+                ShardRouter::verify();
+            }
+            else if (command == "useBranch")
+            {
+                shards.askBranch(branch);
             }
             else if (command == "help")
             {
@@ -1768,6 +10093,43 @@ int main()
                 cout << "displayAllEmployees: Display all employees." << endl;
                 cout << "displayCustomer: Display a customer." << endl;
                 cout << "displayEmployee: Display an employee." << endl;
+                cout << "report: Display cars, customers and employees from one consistent snapshot." << endl;
+                cout << "simulate: Simulate rentals on the in-memory and SQLite engines." << endl;
+                cout << "backup: Back up the database in the background while it stays in use." << endl;
+                cout << "scheduleBackup: Back up the database periodically." << endl;
+                cout << "backupStatus: Display the progress of the current backup." << endl;
+                cout << "benchGroupCommit: Benchmark group-commit throughput against the batch window." << endl;
+                cout << "log: Display where diagnostics are logged and change the log level." << endl;
+                cout << "contention: Display lock contention metrics and change the retry settings." << endl;
+                cout << "benchContention: Benchmark several processes writing at once, with and without busy handling." << endl;
+                cout << "benchSnapshot: Check that reports on a read snapshot stay consistent while a writer runs." << endl;
+                cout << "benchHolds: Benchmark checkout holds with competing renters." << endl;
+                cout << "dashboard: Display fleet and account totals." << endl;
+                cout << "verifyAggregates: Check the dashboard totals against the tables." << endl;
+                cout << "bulkReturn <file>: Check in many returned cars from a file of renter, car, date, condition rows." << endl;
+                cout << "asOf: Display a car, customer or employee as it was on a past day." << endl;
+                cout << "history: Display how many past versions are kept and prune them." << endl;
+                cout << "audit: Display and run the rental consistency audit." << endl;
+                cout << "quote: Price a return without making it." << endl;
+                cout << "quoteBatch <file>: Price many returns from a file in the bulkReturn format without making them." << endl;
+                cout << "benchQuotes: Benchmark return quotes over a synthetic fleet." << endl;
+                cout << "settleDues: Settle dues of all matching customers or employees at once." << endl;
+                cout << "searchCars: Search cars by model, years, condition and availability." << endl;
+                cout << "nearest <model> <x> <y> <k>: Display the k available cars of a model (or *) closest to a location." << endl;
+                cout << "moveCar: Set the location of a car." << endl;
+                cout << "benchNearest: Benchmark nearest-car lookups over a synthetic fleet." << endl;
+                cout << "verifyNearest: Check that nearest-car lookups catch moved and rented cars far from the origin." << endl;
+                cout << "benchSearchCars: Benchmark car searches over a synthetic fleet." << endl;
+#ifdef __unix__
+                cout << "benchListing: Benchmark listing all cars in each output format." << endl;
+#endif
+                cout << "benchMultiGet: Benchmark batched car lookups against per-id lookups." << endl;
+                cout << "addBranch: Add a branch with its own database file." << endl;
+                cout << "listBranches: List branches and their database files." << endl;
+                cout << "searchFleet: Search available cars of a model across all branches." << endl;
+                cout << "fleetDues: Display total dues across all branches." << endl;
+                cout << "verifyBranches: Check fleet search, dues and writes to one branch over several scratch branch files." << endl;
+                cout << "useBranch: Add, update, delete and display cars, customers and employees in a branch's database (main for the main database)." << endl;
                 cout << "exit: Exit the program." << endl;
             }
             else if (command == "exit")
@@ -1806,22 +10168,38 @@ int main()
             cout << endl;
             cout << endl;
 
+            SessionTrace::checkpoint();
             cout << "Enter a command: (Type 'help' for commands list)" << endl;
-            cin >> command;
+            if (!(cin >> command))
+                break; // Input ended
+            RequestArena::Scope request; // Scratch memory for this command
+            Log::Context context(command.c_str());
+            // Rows of the branch the session works in are in the branch's own file
+            ShardRouter::Connection shard(shards, command == "useBranch" ? "" : branch);
+            if (shard.failed())
+                continue;
             cout << endl;
             cout << endl;
 
             if (command == "myDetails")
             {
-                CustomerDb::displayCustomer(id);
+                CustomerDb::displayCustomer(id, shard.handle());
             }
             else if (command == "rentCar")
             {
-                customer.rentCar();
+                customer.rentCar(shard.handle());
+            }
+            else if (command == "rentCart")
+            {
+                customer.rentCart(shard.handle());
             }
             else if (command == "returnCar")
             {
-                customer.returnCar();
+                customer.returnCar(shard.handle());
+            }
+            else if (command == "quoteReturn")
+            {
+                customer.quoteReturn();
             }
             else if (command == "clearDues")
             {
@@ -1829,12 +10207,28 @@ int main()
             }
             else if (command == "displayAvailableCars")
             {
-                manager.displayAvailableCars();
+                manager.displayAvailableCars(shard.handle());
+            }
+            else if (command == "findCar")
+            {
+                string line;
+                getline(cin, line);
+                CarDb::runFindCar(line);
+            }
+            else if (command == "nearest")
+            {
+                string line;
+                getline(cin, line);
+                CarDb::runNearest(line);
             }
             else if (command == "currentlyRentedCars")
             {
                 customer.browseRentedCars();
             }
+            else if (command == "useBranch")
+            {
+                shards.askBranch(branch);
+            }
             else if (command == "help")
             {
                 cout << endl;
@@ -1842,10 +10236,15 @@ int main()
                 cout << "-----------------" << endl;
                 cout << "myDetails: Display your details." << endl;
                 cout << "rentCar: Rent a car." << endl;
+                cout << "rentCart: Rent several cars, by ID or by model and quantity, all at once." << endl;
                 cout << "returnCar: Return a car." << endl;
+                cout << "quoteReturn: See what returning a car would cost, without returning it." << endl;
                 cout << "clearDues: Clear your dues." << endl;
                 cout << "displayAvailableCars: Display available cars." << endl;
+                cout << "findCar <text>: Find cars by model or year, e.g. findCar lambo." << endl;
+                cout << "nearest <model> <x> <y> <k>: Display the k available cars of a model (or *) closest to you, e.g. nearest ferrari 10 20 3." << endl;
                 cout << "currentlyRentedCars: Display currently rented cars." << endl;
+                cout << "useBranch: Rent, return and display cars and your details in a branch's database (main for the main database)." << endl;
                 cout << "exit: Exit the program." << endl;
             }
             else if (command == "exit")
@@ -1884,22 +10283,38 @@ int main()
         {
             cout << endl;
             cout << endl;
+            SessionTrace::checkpoint();
             cout << "Enter a command: (Type 'help' for commands list)" << endl;
-            cin >> command;
+            if (!(cin >> command))
+                break; // Input ended
+            RequestArena::Scope request; // Scratch memory for this command
+            Log::Context context(command.c_str());
+            // Rows of the branch the session works in are in the branch's own file
+            ShardRouter::Connection shard(shards, command == "useBranch" ? "" : branch);
+            if (shard.failed())
+                continue;
             cout << endl;
             cout << endl;
 
             if (command == "myDetails")
             {
-                EmployeeDb::displayEmployee(id);
+                EmployeeDb::displayEmployee(id, shard.handle());
             }
             else if (command == "rentCar")
             {
-                employee.rentCar();
+                employee.rentCar(shard.handle());
+            }
+            else if (command == "rentCart")
+            {
+                employee.rentCart(shard.handle());
             }
             else if (command == "returnCar")
             {
-                employee.returnCar();
+                employee.returnCar(shard.handle());
+            }
+            else if (command == "quoteReturn")
+            {
+                employee.quoteReturn();
             }
             else if (command == "clearDues")
             {
@@ -1907,12 +10322,32 @@ int main()
             }
             else if (command == "displayAvailableCars")
             {
-                manager.displayAvailableCars();
+                manager.displayAvailableCars(shard.handle());
+            }
+            else if (command == "searchCars")
+            {
+                manager.searchCars();
+            }
+            else if (command == "findCar")
+            {
+                string line;
+                getline(cin, line);
+                CarDb::runFindCar(line);
+            }
+            else if (command == "nearest")
+            {
+                string line;
+                getline(cin, line);
+                CarDb::runNearest(line);
             }
             else if (command == "currentlyRentedCars")
             {
                 employee.browseRentedCars();
             }
+            else if (command == "useBranch")
+            {
+                shards.askBranch(branch);
+            }
             else if (command == "help")
             {
                 cout << endl;
@@ -1920,10 +10355,16 @@ int main()
                 cout << "-----------------" << endl;
                 cout << "myDetails: Display your details." << endl;
                 cout << "rentCar: Rent a car." << endl;
+                cout << "rentCart: Rent several cars, by ID or by model and quantity, all at once." << endl;
                 cout << "returnCar: Return a car." << endl;
+                cout << "quoteReturn: See what returning a car would cost, without returning it." << endl;
                 cout << "clearDues: Clear your dues." << endl;
                 cout << "displayAvailableCars: Display available cars." << endl;
+                cout << "searchCars: Search cars by model, years, condition and availability." << endl;
+                cout << "findCar <text>: Find cars by model or year, e.g. findCar lambo." << endl;
+                cout << "nearest <model> <x> <y> <k>: Display the k available cars of a model (or *) closest to you, e.g. nearest ferrari 10 20 3." << endl;
                 cout << "currentlyRentedCars: Display currently rented cars." << endl;
+                cout << "useBranch: Rent, return and display cars and your details in a branch's database (main for the main database)." << endl;
                 cout << "exit: Exit the program." << endl;
             }
             else if (command == "exit")
@@ -1941,6 +10382,9 @@ int main()
         cout << "Invalid role." << endl;
     }
 
+    // Lets the next start load its indexes instead of scanning the tables
+    FleetSnapshot::save(db);
     sqlite3_close(db);
+    SessionTrace::stop();
     return 0;
 }
\ No newline at end of file